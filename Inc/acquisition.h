@@ -0,0 +1,98 @@
+#ifndef INC_ACQUISITION_H_
+#define INC_ACQUISITION_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Continuous ADC2 acquisition. ADC2 scans channel 3 (OPAMP2 output), optionally VREFINT and optionally channel 4
+ * in continuous mode; DMA writes into a circular buffer of two blocks. The DMA half/full transfer callback only
+ * sums the codes of a block; the float conversion, PGA ranging and the consumers run once per published sample.
+ * Channel 4 is dropped from the scan when the auxiliary input is disabled, which shortens the scan and raises the
+ * block rate.
+ *
+ * The block size sets the DMA interrupt rate: 64 scans is about 170 us in BALANCED without channel 4, 64 us in
+ * FAST and 1.6 ms in PRECISE. Longer blocks would take more RAM than the 12K allow: 1 ms blocks in FAST need a 4 KB buffer.
+ *
+ * Vdd changes far more slowly than flow. In ACQ_VREF_MODE_SLOW VREFINT is not part of the scan; it is converted as
+ * an injected channel every vref_period_ms and low pass filtered, and every sample is scaled with the filtered Vdd.
+ * ACQ_VREF_MODE_SCAN converts VREFINT in every scan and scales each sample with its own Vdd.
+ * */
+#define ACQ_SCAN_LENGTH_MAX		3											// Conversions per scan: channel 3, VREFINT, channel 4
+#define ACQ_BLOCK_SCANS			64											// Scans summed per block, 4^3
+#define ACQ_TIMEOUT_MS			2											// A sample older than this means acquisition has stalled
+#define ACQ_VREF_DEFAULT_PERIOD_MS	10										// Injected VREFINT conversion period
+#define ACQ_VDD_FILTER_SHIFT	6											// Vdd low pass filter, 1/64 of each VREFINT conversion
+#define ACQ_ADC_CLOCK_HZ		72000000UL									// ADC12 clock, PLL / 1
+
+/*
+ * Oversampling and decimation. 4^n channel 3 conversions are summed and shifted right by n, which gives 12 + n bits.
+ * One block is 64 = 4^3 scans, so n = 3 publishes every block and each extra bit decimates 4 blocks into one sample.
+ * */
+#define ACQ_OVERSAMPLE_BITS_MIN	3											// 15 bit, one block per sample
+#define ACQ_OVERSAMPLE_BITS_MAX	4											// 16 bit, 4 blocks per sample
+
+// VREFINT modes (MODBUS_REG_ACQ_VREF_MODE)
+#define ACQ_VREF_MODE_SCAN		0											// VREFINT in every scan
+#define ACQ_VREF_MODE_SLOW		1											// VREFINT injected at a low rate, filtered Vdd
+
+/*
+ * Acquisition profiles set sampling time, resolution, VREFINT mode and oversampling together. Channel 3 is driven by
+ * the OPAMP2 output, so it does not need the long sampling time a high impedance source would.
+ * PRECISE:  601.5 cycles, 12 bit, VREFINT in every scan (ratiometric), 16 bit oversampling
+ * BALANCED: 181.5 cycles, 12 bit, VREFINT injected, 15 bit oversampling
+ * FAST:      61.5 cycles, 10 bit, VREFINT injected, 13 bit oversampling
+ * Writing an individual setting (VREFINT mode, oversampling) switches to ACQ_PROFILE_CUSTOM.
+ * */
+#define ACQ_PROFILE_PRECISE		0
+#define ACQ_PROFILE_BALANCED	1
+#define ACQ_PROFILE_FAST		2
+#define ACQ_PROFILE_COUNT		3
+#define ACQ_PROFILE_CUSTOM		0xFF
+#define ACQ_NOISE_LSB_RMS		1.0f										// Assumed noise of a single conversion, LSB rms
+
+// Settings applied by an acquisition profile
+typedef struct AcquisitionProfile {
+	uint32_t	sampling_time;												// ADC_SAMPLETIME_x of the regular channels
+	uint16_t	sampling_cycles_x2;											// Sampling time in ADC cycles * 2
+	uint32_t	resolution;													// ADC_RESOLUTION_x
+	uint8_t		resolution_bits;
+	uint8_t		vref_mode;													// ACQ_VREF_MODE_x
+	uint8_t		oversample_bits;											// Extra bits from oversampling
+}AcquisitionProfile;
+
+// Block average published by the acquisition callbacks
+typedef struct AcquisitionSample {
+	float		channel_3;													// Channel 3 voltage referred to the OPAMP2 input, V
+	float		channel_4;													// Channel 4 voltage, V; 0 if channel 4 is not scanned
+	float		vdd;														// Vdd computed from VREFINT, V
+	uint16_t	channel_3_code;												// Decimated channel 3 ADC code at the OPAMP2 output, left aligned to 16 bits
+	uint32_t	sequence;													// Sample counter; 0 until the first sample is complete
+	uint32_t	tick;														// HAL tick when the sample was complete
+	uint32_t	timestamp_us;												// timebase_us() when the sample was complete
+}AcquisitionSample;
+
+// Acquisition API
+void acquisition_start(void);
+void acquisition_task(void);
+void acquisition_stop(void);
+void acquisition_resume(void);
+void acquisition_set_adc_calibration(uint32_t calfact);
+void acquisition_set_channel_4(bool enable);
+void acquisition_reconfigure(void);
+bool acquisition_get_sample(AcquisitionSample *sample);
+void acquisition_freeze_sample(bool freeze);
+bool acquisition_running(void);
+void acquisition_set_sample_hold(uint32_t hold_ms);
+float acquisition_sample_rate(void);
+float acquisition_scan_rate(void);
+float acquisition_noise_floor(void);
+uint16_t acquisition_full_scale(void);
+uint16_t acquisition_last_channel_3(void);
+bool acquisition_set_profile(uint8_t profile);
+float acquisition_get_vdd(void);
+bool acquisition_read_register(uint16_t reg, uint16_t *value);
+bool acquisition_write_register(uint16_t reg, uint16_t value);
+void acquisition_dma_irq_handler(void);
+
+#endif /* INC_ACQUISITION_H_ */
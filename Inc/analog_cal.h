@@ -0,0 +1,27 @@
+#ifndef INC_ANALOG_CAL_H_
+#define INC_ANALOG_CAL_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * OPAMP2 offset trims and ADC2 calibration factor. The values found by the self-calibrations are kept in the
+ * configuration store and reapplied at boot without calibrating again. Recalibration runs every period_min minutes;
+ * it stops the acquisition for ~30ms, so it is started right after a Modbus response, when the master is least likely
+ * to poll, or unconditionally once it is ANALOG_CAL_FORCE_DELAY_MS overdue.
+ * */
+#define ANALOG_CAL_DEFAULT_PERIOD_MIN	1440									// Recalibrate once a day
+#define ANALOG_CAL_FORCE_DELAY_MS		60000									// Run without a Modbus response after this delay
+
+// Status bits (MODBUS_REG_ANALOG_CAL_STATUS)
+#define ANALOG_CAL_STATUS_RESTORED		0x0001									// Stored values were applied at boot
+#define ANALOG_CAL_STATUS_FAILED		0x0002									// Last calibration failed; previous values kept
+
+// Analog calibration API
+void analog_cal_init(void);
+void analog_cal_task(bool response_sent);
+bool analog_cal_request(void);
+bool analog_cal_read_register(uint16_t reg, uint16_t *value);
+bool analog_cal_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_ANALOG_CAL_H_ */
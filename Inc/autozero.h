@@ -0,0 +1,50 @@
+#ifndef INC_AUTOZERO_H_
+#define INC_AUTOZERO_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Auto-zero tracking of the sensor zero offset. While the flow is known to be zero (valve closed input, Modbus
+ * write, or flow within the deadband for the hold time) the zero is re-estimated with a long time constant and
+ * the correction is slewed into get_flow(), so the output never jumps.
+ * */
+#define AUTOZERO_UPDATE_PERIOD_MS		100									// Estimator update period
+#define AUTOZERO_MAX_STEP_V				0.00005f							// Max change of applied correction per update (50uV)
+#define AUTOZERO_MAX_CORRECTION_V		0.030f								// Largest correction either way (30mV), fits the int16 uV registers
+#define AUTOZERO_HISTORY_SIZE			16									// Drift history entries
+#define AUTOZERO_HISTORY_PERIOD_MS		3600000UL							// Drift history sample period (1 hour)
+
+/*
+ * History timestamps are the low 16 bits of the minutes since boot and wrap after 65536 minutes (45.5 days). The
+ * whole history spans AUTOZERO_HISTORY_SIZE hours, so the age of an entry is the difference to the newest entry
+ * modulo 65536, never its plain value.
+ * */
+
+// Control bits (MODBUS_REG_AUTOZERO_CONTROL)
+#define AUTOZERO_CONTROL_ENABLE			0x0001								// Auto-zero engine enabled
+#define AUTOZERO_CONTROL_GPIO			0x0002								// Valve closed input (PB5, active low) is used
+
+// Status bits (MODBUS_REG_AUTOZERO_STATUS)
+#define AUTOZERO_STATUS_TRACKING		0x0001								// Zero is currently being re-estimated
+#define AUTOZERO_STATUS_VALVE_CLOSED	0x0002								// Valve closed signalled by GPIO or Modbus
+#define AUTOZERO_STATUS_QUIET			0x0004								// Flow within deadband for the hold time
+#define AUTOZERO_STATUS_LIMIT			0x0008								// Estimate beyond AUTOZERO_MAX_CORRECTION_V; re-zero the sensor
+
+// Drift history entry
+typedef struct AutozeroHistoryEntry {
+	uint16_t	minutes;													// Minutes since boot, modulo 65536
+	int16_t		drift_uv;													// Applied correction, uV
+}AutozeroHistoryEntry;
+
+// Auto-zero API
+void autozero_init(void);
+void autozero_accumulate(float voltage);
+void autozero_task(float zero_offset, float step_per_liter);
+void autozero_reset(void);
+float autozero_correction(void);
+void autozero_set_valve_closed(bool closed);
+bool autozero_read_register(uint16_t reg, uint16_t *value);
+bool autozero_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_AUTOZERO_H_ */
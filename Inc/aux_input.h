@@ -0,0 +1,26 @@
+#ifndef INC_AUX_INPUT_H_
+#define INC_AUX_INPUT_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Auxiliary analog input on ADC2 channel 4 (PA7), e.g. a second flow sensor or a pressure transmitter. Block
+ * averages from the acquisition are low pass filtered and scaled linearly between two input voltages. When the
+ * input is disabled channel 4 is removed from the ADC2 scan.
+ * */
+#define AUX_FILTER_SHIFT_MAX		10										// Longest filter, 1/1024 of the new block per block
+
+// Control bits (MODBUS_REG_AUX_CONTROL)
+#define AUX_CONTROL_ENABLE			0x0001									// Channel 4 is scanned
+
+// Auxiliary input API
+void aux_input_init(void);
+void aux_input_update(float voltage);
+bool aux_input_enabled(void);
+float aux_input_voltage(void);
+float aux_input_value(void);
+bool aux_input_read_register(uint16_t reg, uint16_t *value);
+bool aux_input_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_AUX_INPUT_H_ */
@@ -0,0 +1,41 @@
+#ifndef INC_CAPTURE_H_
+#define INC_CAPTURE_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Triggered capture of channel 3 at the full ADC2 rate ("scope mode"). Once armed, every channel 3 conversion (or
+ * the average of 2^divider_shift conversions) is written into a ring; after pre_samples have been collected the
+ * trigger is checked on each new value. When it fires, the ring keeps filling until it holds CAPTURE_SIZE values with
+ * the trigger at pre_samples, then freezes until the master has downloaded it and re-arms.
+ *
+ * Values are ADC codes at the OPAMP2 output: V = code * vdd_mv / full_scale / gain, all captured with the buffer.
+ * The acquisition callback only pays for one call per block while the capture is idle or frozen.
+ *
+ * RAM budget: the buffer takes CAPTURE_RAM_BUDGET of the 12K RAM, next to the trend rings (see trend.h).
+ * */
+#define CAPTURE_SIZE				1024									// Values in the buffer, power of 2
+#define CAPTURE_RAM_BUDGET			2048									// Bytes
+#define CAPTURE_SLOPE_SPAN			16										// Slope trigger compares values this far apart
+#define CAPTURE_DIVIDER_SHIFT_MAX	8
+
+// States (MODBUS_REG_CAPTURE_STATE)
+#define CAPTURE_STATE_IDLE			0										// Write to stop
+#define CAPTURE_STATE_ARMED			1										// Write to arm; filling pre-trigger values and waiting for the trigger
+#define CAPTURE_STATE_TRIGGERED		2										// Write to trigger now; filling post-trigger values
+#define CAPTURE_STATE_DONE			3										// Buffer frozen, ready for download
+
+// Trigger modes (MODBUS_REG_CAPTURE_TRIGGER_MODE)
+#define CAPTURE_TRIGGER_RISING		0										// Value crosses the level upwards
+#define CAPTURE_TRIGGER_FALLING		1										// Value crosses the level downwards
+#define CAPTURE_TRIGGER_SLOPE		2										// Value changes by the level within CAPTURE_SLOPE_SPAN values, either way
+
+// Capture API
+void capture_process_block(const uint16_t *block, uint8_t scan_length);
+void capture_abort(void);
+bool capture_active(void);
+bool capture_read_register(uint16_t reg, uint16_t *value);
+bool capture_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_CAPTURE_H_ */
@@ -0,0 +1,43 @@
+#ifndef INC_CLOCK_GOVERNOR_H_
+#define INC_CLOCK_GOVERNOR_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * SYSCLK governor. While the node is idle, SYSCLK is switched from the PLL (72 MHz) to HSE bypass (8 MHz). It
+ * switches back when a Modbus request starts arriving, and when a capture, re-zero or PGA calibration needs the
+ * speed. The governor runs first in every scheduler pass, so the clock is already back at 72 MHz when the request
+ * has been received.
+ *
+ * The PLL keeps running at 8 MHz SYSCLK: ADC2 is clocked by PLL / 1 asynchronously, so its conversion timing and
+ * the acquisition rates stay the same, and switching back does not wait for the PLL to lock. On each switch the
+ * flash latency, SystemCoreClock, the SysTick reload, the USART2 BRR and the TIM2 time base prescaler (PCLK1) are
+ * updated. USART1 runs from the HSI and is not affected.
+ *
+ * The interrupt load is part of the scheduler load. The clock is only lowered while the load measured at 72 MHz,
+ * scaled by 9, stays below CLOCK_GOV_UP_LOAD_PERMIL with margin, and raised when the load at 8 MHz exceeds it.
+ *
+ * The saving is estimated from the time at 8 MHz, the scheduler load and typical run and sleep currents of the
+ * STM32F303x8 at 3.3 V; adjust CLOCK_GOV_IDD_x for the board.
+ * */
+#define CLOCK_GOV_HOLD_MS			100										// Time idle after a demand before lowering the clock
+#define CLOCK_GOV_SETTLE_MS			2000									// Time at a clock before its load is trusted
+#define CLOCK_GOV_DOWN_LOAD_PERMIL	60										// Lower below this load at 72 MHz
+#define CLOCK_GOV_UP_LOAD_PERMIL	800										// Raise above this load at 8 MHz
+#define CLOCK_GOV_STATS_PERIOD_MS	10000									// Residency statistics window
+#define CLOCK_GOV_IDD_RUN_72_UA		26000									// Typical run current, from flash
+#define CLOCK_GOV_IDD_RUN_8_UA		4000
+#define CLOCK_GOV_IDD_SLEEP_72_UA	7000									// Typical sleep current
+#define CLOCK_GOV_IDD_SLEEP_8_UA	1200
+
+// Control bits (MODBUS_REG_CLK_CONTROL)
+#define CLOCK_GOV_CONTROL_ENABLE	0x0001									// Lower the clock while idle
+
+// Clock governor API
+void clock_governor_init(void);
+void clock_governor_task(void);
+bool clock_governor_read_register(uint16_t reg, uint16_t *value);
+bool clock_governor_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_CLOCK_GOVERNOR_H_ */
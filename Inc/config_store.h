@@ -0,0 +1,70 @@
+#ifndef INC_CONFIG_STORE_H_
+#define INC_CONFIG_STORE_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Persistent configuration store. Uses the last two 2K flash pages (see CONFIG region in STM32F303K8Tx_FLASH.ld).
+ * Records are appended to the active page; when it fills up the latest value of each key is copied to the other page.
+ * */
+#define CONFIG_PAGE_A_ADDRESS		0x0800F000UL
+#define CONFIG_PAGE_B_ADDRESS		0x0800F800UL
+#define CONFIG_PAGE_SIZE			FLASH_PAGE_SIZE
+
+// Configuration keys. Do not reorder - the key number is what is stored in flash
+typedef enum ConfigKey {
+	CONFIG_KEY_MODBUS_ADDRESS = 0,											// Modbus address used when the DIP switch is set to 0
+	CONFIG_KEY_BAUD_RATE,													// USART1 baud rate in bps
+	CONFIG_KEY_ZERO_OFFSET,													// Sensor zero offset in V (float)
+	CONFIG_KEY_STEP_PER_LITER,												// Sensor step per liter in V (float)
+	CONFIG_KEY_BOOT_MODE,													// BOOT_MODE_x
+	CONFIG_KEY_AUTOZERO_CONTROL,											// AUTOZERO_CONTROL_x bits
+	CONFIG_KEY_AUTOZERO_DEADBAND,											// Auto-zero deadband, flow units
+	CONFIG_KEY_AUTOZERO_HOLD_TIME,											// Auto-zero hold time, s
+	CONFIG_KEY_AUTOZERO_TAU,												// Auto-zero time constant, s
+	CONFIG_KEY_CAL_TEMPERATURE,												// MCU temperature at calibration, degC (float)
+	CONFIG_KEY_TEMPCO_ZERO,													// Zero temperature coefficient, uV/degC (int32)
+	CONFIG_KEY_TEMPCO_SPAN,													// Span temperature coefficient, ppm/degC (int32)
+	CONFIG_KEY_AUX_CONTROL,													// AUX_CONTROL_x bits
+	CONFIG_KEY_AUX_FILTER,													// Auxiliary input filter shift
+	CONFIG_KEY_AUX_ZERO_MV,													// Auxiliary input voltage at scale zero, mV
+	CONFIG_KEY_AUX_SPAN_MV,													// Auxiliary input voltage at full scale, mV
+	CONFIG_KEY_AUX_FULL_SCALE,												// Auxiliary input value at full scale (int32)
+	CONFIG_KEY_ACQ_VREF_MODE,												// ACQ_VREF_MODE_x
+	CONFIG_KEY_ACQ_VREF_PERIOD,												// Injected VREFINT period, ms
+	CONFIG_KEY_PGA_CONTROL,													// PGA_CONTROL_x bits
+	CONFIG_KEY_PGA_FIXED_GAIN,												// Gain index used without auto-ranging
+	CONFIG_KEY_PGA_MAX_GAIN,												// Highest gain index used by auto-ranging
+	CONFIG_KEY_PGA_CAL_2,													// Calibrated x2 gain (float)
+	CONFIG_KEY_PGA_CAL_4,													// Calibrated x4 gain (float)
+	CONFIG_KEY_PGA_CAL_8,													// Calibrated x8 gain (float)
+	CONFIG_KEY_PGA_CAL_16,													// Calibrated x16 gain (float)
+	CONFIG_KEY_OPAMP_TRIM,													// OPAMP2 TrimmingValueP | TrimmingValueN << 8
+	CONFIG_KEY_ADC_CALFACT,													// ADC2 single ended calibration factor
+	CONFIG_KEY_ANALOG_CAL_PERIOD,											// OPAMP2/ADC2 recalibration period, min
+	CONFIG_KEY_ACQ_OVERSAMPLE_BITS,											// Extra bits from oversampling, ACQ_OVERSAMPLE_BITS_MIN..MAX
+	CONFIG_KEY_ALARM_CONTROL,												// FLOW_ALARM_CONTROL_x bits
+	CONFIG_KEY_ALARM_LOW_MV,												// Analog watchdog low threshold, mV
+	CONFIG_KEY_ALARM_HIGH_MV,												// Analog watchdog high threshold, mV
+	CONFIG_KEY_ACQ_PROFILE,													// ACQ_PROFILE_x
+	CONFIG_KEY_LOG_CONTROL,													// FLOW_LOG_CONTROL_x bits
+	CONFIG_KEY_LP_PERIOD_MS,												// Sample period with STOP in between, 0 = off
+	CONFIG_KEY_CLOCK_GOV_CONTROL,											// CLOCK_GOV_CONTROL_x bits
+	CONFIG_KEY_PGA_OFFSET_2,												// x2 input offset relative to x1, V (float)
+	CONFIG_KEY_PGA_OFFSET_4,												// x4 input offset relative to x1, V (float)
+	CONFIG_KEY_PGA_OFFSET_8,												// x8 input offset relative to x1, V (float)
+	CONFIG_KEY_PGA_OFFSET_16,												// x16 input offset relative to x1, V (float)
+	CONFIG_KEY_COUNT
+}ConfigKey;
+
+// Configuration store API
+void config_store_init(void);
+bool config_get(ConfigKey key, uint32_t *value);
+bool config_get_float(ConfigKey key, float *value);
+bool config_set(ConfigKey key, uint32_t value);
+bool config_set_float(ConfigKey key, float value);
+uint32_t config_store_generation(void);
+uint16_t config_store_free_records(void);
+
+#endif /* INC_CONFIG_STORE_H_ */
@@ -0,0 +1,71 @@
+#ifndef INC_FAULT_RECORD_H_
+#define INC_FAULT_RECORD_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Crash record. The fault handlers and Error_Handler() save the stacked registers, the fault status registers and a
+ * short backtrace to a .noinit RAM section and reset the MCU at once, instead of hanging until the IWDG expires. The
+ * record survives the reset and is read over Modbus; it is only lost on a power cycle, when the magic or checksum do
+ * not match. With a debugger attached the core halts on a breakpoint before the reset.
+ *
+ * The backtrace is a stack scan: the first FAULT_RECORD_BACKTRACE words above the exception frame that hold a Thumb
+ * address inside the code in flash. These are usually return addresses, newest first, but may include stale values.
+ * */
+#define FAULT_RECORD_MAGIC			0xFA017EC0UL
+#define FAULT_RECORD_BACKTRACE		4										// Code addresses found on the stack
+#define FAULT_RECORD_SCAN_WORDS		64										// Stack words searched for them
+
+// Fault types (MODBUS_REG_FAULT_TYPE); plain numbers, as they are also used in the handler assembly
+#define FAULT_TYPE_NONE				0
+#define FAULT_TYPE_HARD				1										// HardFault
+#define FAULT_TYPE_MEMMANAGE		2										// MemManage: MPU or execute-never
+#define FAULT_TYPE_BUS				3										// BusFault
+#define FAULT_TYPE_USAGE			4										// UsageFault
+#define FAULT_TYPE_ERROR_HANDLER	5										// Error_Handler(); pc is the caller
+
+// Record in .noinit RAM. Register values are those stacked on exception entry
+typedef struct FaultRecord {
+	uint32_t	magic;
+	uint32_t	type;
+	uint32_t	count;														// Faults since power-on
+	uint32_t	r0;
+	uint32_t	r1;
+	uint32_t	r2;
+	uint32_t	r3;
+	uint32_t	r12;
+	uint32_t	lr;
+	uint32_t	pc;
+	uint32_t	xpsr;
+	uint32_t	cfsr;
+	uint32_t	hfsr;
+	uint32_t	mmfar;
+	uint32_t	bfar;
+	uint32_t	sp;															// Before the exception
+	uint32_t	exc_return;
+	uint32_t	backtrace[FAULT_RECORD_BACKTRACE];
+	uint32_t	check;														// ~sum of the words above
+}FaultRecord;
+
+#define FAULT_RECORD_STRING(x)		#x
+#define FAULT_RECORD_TYPE(x)		FAULT_RECORD_STRING(x)
+
+// Body of a naked fault handler: pass the stack frame in use, EXC_RETURN and the type to fault_record_save()
+#define FAULT_RECORD_ENTRY(type)	__ASM volatile(									\
+		"tst lr, #4\n"																\
+		"ite eq\n"																	\
+		"mrseq r0, msp\n"															\
+		"mrsne r0, psp\n"															\
+		"mov r1, lr\n"																\
+		"movs r2, #" FAULT_RECORD_TYPE(type) "\n"									\
+		"b fault_record_save\n")
+
+// Fault record API
+void fault_record_init(void);
+void fault_record_save(const uint32_t *frame, uint32_t exc_return, uint32_t type) __attribute__((noreturn));
+void fault_record_error(uint32_t caller) __attribute__((noreturn));
+bool fault_record_read_register(uint16_t reg, uint16_t *value);
+bool fault_record_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_FAULT_RECORD_H_ */
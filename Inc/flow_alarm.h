@@ -0,0 +1,39 @@
+#ifndef INC_FLOW_ALARM_H_
+#define INC_FLOW_ALARM_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Hardware flow alarm on the ADC2 analog watchdog 1, watching channel 3. A conversion outside the window raises
+ * the ADC interrupt, which latches the alarm, drives ALARM_OUT (PB6) high if enabled and disarms the watchdog
+ * interrupt; nothing is polled. Writing the status register acknowledges the alarm and re-arms the watchdog.
+ * Thresholds are voltages at the ADC input (OPAMP2 output): with PGA gain g in use, the window seen at the sensor
+ * is divided by g. The low threshold default matches the 0.5V sensor disconnect check of the calibration.
+ *
+ * While the PGA is auto-ranging (PGA_CONTROL_AUTO) the high threshold is ignored. The watchdog checks every
+ * conversion but the gain only steps down once per sample, so at gain > 1 a rising flow crosses the high threshold
+ * at an input far below the real limit. Rescaling TR1 on every gain change would mean stopping ADC2 in the middle
+ * of the DMA stream. The low threshold stays armed: a disconnected sensor reads near 0 V at any gain.
+ * */
+#define FLOW_ALARM_DEFAULT_LOW_MV		500									// Sensor disconnected below this
+#define FLOW_ALARM_DEFAULT_HIGH_MV		3200								// Over-flow / saturation above this
+
+// Control bits (MODBUS_REG_ALARM_CONTROL)
+#define FLOW_ALARM_CONTROL_ENABLE		0x0001								// Analog watchdog enabled
+#define FLOW_ALARM_CONTROL_GPIO			0x0002								// ALARM_OUT follows the latched alarm
+
+// Status bits (MODBUS_REG_ALARM_STATUS)
+#define FLOW_ALARM_STATUS_LATCHED		0x0001								// Channel 3 left the window; write to acknowledge
+#define FLOW_ALARM_STATUS_HIGH			0x0002								// Conversion was above the high threshold
+#define FLOW_ALARM_STATUS_LOW			0x0004								// Conversion was below the low threshold
+
+// Flow alarm API
+void flow_alarm_init(void);
+void flow_alarm_configure(void);
+bool flow_alarm_latched(void);
+uint16_t flow_alarm_events(void);
+bool flow_alarm_read_register(uint16_t reg, uint16_t *value);
+bool flow_alarm_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_FLOW_ALARM_H_ */
@@ -0,0 +1,62 @@
+#ifndef INC_FLOW_LOG_H_
+#define INC_FLOW_LOG_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Append-only flow log in flash (see LOG region in STM32F303K8Tx_FLASH.ld). Records hold the 1 minute trend
+ * aggregates and selected events, each with a sequence number and a CRC written last, so a record torn by a power
+ * loss is skipped when the log is scanned at boot. The pages are used as a ring; the page after the one being
+ * written is kept erased, so appending never has to wait for an erase and the oldest page is given up one at a time.
+ *
+ * The CPU stalls while flash is programmed (~0.5ms per record) or erased (~40ms per page). Records are queued in
+ * RAM and written in the gap after a Modbus response has been sent, when the master is not talking to this node; if
+ * the bus stays busy or silent they are written anyway after FLOW_LOG_FORCE_DELAY_MS, between frames.
+ *
+ * The vector table and most interrupt handlers are in flash, so USART1 is not served during an erase and a request
+ * arriving then overruns the receiver. An erase therefore also waits until nothing has been received, for any node,
+ * for the receiver timeout plus FLOW_LOG_ERASE_QUIET_FRAMES request frame times. This only lowers the risk: a master
+ * that starts polling again right after such a pause still loses the request, and retries it. If the bus never
+ * pauses that long the erase waits, the queue fills and new records are dropped (MODBUS_REG_LOG_DROPPED).
+ *
+ * At one record per minute a page holds 85 minutes and each page is erased about every 6 hours, well within the
+ * flash endurance.
+ * */
+#define FLOW_LOG_START_ADDRESS		0x0800D000UL
+#define FLOW_LOG_PAGES				4
+#define FLOW_LOG_PAGE_SIZE			FLASH_PAGE_SIZE
+#define FLOW_LOG_QUEUE_SIZE			8										// Records waiting for a write window
+#define FLOW_LOG_FORCE_DELAY_MS		5000									// Longest a record waits for a window
+#define FLOW_LOG_WINDOW_RECORDS		10										// Records in the Modbus read window
+#define FLOW_LOG_ERASE_QUIET_FRAMES	4										// Bus silence before an erase, frame times after the receiver timeout
+
+// Control bits (MODBUS_REG_LOG_CONTROL)
+#define FLOW_LOG_CONTROL_AGGREGATES	0x0001									// Log the 1 minute trend aggregates
+#define FLOW_LOG_CONTROL_EVENTS		0x0002									// Log boot, re-zero and alarm events
+
+// Record types
+#define FLOW_LOG_TYPE_MINUTE		1										// Data: min, max, mean flow * 1000
+#define FLOW_LOG_TYPE_BOOT			2										// Data: RCC_CSR reset flags
+#define FLOW_LOG_TYPE_REZERO		3										// Data: zero offset, uV; step per liter, uV
+#define FLOW_LOG_TYPE_ALARM			4										// Data: alarm events since boot
+
+// Log record. The CRC covers the record with the CRC field erased
+typedef struct FlowLogRecord {
+	uint32_t	sequence;
+	uint16_t	type;														// FLOW_LOG_TYPE_x
+	uint16_t	crc;
+	uint32_t	uptime_s;													// Seconds since boot
+	int32_t		data[3];
+}FlowLogRecord;
+
+#define FLOW_LOG_RECORDS_PER_PAGE	(FLOW_LOG_PAGE_SIZE / sizeof(FlowLogRecord))
+
+// Flow log API
+void flow_log_init(void);
+void flow_log_append(uint16_t type, int32_t data_0, int32_t data_1, int32_t data_2);
+void flow_log_task(bool response_sent);
+bool flow_log_read_register(uint16_t reg, uint16_t *value);
+bool flow_log_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_FLOW_LOG_H_ */
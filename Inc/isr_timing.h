@@ -0,0 +1,36 @@
+#ifndef INC_ISR_TIMING_H_
+#define INC_ISR_TIMING_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Interrupt timing in core clock cycles, to compare hot code in CCMRAM with the same build in flash
+ * (CCMRAM_DISABLE, see main.h). The SysTick entry latency is read from the SysTick counter: the cycles from the
+ * counter reload to the first statement of the handler, which includes stacking, the vector fetch and the handler
+ * prologue; it is longer when the core wakes from WFI. The other entries time the whole handler with DWT->CYCCNT.
+ * Cycle counts are lower while the clock governor runs the core at 8 MHz with no flash wait states.
+ *
+ * Comparison: flash each build, write any register of each entry to reset its min/max, poll the device at a fixed
+ * rate with the core at 72 MHz, then read the min/max of each entry. No before/after numbers are recorded here yet; the
+ * two builds have not been measured on hardware.
+ * */
+#define ISR_TIMING_TICK_LATENCY		0										// SysTick entry latency
+#define ISR_TIMING_DMA_ADC2			1										// DMA1 channel 2: ADC2 block processing
+#define ISR_TIMING_USART1			2										// USART1: Modbus RX/TX
+#define ISR_TIMING_ADC				3										// ADC1/2: analog watchdog
+#define ISR_TIMING_COUNT			4
+
+// Timing of one interrupt, cycles
+typedef struct IsrTiming {
+	uint16_t	last;
+	uint16_t	min;
+	uint16_t	max;
+}IsrTiming;
+
+// ISR timing API
+void isr_timing_record(uint8_t isr, uint32_t cycles);
+bool isr_timing_read_register(uint16_t reg, uint16_t *value);
+bool isr_timing_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_ISR_TIMING_H_ */
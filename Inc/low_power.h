@@ -0,0 +1,46 @@
+#ifndef INC_LOW_POWER_H_
+#define INC_LOW_POWER_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * STOP mode between slow samples. With a sample period set, acquisition runs in bursts: ADC2 is started, the next
+ * sample is published, ADC2 is stopped and the core enters STOP (PLL, HSE and SysTick off, low power regulator)
+ * until the next sample is due. STOP replaces the scheduler WFI only while nothing else needs the core: no Modbus
+ * traffic or pending request, no re-zero, PGA calibration or armed capture. Queued flash log records stay in RAM
+ * and are written in one of the awake periods once they are due.
+ *
+ * Wake-up sources:
+ * - RTC wake-up timer (EXTI line 20), clocked by the LSI. Each STOP lasts at most LOW_POWER_MAX_STOP_MS so the
+ *   main loop refreshes the independent watchdog, which keeps running in STOP.
+ * - USART1 start bit (EXTI line 25). USART1 is clocked by the HSI, which keeps receiving in STOP, so the first
+ *   byte of a request is not lost. Interrupts are enabled as soon as the core wakes, still on the HSI, so the
+ *   following bytes are read while the PLL locks.
+ *
+ * The RTC calendar is not used as a clock: its sub-second counter measures the time spent in STOP, which is added
+ * to the HAL tick. The LSI is only accurate to tens of percent, so its frequency is measured against the HAL tick
+ * (HSE) for LOW_POWER_CAL_WINDOW_MS before the first STOP and again every LOW_POWER_RECAL_PERIOD_MS.
+ *
+ * The wake-up latency runs from the wake-up event to the switch back to the run clock. The STOP exit before the first
+ * instruction is not visible to the core and is counted as LOW_POWER_STOP_EXIT_US; the rest runs on the HSI and is
+ * counted in DWT cycles at HSI_VALUE.
+ *
+ * Between samples the analog watchdog alarm does not see the flow, and flow readings return the last sample.
+ * */
+#define LOW_POWER_MIN_PERIOD_MS		20										// Shortest sample period with STOP in between
+#define LOW_POWER_MAX_PERIOD_MS		60000
+#define LOW_POWER_MIN_STOP_MS		5										// Less time to the next sample is spent in WFI
+#define LOW_POWER_MAX_STOP_MS		250										// Longest STOP, well within the IWDG timeout
+#define LOW_POWER_CAL_WINDOW_MS		1000									// LSI measurement window
+#define LOW_POWER_RECAL_PERIOD_MS	600000UL								// LSI measurement repeated every 10 minutes
+#define LOW_POWER_STATS_PERIOD_MS	10000									// Residency statistics window
+
+// Low power API
+void low_power_init(void);
+bool low_power_idle(uint32_t *stopped_ms);
+void RTC_WKUP_IRQHandler(void);
+bool low_power_read_register(uint16_t reg, uint16_t *value);
+bool low_power_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_LOW_POWER_H_ */
@@ -29,6 +29,7 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 #include <stm32f3xx_hal.h>
+#include <stdbool.h>
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
@@ -42,11 +43,31 @@ extern "C" {
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
+// Calibration status bits
+#define CAL_STATUS_VALID			0x0001							// Calibration available; flow can be computed
+#define CAL_STATUS_CACHED			0x0002							// Calibration loaded from the configuration store
+#define CAL_STATUS_REZERO_BUSY		0x0004							// Background re-zero in progress
+#define CAL_STATUS_REZERO_FAILED	0x0008							// Last re-zero failed (ADC timeout or sensor voltage too low)
+
+// Boot modes
+#define BOOT_MODE_CALIBRATE			0								// Run self_calibration() at boot; use cached calibration if it fails
+#define BOOT_MODE_CACHED			1								// Use cached calibration; only calibrate if none is stored
 
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
+/*
+ * Hot code in CCMRAM: interrupt handlers and the per-block kernels run from the 4K CCM SRAM with zero wait states
+ * instead of flash with FLASH_LATENCY_2. The startup code copies the .ccmram section down from flash; calls between
+ * flash and CCMRAM go through linker veneers. Define CCMRAM_DISABLE to build everything into flash and compare the
+ * ISR timing registers (isr_timing.h). CCMRAM is not reachable by DMA, so DMA buffers stay in RAM.
+ * */
+#ifndef CCMRAM_DISABLE
+#define CCMRAM_FUNC		__attribute__((section(".ccmram.text"), noinline))
+#else
+#define CCMRAM_FUNC
+#endif
 
 /* USER CODE END EM */
 
@@ -54,6 +75,15 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+int16_t get_flow(void);
+int32_t get_flow_milli(void);
+bool get_flow_scale(float *zero, float *span);
+uint16_t get_calibration_status(void);
+bool start_rezero(void);
+uint32_t get_boot_ready_time_us(void);
+uint32_t get_first_response_time_ms(void);
+uint32_t get_flow_timestamp_us(void);
+uint32_t get_response_latency_us(void);
 
 /* USER CODE END EFP */
 
@@ -82,6 +112,10 @@ void Error_Handler(void);
 #define LD3_GPIO_Port GPIOB
 #define ADXL_INT1_Pin GPIO_PIN_1
 #define ADXL_INT1_GPIO_Port GPIOA
+#define VALVE_CLOSED_Pin GPIO_PIN_5
+#define VALVE_CLOSED_GPIO_Port GPIOB
+#define ALARM_OUT_Pin GPIO_PIN_6
+#define ALARM_OUT_GPIO_Port GPIOB
 /* USER CODE BEGIN Private defines */
 
 /* USER CODE END Private defines */
@@ -0,0 +1,259 @@
+#ifndef INC_MODBUS_REGISTERS_H_
+#define INC_MODBUS_REGISTERS_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Modbus register map. Function codes 0x03 and 0x04 read the same register space; 0x06 writes to it.
+ * 32-bit values occupy two registers, high word first.
+ * */
+
+// Measurement
+#define MODBUS_REG_FLOW						0x0001						// R   int16 flow
+#define MODBUS_REG_FLOW_MILLI				0x0002						// R   int32 flow / 1000; 0x80000000 if not valid
+#define MODBUS_REG_FLOW_TIMESTAMP_US		0x0004						// R   uint32 time base timestamp of the sample behind the flow, us;
+																		//     read in the same request as the flow for a matching pair
+#define MODBUS_REG_TIME_US					0x0006						// R   uint32 time base, us (see timebase.h)
+
+// Boot and calibration
+#define MODBUS_REG_CAL_STATUS				0x0010						// R   CAL_STATUS_x bits
+#define MODBUS_REG_BOOT_MODE				0x0011						// R/W BOOT_MODE_x, applied at next boot
+#define MODBUS_REG_COMMAND					0x0012						// W   MODBUS_COMMAND_x; reads as 0
+#define MODBUS_REG_BOOT_READY_US			0x0013						// R   uint32 time from reset to main loop, us
+#define MODBUS_REG_FIRST_RESPONSE_MS		0x0015						// R   uint32 time from reset to first response, ms; 0 until then
+#define MODBUS_REG_RESPONSE_LATENCY_US		0x0017						// R   end of the previous request frame to its response, us
+
+// Commands written to MODBUS_REG_COMMAND
+#define MODBUS_COMMAND_REZERO				0x0001						// Start background re-zero; flow must be zero
+#define MODBUS_COMMAND_PGA_CALIBRATE		0x0002						// Start OPAMP2 gain calibration; input must be steady
+#define MODBUS_COMMAND_ANALOG_CALIBRATE		0x0003						// Recalibrate OPAMP2 offset and ADC2 now
+#define MODBUS_COMMAND_PGA_CALIBRATE_2		0x0004						// Second point of the OPAMP2 calibration; steady input at another level
+
+// Auto-zero (see autozero.h)
+#define MODBUS_REG_AUTOZERO_BASE			0x0030
+#define MODBUS_REG_AUTOZERO_CONTROL			0x0030						// R/W AUTOZERO_CONTROL_x bits
+#define MODBUS_REG_AUTOZERO_VALVE_CLOSED	0x0031						// R/W valve closed signal, 1 = closed
+#define MODBUS_REG_AUTOZERO_DEADBAND		0x0032						// R/W zero flow deadband, flow units
+#define MODBUS_REG_AUTOZERO_HOLD_TIME		0x0033						// R/W time within deadband before tracking, s; 0 = off
+#define MODBUS_REG_AUTOZERO_TAU				0x0034						// R/W estimator time constant, s
+#define MODBUS_REG_AUTOZERO_STATUS			0x0035						// R   AUTOZERO_STATUS_x bits
+#define MODBUS_REG_AUTOZERO_CORRECTION_UV	0x0036						// R   int16 applied zero correction, uV
+#define MODBUS_REG_AUTOZERO_HISTORY_COUNT	0x0037						// R   number of drift history entries
+#define MODBUS_REG_AUTOZERO_HISTORY			0x0038						// R   history, newest first: minutes since boot mod 65536, int16 correction uV
+#define MODBUS_REG_AUTOZERO_END				0x0058
+
+// Temperature compensation (see temperature.h)
+#define MODBUS_REG_TEMPERATURE_BASE			0x0060
+#define MODBUS_REG_TEMPERATURE				0x0060						// R   int16 MCU temperature, 0.01 degC
+#define MODBUS_REG_TEMPERATURE_CAL			0x0061						// R   int16 temperature at calibration, 0.01 degC
+#define MODBUS_REG_TEMPERATURE_TEMPCO_ZERO	0x0062						// R/W int16 zero coefficient, uV/degC
+#define MODBUS_REG_TEMPERATURE_TEMPCO_SPAN	0x0063						// R/W int16 span coefficient, ppm/degC
+#define MODBUS_REG_TEMPERATURE_ZERO_SHIFT_UV	0x0064					// R   int16 zero shift applied, uV
+#define MODBUS_REG_TEMPERATURE_END			0x0065
+
+// Auxiliary analog input on channel 4 (see aux_input.h)
+#define MODBUS_REG_AUX_BASE					0x0070
+#define MODBUS_REG_AUX_CONTROL				0x0070						// R/W AUX_CONTROL_x bits
+#define MODBUS_REG_AUX_FILTER				0x0071						// R/W low pass filter shift, 0 = off
+#define MODBUS_REG_AUX_ZERO_MV				0x0072						// R/W input voltage at scale zero, mV
+#define MODBUS_REG_AUX_SPAN_MV				0x0073						// R/W input voltage at full scale, mV
+#define MODBUS_REG_AUX_FULL_SCALE			0x0074						// R/W int16 value at full scale
+#define MODBUS_REG_AUX_VOLTAGE				0x0075						// R   filtered input voltage, 0.1 mV
+#define MODBUS_REG_AUX_VALUE				0x0076						// R   int16 scaled value
+#define MODBUS_REG_AUX_END					0x0077
+
+// Acquisition (see acquisition.h)
+#define MODBUS_REG_ACQ_BASE					0x0080
+#define MODBUS_REG_ACQ_VREF_MODE			0x0080						// R/W ACQ_VREF_MODE_x
+#define MODBUS_REG_ACQ_VREF_PERIOD_MS		0x0081						// R/W injected VREFINT period, ms
+#define MODBUS_REG_ACQ_VDD_MV				0x0082						// R   Vdd used for the latest block, mV
+#define MODBUS_REG_ACQ_SCAN_LENGTH			0x0083						// R   conversions per ADC2 scan
+#define MODBUS_REG_ACQ_OVERSAMPLE_BITS		0x0084						// R/W extra bits from oversampling, 2..4 (14..16 bit)
+#define MODBUS_REG_ACQ_SAMPLE_RATE_HZ		0x0085						// R   published sample rate, Hz
+#define MODBUS_REG_ACQ_CH3_CODE				0x0086						// R   decimated channel 3 code, full 16-bit scale
+#define MODBUS_REG_ACQ_CH3_UV				0x0087						// R   uint32 channel 3 input voltage, uV
+#define MODBUS_REG_ACQ_PROFILE				0x0089						// R/W ACQ_PROFILE_x; 0xFF = custom
+#define MODBUS_REG_ACQ_RESOLUTION_BITS		0x008A						// R   ADC resolution of the profile, bits
+#define MODBUS_REG_ACQ_SAMPLING_CYCLES_X2	0x008B						// R   sampling time of the profile, ADC cycles * 2
+#define MODBUS_REG_ACQ_NOISE_FLOOR_UV		0x008C						// R   expected channel 3 noise floor, uV rms
+#define MODBUS_REG_ACQ_END					0x008D
+
+// OPAMP2 gain ranging (see pga.h). Gains are 1, 2, 4, 8 or 16
+#define MODBUS_REG_PGA_BASE					0x0090
+#define MODBUS_REG_PGA_CONTROL				0x0090						// R/W PGA_CONTROL_x bits
+#define MODBUS_REG_PGA_FIXED_GAIN			0x0091						// R/W gain used without auto-ranging
+#define MODBUS_REG_PGA_MAX_GAIN				0x0092						// R/W highest gain used by auto-ranging
+#define MODBUS_REG_PGA_GAIN					0x0093						// R   gain in use
+#define MODBUS_REG_PGA_STATUS				0x0094						// R   PGA_STATUS_x bits
+#define MODBUS_REG_PGA_SWITCHES				0x0095						// R   gain changes since boot
+#define MODBUS_REG_PGA_CAL_PPM				0x0096						// R   int16 gain error of x2, x4, x8, x16, ppm
+#define MODBUS_REG_PGA_CAL_OFFSET_UV		0x009A						// R   int16 input offset of x2, x4, x8, x16 relative to x1, uV
+#define MODBUS_REG_PGA_END					0x009E
+
+// OPAMP2 / ADC2 self-calibration (see analog_cal.h)
+#define MODBUS_REG_ANALOG_CAL_BASE			0x00A0
+#define MODBUS_REG_ANALOG_CAL_PERIOD_MIN	0x00A0						// R/W recalibration period, min; 0 = off
+#define MODBUS_REG_ANALOG_CAL_STATUS		0x00A1						// R   ANALOG_CAL_STATUS_x bits
+#define MODBUS_REG_ANALOG_CAL_RUNS			0x00A2						// R   calibrations since boot
+#define MODBUS_REG_ANALOG_CAL_DURATION_MS	0x00A3						// R   duration of the last calibration, ms
+#define MODBUS_REG_ANALOG_CAL_OPAMP_TRIM_P	0x00A4						// R   OPAMP2 PMOS offset trim
+#define MODBUS_REG_ANALOG_CAL_OPAMP_TRIM_N	0x00A5						// R   OPAMP2 NMOS offset trim
+#define MODBUS_REG_ANALOG_CAL_ADC_CALFACT	0x00A6						// R   ADC2 calibration factor
+#define MODBUS_REG_ANALOG_CAL_END			0x00A7
+
+// Flow alarm on the ADC2 analog watchdog (see flow_alarm.h)
+#define MODBUS_REG_ALARM_BASE				0x00B0
+#define MODBUS_REG_ALARM_CONTROL			0x00B0						// R/W FLOW_ALARM_CONTROL_x bits
+#define MODBUS_REG_ALARM_LOW_MV				0x00B1						// R/W low threshold at the ADC input, mV
+#define MODBUS_REG_ALARM_HIGH_MV			0x00B2						// R/W high threshold at the ADC input, mV; ignored while the PGA auto-ranges
+#define MODBUS_REG_ALARM_STATUS				0x00B3						// R/W FLOW_ALARM_STATUS_x bits; write to acknowledge
+#define MODBUS_REG_ALARM_EVENTS				0x00B4						// R   alarms since boot
+#define MODBUS_REG_ALARM_END				0x00B5
+
+// Flow statistics since the previous read (see statistics.h). 32-bit values, high word first; flow values * 1000,
+// 0x80000000 if uncalibrated or no samples
+#define MODBUS_REG_STATS_BASE				0x00C0
+#define MODBUS_REG_STATS_COUNT				0x00C0						// R   samples in the interval; reading the high word starts a new interval
+#define MODBUS_REG_STATS_INTERVAL_MS		0x00C2						// R   interval length, ms
+#define MODBUS_REG_STATS_MEAN_MILLI			0x00C4						// R   mean flow * 1000
+#define MODBUS_REG_STATS_MIN_MILLI			0x00C6						// R   minimum flow * 1000
+#define MODBUS_REG_STATS_MAX_MILLI			0x00C8						// R   maximum flow * 1000
+#define MODBUS_REG_STATS_STDDEV_MILLI		0x00CA						// R   flow standard deviation * 1000 (variance = stddev^2)
+#define MODBUS_REG_STATS_END				0x00CC
+
+// Flow trend (see trend.h). Entries are read from the entry windows below
+#define MODBUS_REG_TREND_BASE				0x00D0
+#define MODBUS_REG_TREND_COUNT_SECONDS		0x00D0						// R   valid 1 s entries
+#define MODBUS_REG_TREND_COUNT_MINUTES		0x00D1						// R   valid 1 min entries
+#define MODBUS_REG_TREND_COUNT_HOURS		0x00D2						// R   valid 1 h entries
+#define MODBUS_REG_TREND_SEQUENCE_SECONDS	0x00D3						// R   1 s entries since boot, wraps; shows how far the newest entry has moved
+#define MODBUS_REG_TREND_SEQUENCE_MINUTES	0x00D4						// R   1 min entries since boot, wraps
+#define MODBUS_REG_TREND_SEQUENCE_HOURS		0x00D5						// R   1 h entries since boot, wraps
+#define MODBUS_REG_TREND_END				0x00D6
+
+// Flash flow log (see flow_log.h). Records are read from the record window below
+#define MODBUS_REG_LOG_BASE					0x00E0
+#define MODBUS_REG_LOG_CONTROL				0x00E0						// R/W FLOW_LOG_CONTROL_x bits
+#define MODBUS_REG_LOG_FIRST_SEQUENCE		0x00E1						// R   oldest record in flash, 0xFFFFFFFF if empty (2 registers)
+#define MODBUS_REG_LOG_NEXT_SEQUENCE		0x00E3						// R   sequence of the next record (2 registers)
+#define MODBUS_REG_LOG_READ_SEQUENCE		0x00E5						// R/W first record of the read window; write high word, then low word (2 registers)
+#define MODBUS_REG_LOG_PENDING				0x00E7						// R   records waiting in RAM for a flash write
+#define MODBUS_REG_LOG_DROPPED				0x00E8						// R   records lost because the RAM queue was full
+#define MODBUS_REG_LOG_END					0x00E9
+
+// Triggered channel 3 capture (see capture.h). Values are read from the data window below
+#define MODBUS_REG_CAPTURE_BASE				0x00F0
+#define MODBUS_REG_CAPTURE_STATE			0x00F0						// R/W CAPTURE_STATE_x; write ARMED to arm, TRIGGERED to trigger now, IDLE to stop
+#define MODBUS_REG_CAPTURE_TRIGGER_MODE		0x00F1						// R/W CAPTURE_TRIGGER_x
+#define MODBUS_REG_CAPTURE_TRIGGER_MV		0x00F2						// R/W trigger level, or change for the slope trigger, mV at the ADC input
+#define MODBUS_REG_CAPTURE_PRE_SAMPLES		0x00F3						// R/W values kept before the trigger
+#define MODBUS_REG_CAPTURE_DIVIDER_SHIFT	0x00F4						// R/W each value averages 2^n conversions
+#define MODBUS_REG_CAPTURE_SAMPLE_RATE_HZ	0x00F5						// R   value rate of the capture (2 registers, high word first)
+#define MODBUS_REG_CAPTURE_COUNT			0x00F7						// R   values collected
+#define MODBUS_REG_CAPTURE_TRIGGER_INDEX	0x00F8						// R   position of the trigger in the buffer
+#define MODBUS_REG_CAPTURE_FULL_SCALE		0x00F9						// R   ADC full scale code of the capture
+#define MODBUS_REG_CAPTURE_VDD_MV			0x00FA						// R   Vdd when armed, mV
+#define MODBUS_REG_CAPTURE_GAIN				0x00FB						// R   OPAMP2 gain at the trigger
+#define MODBUS_REG_CAPTURE_END				0x00FC
+
+// Configuration store. Address and baud rate take effect after reset
+#define MODBUS_REG_CFG_MODBUS_ADDRESS		0x0100						// R/W address used when the DIP switch is set to 0 (1..247)
+#define MODBUS_REG_CFG_BAUD_RATE			0x0101						// R/W USART1 baud rate / 100 (e.g. 96 for 9600)
+#define MODBUS_REG_CFG_STORE_GENERATION		0x0102						// R   number of store compactions
+#define MODBUS_REG_CFG_STORE_FREE			0x0103						// R   free records in the active store page
+
+// Main loop scheduler (see scheduler.h)
+#define MODBUS_REG_SCHED_BASE				0x0110
+#define MODBUS_REG_SCHED_LOAD_PERMIL		0x0110						// R   time awake in the last second, 1/1000
+#define MODBUS_REG_SCHED_WAKEUPS			0x0111						// R   wake-ups from WFI in the last second
+#define MODBUS_REG_SCHED_OVERRUNS			0x0112						// R   task deadline overruns since boot
+#define MODBUS_REG_SCHED_LAST_OVERRUN_TASK	0x0113						// R   table index of the last late task, 0xFF if none
+#define MODBUS_REG_SCHED_MAX_PASS_US		0x0114						// R   longest pass through the tasks, us
+#define MODBUS_REG_SCHED_END				0x0115
+
+// Low power registers (see low_power.h)
+#define MODBUS_REG_LP_BASE					0x0120
+#define MODBUS_REG_LP_PERIOD_MS				0x0120						// RW  sample period with STOP in between, ms; 0 = off
+#define MODBUS_REG_LP_LSI_HZ				0x0121						// R   measured LSI frequency, Hz; 0 until measured
+#define MODBUS_REG_LP_RESIDENCY_PERMIL		0x0122						// R   time in STOP in the last 10 s, 1/1000
+#define MODBUS_REG_LP_WAKEUPS_TIMER			0x0123						// R   wake-ups by the RTC timer since boot
+#define MODBUS_REG_LP_WAKEUPS_BUS			0x0124						// R   wake-ups by USART1 since boot
+#define MODBUS_REG_LP_WAKE_LATENCY_US		0x0125						// R   last wake-up event to the run clock, us
+#define MODBUS_REG_LP_WAKE_LATENCY_MAX_US	0x0126						// RW  longest wake-up event to the run clock, us; write to reset
+#define MODBUS_REG_LP_END					0x0127
+
+// Clock governor registers (see clock_governor.h)
+#define MODBUS_REG_CLK_BASE					0x0130
+#define MODBUS_REG_CLK_CONTROL				0x0130						// RW  CLOCK_GOV_CONTROL_x bits
+#define MODBUS_REG_CLK_SYSCLK_MHZ			0x0131						// R   current SYSCLK, MHz
+#define MODBUS_REG_CLK_LOW_PERMIL			0x0132						// R   time at 8 MHz in the last 10 s, 1/1000
+#define MODBUS_REG_CLK_SWITCHES				0x0133						// R   clock switches since boot
+#define MODBUS_REG_CLK_DOWN_US				0x0134						// R   duration of the last switch to 8 MHz, us
+#define MODBUS_REG_CLK_UP_US				0x0135						// R   duration of the last switch to 72 MHz, us
+#define MODBUS_REG_CLK_SAVING_UA			0x0136						// R   estimated average current saved in the last 10 s, uA
+#define MODBUS_REG_CLK_END					0x0137
+
+// ISR timing registers (see isr_timing.h)
+#define MODBUS_REG_ISR_BASE					0x0140
+#define MODBUS_REG_ISR_TIMING				0x0140						// RW  entry ISR_TIMING_x at + 3 * x: last, min, max cycles; write to reset
+#define MODBUS_REG_ISR_ENTRY_SIZE			3
+#define MODBUS_REG_ISR_CCMRAM_BYTES			0x014C						// R   code and data placed in CCMRAM, bytes
+#define MODBUS_REG_ISR_END					0x014D
+
+// RAM budget registers (see ram_budget.h)
+#define MODBUS_REG_RAM_BASE					0x0150
+#define MODBUS_REG_RAM_STACK_PEAK			0x0150						// RW  stack high-water mark, bytes; write to repaint
+#define MODBUS_REG_RAM_STACK_FREE			0x0151						// R   stack area never reached, bytes
+#define MODBUS_REG_RAM_STACK_AREA			0x0152						// R   RAM between the heap start and the top, bytes
+#define MODBUS_REG_RAM_STACK_RESERVED		0x0153						// R   _Min_Stack_Size checked by the linker, bytes
+#define MODBUS_REG_RAM_STATIC				0x0154						// R   .data and .bss, bytes
+#define MODBUS_REG_RAM_SUBSYSTEM			0x0155						// R   + RAM_BUDGET_x: static RAM of the subsystem, bytes
+#define MODBUS_REG_RAM_END					0x015E
+
+// Fault record registers (see fault_record.h). Kept over a reset, cleared by a power cycle
+#define MODBUS_REG_FAULT_BASE				0x0170
+#define MODBUS_REG_FAULT_TYPE				0x0170						// RW  FAULT_TYPE_x of the last fault; write 0 to clear
+#define MODBUS_REG_FAULT_COUNT				0x0171						// R   faults since power-on
+#define MODBUS_REG_FAULT_RECORD				0x0172						// R   uint32 r0-r3, r12, lr, pc, xPSR, CFSR, HFSR, MMFAR, BFAR, sp,
+																		//     EXC_RETURN, backtrace 0..3
+#define MODBUS_REG_FAULT_END				0x0196
+
+// Watchdog supervisor registers (see watchdog.h)
+#define MODBUS_REG_WDG_BASE					0x01A0
+#define MODBUS_REG_WDG_RESET_CAUSE			0x01A0						// R   RCC_CSR reset flags (bits 31..24) of the last reset
+#define MODBUS_REG_WDG_MISSED_TASK			0x01A1						// RW  WATCHDOG_x that last missed its deadline, kept over the reset;
+																		//     WATCHDOG_NONE if none, write it to clear
+#define MODBUS_REG_WDG_MISSED_COUNT			0x01A2						// R   resets by a missed deadline since power-on
+#define MODBUS_REG_WDG_CHECKIN_AGE			0x01A3						// R   + WATCHDOG_x: time since the last check-in, ms
+#define MODBUS_REG_WDG_DEADLINE				0x01A7						// R   + WATCHDOG_x: deadline, ms
+#define MODBUS_REG_WDG_END					0x01AB
+
+// Trend entry windows, one per level: 1 s at 0x0200, 1 min at 0x0400, 1 h at 0x0600. Entry n (0 is the newest) is
+// at window + 6 * n: min, max, mean flow * 1000, 32-bit high word first, 0x80000000 if the entry has no value
+#define MODBUS_REG_TREND_ENTRIES_BASE		0x0200
+#define MODBUS_REG_TREND_LEVEL_STRIDE		0x0200
+#define MODBUS_REG_TREND_ENTRY_SIZE			6
+#define MODBUS_REG_TREND_ENTRIES_END		0x0800
+
+// Flow log record window: FLOW_LOG_WINDOW_RECORDS records starting at the read sequence, 12 registers each: sequence,
+// type, uptime in s, data 0..2, all 32-bit high word first. All 0xFFFF past the newest record
+#define MODBUS_REG_LOG_RECORDS_BASE			0x0800
+#define MODBUS_REG_LOG_RECORD_SIZE			12
+#define MODBUS_REG_LOG_RECORDS_END			0x0878
+
+// Capture data window: CAPTURE_SIZE values, oldest first, once the capture is done
+#define MODBUS_REG_CAPTURE_DATA_BASE		0x1000
+#define MODBUS_REG_CAPTURE_DATA_END			0x1400
+
+// Compressed capture data (see sample_codec.h): chunk k of 64 values at base + k * stride, header and packed
+// differences. A chunk needs 5 + ceil(63 * width / 16) registers; the width is in the first register
+#define MODBUS_REG_CAPTURE_PACKED_BASE		0x2000
+#define MODBUS_REG_CAPTURE_PACKED_STRIDE	0x0080
+#define MODBUS_REG_CAPTURE_PACKED_END		0x2800
+
+// Register map API
+bool modbus_read_register(uint16_t reg, uint16_t *value);
+bool modbus_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_MODBUS_REGISTERS_H_ */
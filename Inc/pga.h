@@ -0,0 +1,55 @@
+#ifndef INC_PGA_H_
+#define INC_PGA_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * OPAMP2 gain ranging. OPAMP2 runs as a follower (x1) or as an internal PGA (x2, x4, x8, x16). In auto mode the
+ * gain follows the filtered input level: it steps down at once when the output nears the top of the ADC range and
+ * steps up only after the level has been low enough for the next gain for PGA_UP_HOLD_SAMPLES samples. Samples
+ * converted while the gain settles are discarded. Ranging runs once per acquisition sample, and a gain change
+ * takes effect at the start of the next one, so a sample never mixes two gains.
+ *
+ * Each gain has a calibrated actual gain and input offset, both relative to x1. OPAMP2 and ADC2 add an offset at
+ * the output that is not scaled by the gain, so referred to the input it differs from one gain to the next; the
+ * zero calibration only removes the offset of the gain it was taken at. The calibration takes two points with a
+ * steady input, e.g. the valve closed and then a steady flow. The first point measures every gain against x1 and
+ * sets the gain from the ratio with no offset. The second point, at another input level, sets the gain from the
+ * differences to the first point and the offset from what is left. Without a second point the offset stays 0.
+ * Results outside PGA_CAL_GAIN_TOLERANCE of the nominal gain or PGA_CAL_MAX_OFFSET are not stored, and the
+ * previous calibration of that gain is kept.
+ * */
+#define PGA_GAIN_COUNT				5										// x1 (follower), x2, x4, x8, x16
+#define PGA_SETTLE_SAMPLES			2										// Samples discarded after a gain change
+#define PGA_FILTER_SHIFT			4										// Input level low pass filter, 1/16 per sample
+#define PGA_DOWN_THRESHOLD			0.90f									// Step down when the output exceeds this part of Vdd
+#define PGA_UP_THRESHOLD			0.70f									// Step up when the output at the next gain stays below this
+#define PGA_UP_HOLD_SAMPLES			64										// Samples the level must allow the next gain
+#define PGA_CAL_SAMPLES				256										// Samples averaged per gain during calibration
+#define PGA_CAL_MIN_SPAN			0.02f									// Least x1 output change between the two points, V
+#define PGA_CAL_GAIN_TOLERANCE		0.10f									// Calibrated gain within this part of the nominal gain
+#define PGA_CAL_MAX_OFFSET			0.05f									// Largest calibrated input offset, V
+
+// Control bits (MODBUS_REG_PGA_CONTROL)
+#define PGA_CONTROL_AUTO			0x0001									// Auto-ranging; otherwise the fixed gain is used
+
+// Status bits (MODBUS_REG_PGA_STATUS)
+#define PGA_STATUS_CALIBRATING		0x0001									// Gain calibration running
+#define PGA_STATUS_CAL_PARTIAL		0x0002									// Last calibration skipped gains that would saturate
+#define PGA_STATUS_CAL_NO_SPAN		0x0004									// Second point too close to the first; offsets not calibrated
+#define PGA_STATUS_CAL_REJECTED		0x0008									// A gain or offset was out of tolerance and not stored
+
+// PGA API
+void pga_init(void);
+void pga_task(void);
+bool pga_process_sample(float *voltage, float vdd);
+uint8_t pga_gain(void);
+bool pga_auto_ranging(void);
+void pga_restore(void);
+bool pga_start_calibration(bool second);
+bool pga_calibrating(void);
+bool pga_read_register(uint16_t reg, uint16_t *value);
+bool pga_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_PGA_H_ */
@@ -0,0 +1,36 @@
+#ifndef INC_RAM_BUDGET_H_
+#define INC_RAM_BUDGET_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * RAM budget. The startup code paints the RAM between the heap start (_end) and the stack pointer with
+ * RAM_BUDGET_PAINT; the stack high-water mark is the lowest word that no longer holds the pattern, searched from
+ * _end up when it is read. Nothing allocates from the heap, so the whole area is available to the stack. Writing the
+ * peak register repaints the area below the current stack pointer to measure again.
+ *
+ * The static RAM (.data and .bss) of each subsystem is taken from symbols the linker script places around its
+ * object files; everything not listed there counts as RAM_BUDGET_OTHER.
+ * */
+#define RAM_BUDGET_PAINT			0xA5A5A5A5UL							// Same pattern as the startup code
+
+// Subsystems (MODBUS_REG_RAM_SUBSYSTEM + x)
+#define RAM_BUDGET_ACQUISITION		0										// acquisition.c
+#define RAM_BUDGET_CAPTURE			1										// capture.c
+#define RAM_BUDGET_TREND			2										// trend.c
+#define RAM_BUDGET_AUTOZERO			3										// autozero.c
+#define RAM_BUDGET_FLOW_LOG			4										// flow_log.c
+#define RAM_BUDGET_MODBUS			5										// rs485_modbus_rtu.c, modbus_registers.c
+#define RAM_BUDGET_CONFIG			6										// config_store.c
+#define RAM_BUDGET_HAL				7										// main.c, HAL drivers and handles
+#define RAM_BUDGET_OTHER			8										// The remaining modules and libraries
+#define RAM_BUDGET_SUBSYSTEM_COUNT	9
+
+// RAM budget API
+uint32_t ram_budget_stack_peak(void);
+void ram_budget_repaint(void);
+bool ram_budget_read_register(uint16_t reg, uint16_t *value);
+bool ram_budget_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_RAM_BUDGET_H_ */
@@ -3,6 +3,20 @@
 
 #include "main.h"
 #include <string.h>
+#include <stdbool.h>
+
+// Supported function codes
+#define MODBUS_FC_READ_HOLDING_REGISTERS	0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS		0x04
+#define MODBUS_FC_WRITE_SINGLE_REGISTER		0x06
+
+// Exception codes
+#define MODBUS_EXCEPTION_ILLEGAL_FUNCTION	0x01
+#define MODBUS_EXCEPTION_ILLEGAL_ADDRESS	0x02
+#define MODBUS_EXCEPTION_ILLEGAL_VALUE		0x03
+
+#define MODBUS_DEFAULT_BAUD_RATE			9600
+#define MODBUS_MAX_READ_REGISTERS			125								// 5 + 2 * 125 bytes response, fits in the USART1 TX buffer
 
 
 //Modbus command structure definition and buffer
@@ -11,17 +25,26 @@ typedef struct ModbusCommand {
 	uint8_t		function_code;
 	uint8_t		data[4];
 	uint8_t		crc[2];
+	uint32_t	timestamp_us;												// timebase_us() at the receiver timeout that ended the frame
 }ModbusCommand;
 
 // USART1 Modbus API
-void USART1_RS485_Init(uint32_t device_address);
+void USART1_RS485_Init(uint32_t device_address, uint32_t baud_rate);
 void USART1_IRQHandler(void);
 void USART1_putchar(uint8_t ch);
+void USART1_stop_mode(bool enable);
 void USART1_putstring(uint8_t *s, uint8_t size);
 uint8_t modbus_command_available(void);
 ModbusCommand get_modbus_command(void);
 uint8_t modbus_command_check_crc(ModbusCommand mc);
 uint16_t modbus_generate_crc(uint8_t *message, uint8_t message_len);
+bool modbus_function_supported(uint8_t function_code);
+bool modbus_baud_rate_valid(uint32_t baud_rate);
+void modbus_send_response(uint8_t *response, uint8_t message_len);
+void modbus_send_exception(ModbusCommand mc, uint8_t exception_code);
+bool modbus_bus_idle(void);
+bool modbus_bus_quiet(uint8_t frames);
+void modbus_watchdog_checkin(void);
 void MX_CRC_Init(void);
 
 #endif /* INC_RS485_MODBUS_RTU_H_ */
@@ -0,0 +1,57 @@
+#ifndef INC_SAMPLE_CODEC_H_
+#define INC_SAMPLE_CODEC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Compressed transfer of 16-bit sample values in Modbus registers. Values are cut into chunks of up to
+ * SAMPLE_CODEC_CHUNK_VALUES; each chunk is sent as its first value followed by the zig-zag encoded differences of
+ * successive values, all packed MSB first at the smallest bit width that holds the largest difference. A smooth
+ * signal with a few LSB of noise needs 3-5 bits per value instead of 16.
+ *
+ * Chunk layout, one 16-bit register per word:
+ *   0  SAMPLE_CODEC_FORMAT << 8 | bit width
+ *   1  number of values
+ *   2  chunk index
+ *   3  first value
+ *   4  CRC-16/MODBUS of all other words, each word high byte first
+ *   5+ packed differences, ceil((values - 1) * width / 16) words; unused bits are 0
+ *
+ * Every word is computed from the source when it is read, so no encoded copy is kept in RAM. The random access to
+ * a fixed width field is what makes that cheap. This file has no HAL dependency and is also built by the host tools
+ * in Tools/sample_codec.
+ * */
+#define SAMPLE_CODEC_FORMAT			1
+#define SAMPLE_CODEC_CHUNK_VALUES	64
+#define SAMPLE_CODEC_HEADER_WORDS	5
+#define SAMPLE_CODEC_MAX_WIDTH		17										// Zig-zag of a 16-bit difference
+#define SAMPLE_CODEC_MAX_WORDS		(SAMPLE_CODEC_HEADER_WORDS + ((SAMPLE_CODEC_CHUNK_VALUES - 1) * SAMPLE_CODEC_MAX_WIDTH + 15) / 16)
+
+// Errors returned by sample_codec_decode()
+#define SAMPLE_CODEC_ERROR_FORMAT	-1										// Unknown format, bad width or too few words
+#define SAMPLE_CODEC_ERROR_CRC		-2
+
+// Returns value n of the data being encoded
+typedef uint16_t (*SampleCodecSource)(void *context, uint16_t n);
+
+// Chunk being encoded
+typedef struct SampleCodecChunk {
+	SampleCodecSource	source;
+	void				*context;
+	uint16_t			index;												// Chunk index
+	uint16_t			first;												// Source position of the first value
+	uint16_t			count;												// Values in the chunk
+	uint8_t				width;												// Bits per difference
+	uint16_t			words;												// Encoded length, words
+	uint16_t			crc;
+}SampleCodecChunk;
+
+// Sample codec API
+void sample_codec_chunk_init(SampleCodecChunk *chunk, SampleCodecSource source, void *context, uint16_t index,
+		uint16_t first, uint16_t count);
+uint16_t sample_codec_chunk_word(const SampleCodecChunk *chunk, uint16_t n);
+int sample_codec_decode(const uint16_t *words, uint16_t word_count, uint16_t *values, uint16_t max_values);
+uint16_t sample_codec_crc(uint16_t crc, uint16_t word);
+
+#endif /* INC_SAMPLE_CODEC_H_ */
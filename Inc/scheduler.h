@@ -0,0 +1,38 @@
+#ifndef INC_SCHEDULER_H_
+#define INC_SCHEDULER_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Main loop scheduler. Each pass runs the tasks that are due, then sleeps in WFI until the next interrupt: SysTick
+ * (1 ms), the ADC2 DMA blocks, the analog watchdog or USART1. A received Modbus request keeps the core awake, so the
+ * response is not delayed by a sleep.
+ *
+ * Every task declares a period (0 runs it on every pass; tasks that keep their own time use 0) and a deadline, the
+ * longest acceptable delay after it became due. A task that runs later than that counts as an overrun, which shows
+ * that another task or interrupt held the loop for too long.
+ *
+ * The core clock, and with it the DWT cycle counter, stops in WFI, so the cycles counted per second are the time
+ * spent awake. Cycles are converted to time at every core clock switch (see clock_governor.h). With a slow sample
+ * period low_power_idle() enters STOP instead of WFI (see low_power.h).
+ * */
+#define SCHEDULER_STATS_PERIOD_MS	1000									// Load and wake-up statistics window
+
+// Task in the scheduler table
+typedef struct SchedulerTask {
+	void		(*run)(void);
+	uint16_t	period_ms;													// 0: run on every pass
+	uint16_t	deadline_ms;												// Longest delay after the task is due
+	uint32_t	last_tick;													// Set by the scheduler
+	uint16_t	overruns;													// Set by the scheduler
+}SchedulerTask;
+
+// Scheduler API
+void scheduler_init(SchedulerTask *tasks, uint8_t count);
+void scheduler_run(void);
+uint16_t scheduler_load_permil(void);
+void scheduler_clock_changed(uint32_t old_hz);
+bool scheduler_read_register(uint16_t reg, uint16_t *value);
+
+#endif /* INC_SCHEDULER_H_ */
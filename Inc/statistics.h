@@ -0,0 +1,28 @@
+#ifndef INC_STATISTICS_H_
+#define INC_STATISTICS_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Streaming statistics of every published channel 3 sample since the last read (Welford's algorithm, so the
+ * variance is stable over millions of samples). Reading MODBUS_REG_STATS_COUNT (first register of the block) takes
+ * a snapshot and restarts the accumulation; the rest of the block reads the snapshot, so a master reading the
+ * whole block gets one consistent interval. Values are converted to flow with the calibration at read time.
+ * */
+
+// Welford accumulator, voltages in V
+typedef struct StatsAccumulator {
+	uint32_t	count;
+	float		mean;
+	float		m2;															// Sum of squared differences from the mean
+	float		min;
+	float		max;
+}StatsAccumulator;
+
+// Statistics API
+void stats_accumulate(float voltage);
+void stats_reset(void);
+bool stats_read_register(uint16_t reg, uint16_t *value);
+
+#endif /* INC_STATISTICS_H_ */
@@ -0,0 +1,25 @@
+#ifndef INC_TEMPERATURE_H_
+#define INC_TEMPERATURE_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * MCU temperature from the internal sensor (ADC1 channel 16; not available on ADC2). ADC1 converts once per
+ * TEMPERATURE_PERIOD_MS independently of the flow acquisition on ADC2. The filtered temperature drives a linear
+ * zero and span compensation relative to the temperature at calibration.
+ * */
+#define TEMPERATURE_PERIOD_MS		100										// Temperature sample period
+#define TEMPERATURE_FILTER_SHIFT	3										// Low pass filter, 1/8 of the new sample per period
+
+// Temperature API
+void temperature_init(void);
+void temperature_task(void);
+float temperature_get(void);
+void temperature_set_calibration_point(void);
+float temperature_zero_shift(void);
+float temperature_span_factor(void);
+bool temperature_read_register(uint16_t reg, uint16_t *value);
+bool temperature_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_TEMPERATURE_H_ */
@@ -0,0 +1,23 @@
+#ifndef INC_TIMEBASE_H_
+#define INC_TIMEBASE_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Free-running 32-bit microsecond time base on TIM2; wraps after 71.6 minutes, so use differences of timestamps.
+ * It timestamps the published acquisition samples and the end of received Modbus frames, and is there for any other
+ * instrumentation that needs better than the 1 ms HAL tick.
+ *
+ * TIM2 is clocked from PCLK1 (x2, as APB1 is divided), so the prescaler is set again at every core clock switch
+ * without losing the count (see clock_governor.h). The counter stops in STOP mode; low_power_stop() moves it on by
+ * the time measured with the RTC, to the RTC resolution (100 us).
+ * */
+
+// Time base API
+void timebase_init(void);
+uint32_t timebase_us(void);
+void timebase_clock_changed(void);
+void timebase_stopped(uint32_t start_us, uint32_t stopped_us);
+
+#endif /* INC_TIMEBASE_H_ */
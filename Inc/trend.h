@@ -0,0 +1,59 @@
+#ifndef INC_TREND_H_
+#define INC_TREND_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * Flow trend pyramid. Every published channel 3 sample is accumulated; once per second the accumulator is converted
+ * to flow and stored as a 1 s entry (min/max/mean). Every TREND_RATIO entries of one level are combined into one
+ * entry of the next level: 1 s -> 1 min -> 1 h. Each level is a ring, readable newest first over Modbus.
+ *
+ * RAM budget: the linker script gives 12K of RAM, of which 1.5K is reserved for stack and heap and about 3K is used
+ * by HAL handles, DMA buffers and the other modules. The pyramid gets TREND_RAM_BUDGET; trend.c fails to compile if
+ * the ring sizes exceed it.
+ * */
+#define TREND_LEVEL_SECONDS		0
+#define TREND_LEVEL_MINUTES		1
+#define TREND_LEVEL_HOURS		2
+#define TREND_LEVEL_COUNT		3
+#define TREND_SECONDS_SIZE		60											// 1 s entries, the last minute
+#define TREND_MINUTES_SIZE		60											// 1 min entries, the last hour
+#define TREND_HOURS_SIZE		24											// 1 h entries, the last day
+#define TREND_RATIO				60											// Entries of one level per entry of the next
+#define TREND_PERIOD_MS			1000										// Period of the first level
+#define TREND_RAM_BUDGET		2048										// Bytes
+#define TREND_INVALID			INT32_MIN									// Entry value without samples or calibration
+
+// Trend entry, flow * 1000
+typedef struct TrendEntry {
+	int32_t		min;
+	int32_t		max;
+	int32_t		mean;
+}TrendEntry;
+
+// Ring of entries of one level
+typedef struct TrendRing {
+	TrendEntry	*entries;
+	uint16_t	size;
+	uint16_t	head;														// Next entry to write
+	uint16_t	count;														// Valid entries
+	uint16_t	sequence;													// Entries written since boot, wraps
+}TrendRing;
+
+// Combines entries of one level into an entry of the next
+typedef struct TrendAccumulator {
+	int64_t		sum;														// Sum of valid means
+	int32_t		min;
+	int32_t		max;
+	uint16_t	valid;														// Entries with a value
+	uint16_t	entries;													// Entries added
+}TrendAccumulator;
+
+// Trend API
+void trend_init(void);
+void trend_accumulate(float voltage);
+void trend_task(void);
+bool trend_read_register(uint16_t reg, uint16_t *value);
+
+#endif /* INC_TREND_H_ */
@@ -0,0 +1,47 @@
+#ifndef INC_WATCHDOG_H_
+#define INC_WATCHDOG_H_
+
+#include "main.h"
+#include <stdbool.h>
+
+/*
+ * IWDG supervisor. The IWDG is only refreshed while every supervised task has checked in within its deadline, so a
+ * stalled ADC pipeline, a dead USART1 interrupt, a stuck transmitter or a flash writer that no longer gets its work
+ * done resets the node even though the main loop keeps running. Once a deadline is missed the IWDG is no longer fed
+ * and resets the MCU after its timeout (0.5 s).
+ *
+ * A task checks in when it has made progress, or when it has nothing to do: acquisition on every block, and from the
+ * main loop while it is stopped; Modbus RX from the main loop while no received byte stays unread over a pass; the
+ * TX drain while the transmit buffer is empty or moving; the flash writer when it has nothing to do, when a record is
+ * written or a page erased, and while it waits for the bus unless its last attempt failed. Pending work is forced
+ * after FLOW_LOG_FORCE_DELAY_MS, so a writer whose attempts keep failing misses its deadline.
+ *
+ * The task that missed its deadline is kept over the reset in .noinit RAM. The reset flags of RCC_CSR are read and
+ * cleared at boot, so they show the cause of the last reset only.
+ * */
+#define WATCHDOG_MAGIC				0x57D0C0DEUL
+
+// Supervised tasks
+#define WATCHDOG_ACQUISITION		0										// ADC2 blocks; deadline follows the sample timeout
+#define WATCHDOG_MODBUS_RX			1										// USART1 receive interrupt
+#define WATCHDOG_TX_DRAIN			2										// USART1 transmit buffer
+#define WATCHDOG_FLASH_WRITER		3										// Flow log writes and erases
+#define WATCHDOG_TASK_COUNT			4
+#define WATCHDOG_NONE				0xFF
+
+// Default deadlines
+#define WATCHDOG_ACQUISITION_MS		1000									// Until acquisition sets its own
+#define WATCHDOG_MODBUS_RX_MS		1000
+#define WATCHDOG_TX_DRAIN_MS		1000									// A full buffer takes 150 ms at 4800 baud
+#define WATCHDOG_FLASH_WRITER_MS	10000									// Twice FLOW_LOG_FORCE_DELAY_MS
+
+// Watchdog API
+void watchdog_init(void);
+void watchdog_task(void);
+void watchdog_checkin(uint8_t task);
+void watchdog_set_deadline(uint8_t task, uint32_t deadline_ms);
+uint32_t watchdog_reset_cause(void);
+bool watchdog_read_register(uint16_t reg, uint16_t *value);
+bool watchdog_write_register(uint16_t reg, uint16_t value);
+
+#endif /* INC_WATCHDOG_H_ */
@@ -0,0 +1,728 @@
+#include "acquisition.h"
+#include "autozero.h"
+#include "aux_input.h"
+#include "pga.h"
+#include "flow_alarm.h"
+#include "statistics.h"
+#include "trend.h"
+#include "capture.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "watchdog.h"
+#include "timebase.h"
+
+#define VREFINT_CAL_ADDR ((uint16_t*)((uint32_t)0x1FFFF7BA))			// VREFINT_CAL value. See datasheet for converting ADC to absolute voltage
+#define ACQ_BUFFER_LENGTH	(2 * ACQ_BLOCK_SCANS * ACQ_SCAN_LENGTH_MAX)
+
+static const AcquisitionProfile profiles[ACQ_PROFILE_COUNT] = {
+	{ ADC_SAMPLETIME_601CYCLES_5, 1203, ADC_RESOLUTION_12B, 12, ACQ_VREF_MODE_SCAN, 4 },		// ACQ_PROFILE_PRECISE
+	{ ADC_SAMPLETIME_181CYCLES_5, 363, ADC_RESOLUTION_12B, 12, ACQ_VREF_MODE_SLOW, 3 },		// ACQ_PROFILE_BALANCED
+	{ ADC_SAMPLETIME_61CYCLES_5, 123, ADC_RESOLUTION_10B, 10, ACQ_VREF_MODE_SLOW, 3 }			// ACQ_PROFILE_FAST
+};
+
+extern ADC_HandleTypeDef hadc2;
+
+static uint16_t adc_buffer[ACQ_BUFFER_LENGTH];								// Circular DMA buffer, two blocks
+static uint16_t vrefint_cal = 0;											// Factory VREFINT calibration
+static volatile AcquisitionSample latest_sample;							// Last published block; written by the DMA interrupt
+static AcquisitionSample frozen_sample;										// Copy returned while frozen
+static bool frozen = false;
+static uint8_t scan_length = ACQ_SCAN_LENGTH_MAX;							// Conversions per scan
+static uint8_t vrefint_index = 1;											// Position of VREFINT in a scan; 0 if not scanned
+static uint8_t channel4_index = 2;											// Position of channel 4 in a scan; 0 if not scanned
+static bool channel_4 = true;												// Channel 4 requested by the auxiliary input
+static bool running = false;
+static uint32_t profile = ACQ_PROFILE_BALANCED;								// ACQ_PROFILE_x
+static uint32_t sampling_time = ADC_SAMPLETIME_181CYCLES_5;					// Regular channels
+static uint16_t sampling_cycles_x2 = 363;
+static uint32_t resolution = ADC_RESOLUTION_12B;
+static uint8_t resolution_bits = 12;
+static float full_scale = 4095.0f;											// Highest code at the current resolution
+static uint32_t oversample_bits = ACQ_OVERSAMPLE_BITS_MIN;					// Extra bits n; 4^(n - 3) blocks per sample
+static uint32_t timeout_ms = ACQ_TIMEOUT_MS;								// Sample age that means acquisition has stalled
+static uint32_t sample_hold_ms = 0;										// Extra sample age allowed while ADC2 is duty cycled
+static uint32_t dec_blocks = 0;												// Blocks in the decimation sums
+static uint32_t dec_code = 0;												// Decimation sums of the conversion codes
+static uint32_t dec_vrefint = 0;
+static uint32_t dec_channel_4 = 0;
+static uint32_t adc_calfact = 0;											// ADC2 single ended calibration factor
+static bool adc_calfact_valid = false;
+
+static uint32_t vref_mode = ACQ_VREF_MODE_SLOW;								// ACQ_VREF_MODE_x
+static uint32_t vref_period_ms = ACQ_VREF_DEFAULT_PERIOD_MS;
+static volatile float vdd_filtered = 0;										// Filtered Vdd used in ACQ_VREF_MODE_SLOW, V
+static bool vref_pending = false;											// Injected VREFINT conversion started
+static uint32_t vref_tick = 0;
+
+static void acquisition_apply_profile(uint8_t p);
+static void acquisition_configure(void);
+static bool acquisition_set_custom(void);
+static void acquisition_run(void);
+static float acquisition_vref_to_vdd(uint32_t vrefint_adc);
+static void acquisition_process_block(const uint16_t *block);
+static void acquisition_publish(uint32_t conversions);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load the acquisition settings, start continuous acquisition and wait for the first block, so the
+ * calibration at boot has a sample. ADC2 must be initialized with continuous conversion and DMA continuous requests
+ */
+/****************************************************************************************************************/
+void acquisition_start(void) {
+	vrefint_cal = *VREFINT_CAL_ADDR;
+	latest_sample.sequence = 0;
+
+	config_get(CONFIG_KEY_ACQ_PROFILE, &profile);
+	config_get(CONFIG_KEY_ACQ_VREF_PERIOD, &vref_period_ms);
+	if (profile < ACQ_PROFILE_COUNT) {
+		acquisition_apply_profile(profile);
+	} else {																// Custom: balanced timing with the stored settings
+		acquisition_apply_profile(ACQ_PROFILE_BALANCED);
+		profile = ACQ_PROFILE_CUSTOM;
+		config_get(CONFIG_KEY_ACQ_VREF_MODE, &vref_mode);
+		config_get(CONFIG_KEY_ACQ_OVERSAMPLE_BITS, &oversample_bits);
+	}
+	if ((oversample_bits < ACQ_OVERSAMPLE_BITS_MIN) || (oversample_bits > ACQ_OVERSAMPLE_BITS_MAX)) {
+		oversample_bits = ACQ_OVERSAMPLE_BITS_MIN;
+	}
+	if (vref_mode > ACQ_VREF_MODE_SLOW) {
+		vref_mode = ACQ_VREF_MODE_SLOW;
+	}
+	if (vref_period_ms == 0) {
+		vref_period_ms = ACQ_VREF_DEFAULT_PERIOD_MS;
+	}
+
+	acquisition_configure();
+	acquisition_run();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief VREFINT tracking, called from the main loop. In ACQ_VREF_MODE_SLOW reads the injected VREFINT conversion
+ * started in the previous period into the filtered Vdd and starts the next one
+ */
+/****************************************************************************************************************/
+void acquisition_task(void) {
+	uint32_t now = HAL_GetTick();
+
+	if (running == false) {													// Stopped on purpose; the blocks check in while running
+		watchdog_checkin(WATCHDOG_ACQUISITION);
+	}
+
+	if ((vref_mode != ACQ_VREF_MODE_SLOW) || !running || ((now - vref_tick) < vref_period_ms)) {
+		return;
+	}
+	vref_tick = now;
+
+	if (vref_pending && __HAL_ADC_GET_FLAG(&hadc2, ADC_FLAG_JEOC)) {
+		float vdd = acquisition_vref_to_vdd(HAL_ADCEx_InjectedGetValue(&hadc2, ADC_INJECTED_RANK_1));
+		vdd_filtered += (vdd - vdd_filtered) / (1 << ACQ_VDD_FILTER_SHIFT);
+	}
+
+	vref_pending = (HAL_ADCEx_InjectedStart(&hadc2) == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Stop acquisition, e.g. to calibrate ADC2 or OPAMP2. ADC2 is left disabled
+ */
+/****************************************************************************************************************/
+void acquisition_stop(void) {
+	if (running) {
+		HAL_ADC_Stop_DMA(&hadc2);
+		running = false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Restart acquisition after acquisition_stop() and wait for the next block
+ */
+/****************************************************************************************************************/
+void acquisition_resume(void) {
+	if (running == false) {
+		acquisition_run();
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Set the ADC2 calibration factor. It is written each time ADC2 is enabled, so a stored factor replaces
+ * running the ADC calibration
+ * @param calfact Single ended calibration factor (ADC_CALFACT_CALFACT_S)
+ */
+/****************************************************************************************************************/
+void acquisition_set_adc_calibration(uint32_t calfact) {
+	adc_calfact = calfact & ADC_CALFACT_CALFACT_S;
+	adc_calfact_valid = true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Add channel 4 to the scan or drop it
+ * @param enable
+ */
+/****************************************************************************************************************/
+void acquisition_set_channel_4(bool enable) {
+	if (enable == channel_4) {
+		return;
+	}
+	channel_4 = enable;
+	acquisition_reconfigure();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Get a copy of the latest block average, or of the frozen one
+ * @param sample
+ * @return false if no block was completed within ACQ_TIMEOUT_MS
+ */
+/****************************************************************************************************************/
+bool acquisition_get_sample(AcquisitionSample *sample) {
+	if (frozen) {
+		*sample = frozen_sample;
+	} else {
+		__disable_irq();													// Block must not be updated while copying
+		*sample = latest_sample;
+		__enable_irq();
+	}
+
+	return (sample->sequence != 0) && ((HAL_GetTick() - sample->tick) <= timeout_ms);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Make acquisition_get_sample() return the same sample until released, so that the registers read by one
+ * Modbus request, e.g. a value and its timestamp, come from one sample
+ * @param freeze true to take the latest sample, false to release it
+ */
+/****************************************************************************************************************/
+void acquisition_freeze_sample(bool freeze) {
+	if (freeze) {
+		__disable_irq();
+		frozen_sample = latest_sample;
+		__enable_irq();
+	}
+	frozen = freeze;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check if ADC2 is converting
+ * @return false after acquisition_stop()
+ */
+/****************************************************************************************************************/
+bool acquisition_running(void) {
+	return running;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Keep samples valid for longer while ADC2 only runs once per sample period (see low_power.h)
+ * @param hold_ms Sample period, 0 for continuous acquisition
+ */
+/****************************************************************************************************************/
+void acquisition_set_sample_hold(uint32_t hold_ms) {
+	sample_hold_ms = hold_ms;
+	timeout_ms = ACQ_TIMEOUT_MS + (uint32_t) (2000.0f / acquisition_sample_rate()) + sample_hold_ms;
+	watchdog_set_deadline(WATCHDOG_ACQUISITION, timeout_ms);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Rate samples are published at with the current scan and oversampling
+ * @return Sample rate, Hz
+ */
+/****************************************************************************************************************/
+float acquisition_sample_rate(void) {
+	float block_rate = acquisition_scan_rate() / ACQ_BLOCK_SCANS;
+
+	return block_rate / (1 << (2 * (oversample_bits - ACQ_OVERSAMPLE_BITS_MIN)));
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Rate of channel 3 conversions with the current scan, before any averaging
+ * @return Scan rate, Hz
+ */
+/****************************************************************************************************************/
+float acquisition_scan_rate(void) {
+	uint32_t conversion_x2 = sampling_cycles_x2 + 2 * resolution_bits + 1;	// Sampling + successive approximation cycles
+
+	return 2.0f * ACQ_ADC_CLOCK_HZ / (conversion_x2 * scan_length);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Expected channel 3 noise floor with the current resolution and oversampling. Assumes ACQ_NOISE_LSB_RMS per
+ * conversion, reduced by sqrt(4^n) = 2^n by the oversampling
+ * @return Noise, V rms
+ */
+/****************************************************************************************************************/
+float acquisition_noise_floor(void) {
+	float vdd = (latest_sample.vdd > 0) ? latest_sample.vdd : 3.3f;
+
+	return ACQ_NOISE_LSB_RMS * vdd / (full_scale + 1) / (1 << oversample_bits);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Highest ADC code at the current resolution
+ */
+/****************************************************************************************************************/
+uint16_t acquisition_full_scale(void) {
+	return (uint16_t) full_scale;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Last channel 3 conversion the DMA has written to adc_buffer. ADC DR may hold VREFINT or channel 4 in a
+ * scan; this finds the channel 3 slot of the scan the DMA is in, or of the previous scan if that slot is next
+ * @return ADC code at the current resolution
+ */
+/****************************************************************************************************************/
+uint16_t acquisition_last_channel_3(void) {
+	uint32_t length = 2 * ACQ_BLOCK_SCANS * scan_length;
+	uint32_t written = length - DMA1_Channel2->CNDTR;						// Conversions written in this pass, 0 after a wrap
+	uint32_t last = (written + length - 1) % length;
+
+	return adc_buffer[last - last % scan_length];							// Channel 3 is always rank 1
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Select an acquisition profile. A running acquisition is restarted with the new settings
+ * @param p ACQ_PROFILE_x
+ * @return false if the profile does not exist
+ */
+/****************************************************************************************************************/
+bool acquisition_set_profile(uint8_t p) {
+	if (p >= ACQ_PROFILE_COUNT) {
+		return false;
+	}
+
+	acquisition_apply_profile(p);
+	profile = p;
+	acquisition_reconfigure();
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Latest Vdd estimate
+ */
+/****************************************************************************************************************/
+float acquisition_get_vdd(void) {
+	return latest_sample.vdd;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read an acquisition register
+ * @param reg Register address, MODBUS_REG_ACQ_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool acquisition_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_ACQ_VREF_MODE:
+		*value = (uint16_t) vref_mode;
+		return true;
+
+	case MODBUS_REG_ACQ_VREF_PERIOD_MS:
+		*value = (uint16_t) vref_period_ms;
+		return true;
+
+	case MODBUS_REG_ACQ_VDD_MV:
+		*value = (uint16_t) (latest_sample.vdd * 1000.0f);
+		return true;
+
+	case MODBUS_REG_ACQ_SCAN_LENGTH:
+		*value = scan_length;
+		return true;
+
+	case MODBUS_REG_ACQ_OVERSAMPLE_BITS:
+		*value = (uint16_t) oversample_bits;
+		return true;
+
+	case MODBUS_REG_ACQ_SAMPLE_RATE_HZ:
+		*value = (uint16_t) (acquisition_sample_rate() + 0.5f);
+		return true;
+
+	case MODBUS_REG_ACQ_CH3_CODE:
+		*value = latest_sample.channel_3_code;
+		return true;
+
+	case MODBUS_REG_ACQ_CH3_UV:
+		*value = (uint16_t) ((uint32_t) (latest_sample.channel_3 * 1000000.0f) >> 16);
+		return true;
+
+	case MODBUS_REG_ACQ_CH3_UV + 1:
+		*value = (uint16_t) (uint32_t) (latest_sample.channel_3 * 1000000.0f);
+		return true;
+
+	case MODBUS_REG_ACQ_PROFILE:
+		*value = (uint16_t) profile;
+		return true;
+
+	case MODBUS_REG_ACQ_RESOLUTION_BITS:
+		*value = resolution_bits;
+		return true;
+
+	case MODBUS_REG_ACQ_SAMPLING_CYCLES_X2:
+		*value = sampling_cycles_x2;
+		return true;
+
+	case MODBUS_REG_ACQ_NOISE_FLOOR_UV:
+		*value = (uint16_t) (acquisition_noise_floor() * 1000000.0f + 0.5f);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write an acquisition register. Settings are kept in the configuration store; changing the VREFINT mode
+ * restarts the acquisition with the new scan
+ * @param reg Register address, MODBUS_REG_ACQ_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool acquisition_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_ACQ_VREF_MODE:
+		if (value > ACQ_VREF_MODE_SLOW) {
+			return false;
+		}
+		if (value != vref_mode) {
+			vref_mode = value;
+			acquisition_reconfigure();
+		}
+		return acquisition_set_custom() && config_set(CONFIG_KEY_ACQ_VREF_MODE, vref_mode);
+
+	case MODBUS_REG_ACQ_VREF_PERIOD_MS:
+		if (value == 0) {
+			return false;
+		}
+		vref_period_ms = value;
+		return config_set(CONFIG_KEY_ACQ_VREF_PERIOD, vref_period_ms);
+
+	case MODBUS_REG_ACQ_OVERSAMPLE_BITS:
+		if ((value < ACQ_OVERSAMPLE_BITS_MIN) || (value > ACQ_OVERSAMPLE_BITS_MAX)) {
+			return false;
+		}
+		if (value != oversample_bits) {
+			oversample_bits = value;
+			acquisition_reconfigure();
+		}
+		return acquisition_set_custom() && config_set(CONFIG_KEY_ACQ_OVERSAMPLE_BITS, oversample_bits);
+
+	case MODBUS_REG_ACQ_PROFILE:
+		if (acquisition_set_profile(value) == false) {
+			return false;
+		}
+		return config_set(CONFIG_KEY_ACQ_PROFILE, profile);
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Load the settings of a profile; acquisition_configure() programs them
+ * @param p ACQ_PROFILE_x
+ */
+/****************************************************************************************************************/
+static void acquisition_apply_profile(uint8_t p) {
+	const AcquisitionProfile *ap = &profiles[p];
+
+	sampling_time = ap->sampling_time;
+	sampling_cycles_x2 = ap->sampling_cycles_x2;
+	resolution = ap->resolution;
+	resolution_bits = ap->resolution_bits;
+	full_scale = (float) ((1UL << resolution_bits) - 1);
+	vref_mode = ap->vref_mode;
+	oversample_bits = ap->oversample_bits;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Keep the current timing and resolution as a custom profile after an individual setting was written. The
+ * individual settings are only used from the store while the profile is custom
+ * @return false if the store write failed
+ */
+/****************************************************************************************************************/
+static bool acquisition_set_custom(void) {
+	if (profile == ACQ_PROFILE_CUSTOM) {
+		return true;
+	}
+	profile = ACQ_PROFILE_CUSTOM;
+	return config_set(CONFIG_KEY_ACQ_VREF_MODE, vref_mode)
+			&& config_set(CONFIG_KEY_ACQ_OVERSAMPLE_BITS, oversample_bits)
+			&& config_set(CONFIG_KEY_ACQ_PROFILE, profile);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Program the ADC2 regular sequence: channel 3, then VREFINT in ACQ_VREF_MODE_SCAN, then channel 4 if
+ * enabled. In ACQ_VREF_MODE_SLOW VREFINT is the injected channel instead. ADC2 must be stopped
+ */
+/****************************************************************************************************************/
+static void acquisition_configure(void) {
+	ADC_ChannelConfTypeDef sConfig = {0};
+	ADC_InjectionConfTypeDef sConfigInjected = {0};
+
+	scan_length = 1;														// Channel 3 is always rank 1
+	vrefint_index = 0;
+	channel4_index = 0;
+	if (vref_mode == ACQ_VREF_MODE_SCAN) {
+		vrefint_index = scan_length++;
+	}
+	if (channel_4) {
+		channel4_index = scan_length++;
+	}
+
+	hadc2.Init.NbrOfConversion = scan_length;
+	hadc2.Init.Resolution = resolution;
+	if (HAL_ADC_Init(&hadc2) != HAL_OK) {
+		Error_Handler();
+	}
+
+	dec_blocks = 0;															// Restart decimation with the new scan
+	timeout_ms = ACQ_TIMEOUT_MS + (uint32_t) (2000.0f / acquisition_sample_rate()) + sample_hold_ms;
+	watchdog_set_deadline(WATCHDOG_ACQUISITION, timeout_ms);
+
+	sConfig.SingleDiff = ADC_SINGLE_ENDED;
+	sConfig.SamplingTime = sampling_time;
+	sConfig.OffsetNumber = ADC_OFFSET_NONE;
+	sConfig.Offset = 0;
+	sConfig.Channel = ADC_CHANNEL_3;
+	sConfig.Rank = ADC_REGULAR_RANK_1;
+	if (HAL_ADC_ConfigChannel(&hadc2, &sConfig) != HAL_OK) {
+		Error_Handler();
+	}
+	if (vrefint_index) {
+		sConfig.Channel = ADC_CHANNEL_VREFINT;
+		sConfig.Rank = vrefint_index + 1;
+		if (HAL_ADC_ConfigChannel(&hadc2, &sConfig) != HAL_OK) {
+			Error_Handler();
+		}
+	}
+	if (channel4_index) {
+		sConfig.Channel = ADC_CHANNEL_4;
+		sConfig.Rank = channel4_index + 1;
+		if (HAL_ADC_ConfigChannel(&hadc2, &sConfig) != HAL_OK) {
+			Error_Handler();
+		}
+	}
+
+	flow_alarm_configure();
+	capture_abort();														// Rate and scale of a running capture change
+
+	if (vref_mode == ACQ_VREF_MODE_SLOW) {
+		sConfigInjected.InjectedChannel = ADC_CHANNEL_VREFINT;
+		sConfigInjected.InjectedRank = ADC_INJECTED_RANK_1;
+		sConfigInjected.InjectedSingleDiff = ADC_SINGLE_ENDED;
+		sConfigInjected.InjectedNbrOfConversion = 1;
+		sConfigInjected.InjectedSamplingTime = ADC_SAMPLETIME_181CYCLES_5;	// VREFINT needs > 2.2us in every profile
+		sConfigInjected.ExternalTrigInjecConvEdge = ADC_EXTERNALTRIGINJECCONV_EDGE_NONE;
+		sConfigInjected.ExternalTrigInjecConv = ADC_INJECTED_SOFTWARE_START;
+		sConfigInjected.AutoInjectedConv = DISABLE;
+		sConfigInjected.InjectedDiscontinuousConvMode = DISABLE;
+		sConfigInjected.QueueInjectedContext = DISABLE;
+		sConfigInjected.InjectedOffset = 0;
+		sConfigInjected.InjectedOffsetNumber = ADC_OFFSET_NONE;
+		if (HAL_ADCEx_InjectedConfigChannel(&hadc2, &sConfigInjected) != HAL_OK) {
+			Error_Handler();
+		}
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Apply a new scan or analog watchdog setting. ADC2 has to be stopped to change them, so a running
+ * acquisition is restarted; the sample sequence number continues
+ */
+/****************************************************************************************************************/
+void acquisition_reconfigure(void) {
+	if (running) {
+		HAL_ADC_Stop_DMA(&hadc2);
+	}
+
+	acquisition_configure();
+
+	if (running) {
+		acquisition_run();
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Start ADC2 with DMA over two blocks of the current scan length and wait for the next sample. In
+ * ACQ_VREF_MODE_SLOW the filtered Vdd is seeded with one injected VREFINT conversion first
+ */
+/****************************************************************************************************************/
+static void acquisition_run(void) {
+	uint32_t sequence = latest_sample.sequence;
+
+	if (adc_calfact_valid) {												// CALFACT can only be written with ADC2 enabled and idle
+		if ((hadc2.Instance->CR & ADC_CR_ADEN) == 0) {
+			hadc2.Instance->ISR = ADC_ISR_ADRDY;
+			hadc2.Instance->CR |= ADC_CR_ADEN;
+			uint32_t start = HAL_GetTick();
+			while (((hadc2.Instance->ISR & ADC_ISR_ADRDY) == 0) && ((HAL_GetTick() - start) <= ACQ_TIMEOUT_MS));
+		}
+		if (HAL_ADCEx_Calibration_SetValue(&hadc2, ADC_SINGLE_ENDED, adc_calfact) != HAL_OK) {
+			Error_Handler();
+		}
+	}
+
+	vref_pending = false;
+	if (vref_mode == ACQ_VREF_MODE_SLOW) {
+		if ((HAL_ADCEx_InjectedStart(&hadc2) != HAL_OK) || (HAL_ADCEx_InjectedPollForConversion(&hadc2, 1) != HAL_OK)) {
+			Error_Handler();
+		}
+		vdd_filtered = acquisition_vref_to_vdd(HAL_ADCEx_InjectedGetValue(&hadc2, ADC_INJECTED_RANK_1));
+		vref_tick = HAL_GetTick();
+	}
+
+	if (HAL_ADC_Start_DMA(&hadc2, (uint32_t*)adc_buffer, 2 * ACQ_BLOCK_SCANS * scan_length) != HAL_OK) {
+		Error_Handler();
+	}
+	hadc2.Instance->IER &= ~ADC_IER_OVR;									// Enabled by the HAL; DR is overwritten, nothing to handle
+	running = true;
+
+	uint32_t start = HAL_GetTick();
+	uint32_t wait_ms = timeout_ms - sample_hold_ms;							// Two sample periods; ADC2 runs continuously here
+	while ((latest_sample.sequence == sequence) && ((HAL_GetTick() - start) <= wait_ms));
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Vdd from a single VREFINT conversion at the current resolution
+ */
+/****************************************************************************************************************/
+static float acquisition_vref_to_vdd(uint32_t vrefint_adc) {
+	vrefint_adc <<= (12 - resolution_bits);								// VREFINT_CAL is a 12-bit value
+	return (vrefint_adc == 0) ? 0 : 3.3f * vrefint_cal / vrefint_adc;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Sum one block of scans into the decimation sums and publish a sample when 4^n conversions are summed.
+ * Called in DMA interrupt context for every block; integer work only, the float work is done per sample
+ * @param block First conversion of the block in adc_buffer
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC static void acquisition_process_block(const uint16_t *block) {
+	uint32_t channel3_adc = 0;
+	uint32_t vrefint_adc = 0;
+	uint32_t channel4_adc = 0;
+
+	capture_process_block(block, scan_length);
+
+	for (int x = 0; x < ACQ_BLOCK_SCANS; x++) {								// Iterate over the block and sum the data
+		channel3_adc += block[0];
+		if (vrefint_index) {
+			vrefint_adc += block[vrefint_index];
+		}
+		if (channel4_index) {
+			channel4_adc += block[channel4_index];
+		}
+		block += scan_length;
+	}
+	if (vrefint_index && (vrefint_adc == 0)) {								// Not a valid scan; leave it out
+		return;
+	}
+
+	if (dec_blocks == 0) {
+		dec_code = 0;
+		dec_vrefint = 0;
+		dec_channel_4 = 0;
+	}
+	dec_code += channel3_adc;
+	dec_vrefint += vrefint_adc;
+	dec_channel_4 += channel4_adc;
+	dec_blocks++;
+
+	uint32_t blocks = 1UL << (2 * (oversample_bits - ACQ_OVERSAMPLE_BITS_MIN));
+	if (dec_blocks < blocks) {
+		return;
+	}
+	dec_blocks = 0;
+	acquisition_publish(blocks * ACQ_BLOCK_SCANS);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert the decimation sums to a sample, run PGA ranging on it and hand it to the consumers. Called in
+ * DMA interrupt context once per sample
+ * @param conversions Channel 3 conversions in the sums, 4^n
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC static void acquisition_publish(uint32_t conversions) {
+	// Vdd uses the ratio of sums, channel voltages divide by the number of conversions
+	float vdd = vdd_filtered;
+	if (vrefint_index) {
+		vdd = 3.3f * vrefint_cal * conversions / (dec_vrefint << (12 - resolution_bits));	// Get current Vdd value
+	}
+	float channel_3 = vdd * dec_code / (full_scale * conversions);			// Convert raw ADC data from channel 3
+	float channel_4 = vdd * dec_channel_4 / (full_scale * conversions);
+
+	if (pga_process_sample(&channel_3, vdd) == false) {						// OPAMP2 gain is settling; drop the sample
+		return;
+	}
+
+	// 4^n conversions summed, shifted right by n gives 12 + n bits; shift left to fill 16 bits
+	latest_sample.channel_3_code = (uint16_t) ((dec_code >> oversample_bits) << (16 - resolution_bits - oversample_bits));
+	latest_sample.channel_3 = channel_3;
+	latest_sample.channel_4 = channel_4;
+	latest_sample.vdd = vdd;
+	latest_sample.tick = HAL_GetTick();
+	latest_sample.timestamp_us = timebase_us();
+	latest_sample.sequence++;
+
+	autozero_accumulate(latest_sample.channel_3);
+	stats_accumulate(latest_sample.channel_3);
+	trend_accumulate(latest_sample.channel_3);
+	if (channel4_index) {
+		aux_input_update(latest_sample.channel_4);
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief DMA1 channel 2 interrupt, register level in place of HAL_DMA_IRQHandler(). Half transfer: the first block
+ * of adc_buffer is complete while the DMA fills the second one. Transfer complete: the second block is complete and
+ * the DMA wraps around to the first one. A transfer error disables the channel interrupts, as the HAL does; the
+ * samples then age out and acquisition_get_sample() reports the stall
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void acquisition_dma_irq_handler(void) {
+	uint32_t isr = DMA1->ISR;
+
+	if (isr & DMA_ISR_TEIF2) {
+		DMA1_Channel2->CCR &= ~(DMA_CCR_TEIE | DMA_CCR_TCIE | DMA_CCR_HTIE);
+		DMA1->IFCR = DMA_IFCR_CGIF2;
+		return;
+	}
+
+	if (isr & DMA_ISR_HTIF2) {
+		DMA1->IFCR = DMA_IFCR_CHTIF2;
+		acquisition_process_block(&adc_buffer[0]);
+	}
+
+	if (isr & DMA_ISR_TCIF2) {
+		DMA1->IFCR = DMA_IFCR_CTCIF2;
+		acquisition_process_block(&adc_buffer[ACQ_BLOCK_SCANS * scan_length]);
+	}
+
+	watchdog_checkin(WATCHDOG_ACQUISITION);
+}
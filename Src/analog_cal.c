@@ -0,0 +1,200 @@
+#include "analog_cal.h"
+#include "acquisition.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "pga.h"
+
+extern ADC_HandleTypeDef hadc2;
+extern OPAMP_HandleTypeDef hopamp2;
+
+static uint32_t period_min = ANALOG_CAL_DEFAULT_PERIOD_MIN;				// Recalibration period; 0 disables
+static uint32_t opamp_trim = 0;												// TrimmingValueP | TrimmingValueN << 8
+static uint32_t adc_calfact = 0;											// ADC2 single ended calibration factor
+static uint16_t status = 0;													// ANALOG_CAL_STATUS_x bits
+static uint16_t runs = 0;													// Calibrations since boot
+static uint32_t duration_ms = 0;											// Duration of the last calibration
+static uint32_t last_tick = 0;												// Tick of the last calibration or boot
+static bool requested = false;
+
+static bool analog_cal_run(void);
+
+/****************************************************************************************************************/
+/**
+ * @brief Apply the stored OPAMP2 trims and ADC2 calibration factor, or calibrate if none are stored. Call after
+ * OPAMP2 and ADC2 are initialized and before they are started
+ */
+/****************************************************************************************************************/
+void analog_cal_init(void) {
+	config_get(CONFIG_KEY_ANALOG_CAL_PERIOD, &period_min);
+
+	if (config_get(CONFIG_KEY_OPAMP_TRIM, &opamp_trim) && config_get(CONFIG_KEY_ADC_CALFACT, &adc_calfact)) {
+		hopamp2.Init.UserTrimming = OPAMP_TRIMMING_USER;
+		hopamp2.Init.TrimmingValueP = opamp_trim & 0x1F;
+		hopamp2.Init.TrimmingValueN = (opamp_trim >> 8) & 0x1F;
+		if (HAL_OPAMP_Init(&hopamp2) != HAL_OK) {
+			Error_Handler();
+		}
+		acquisition_set_adc_calibration(adc_calfact);
+		status = ANALOG_CAL_STATUS_RESTORED;
+	} else {
+		analog_cal_run();
+	}
+
+	last_tick = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Periodic recalibration, called from the main loop. Waits for a re-zero or gain calibration to finish,
+ * since both average the acquisition
+ * @param response_sent true if a Modbus response was sent in this loop iteration
+ */
+/****************************************************************************************************************/
+void analog_cal_task(bool response_sent) {
+	uint32_t now = HAL_GetTick();
+	uint32_t elapsed = now - last_tick;
+	uint32_t period_ms = period_min * 60000UL;
+
+	if (requested == false) {
+		if ((period_min == 0) || (elapsed < period_ms)) {
+			return;
+		}
+		if ((response_sent == false) && (elapsed - period_ms < ANALOG_CAL_FORCE_DELAY_MS)) {
+			return;
+		}
+	}
+	if ((get_calibration_status() & CAL_STATUS_REZERO_BUSY) || pga_calibrating()) {
+		return;
+	}
+
+	acquisition_stop();
+	analog_cal_run();
+	acquisition_resume();
+
+	requested = false;
+	last_tick = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Recalibrate in the next analog_cal_task() call
+ * @return false if a calibration is already requested
+ */
+/****************************************************************************************************************/
+bool analog_cal_request(void) {
+	if (requested) {
+		return false;
+	}
+	requested = true;
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read an analog calibration register
+ * @param reg Register address, MODBUS_REG_ANALOG_CAL_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool analog_cal_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_ANALOG_CAL_PERIOD_MIN:
+		*value = (uint16_t) period_min;
+		return true;
+
+	case MODBUS_REG_ANALOG_CAL_STATUS:
+		*value = status;
+		return true;
+
+	case MODBUS_REG_ANALOG_CAL_RUNS:
+		*value = runs;
+		return true;
+
+	case MODBUS_REG_ANALOG_CAL_DURATION_MS:
+		*value = (uint16_t) duration_ms;
+		return true;
+
+	case MODBUS_REG_ANALOG_CAL_OPAMP_TRIM_P:
+		*value = opamp_trim & 0x1F;
+		return true;
+
+	case MODBUS_REG_ANALOG_CAL_OPAMP_TRIM_N:
+		*value = (opamp_trim >> 8) & 0x1F;
+		return true;
+
+	case MODBUS_REG_ANALOG_CAL_ADC_CALFACT:
+		*value = (uint16_t) adc_calfact;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write an analog calibration register. The period is kept in the configuration store
+ * @param reg Register address, MODBUS_REG_ANALOG_CAL_x
+ * @param value
+ * @return false if the register does not exist or is read-only
+ */
+/****************************************************************************************************************/
+bool analog_cal_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_ANALOG_CAL_PERIOD_MIN:
+		period_min = value;
+		return config_set(CONFIG_KEY_ANALOG_CAL_PERIOD, period_min);
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Run the OPAMP2 and ADC2 self-calibrations and store the results. Acquisition must be stopped
+ * @return false if a calibration failed; the previous values stay in use
+ */
+/****************************************************************************************************************/
+static bool analog_cal_run(void) {
+	uint32_t start = HAL_GetTick();
+	bool opamp_running = (hopamp2.State == HAL_OPAMP_STATE_BUSY);
+	bool ok = true;
+
+	if (opamp_running) {
+		HAL_OPAMP_Stop(&hopamp2);
+	}
+
+	if (HAL_OPAMP_SelfCalibrate(&hopamp2) == HAL_OK) {
+		opamp_trim = hopamp2.Init.TrimmingValueP | (hopamp2.Init.TrimmingValueN << 8);
+	} else {
+		ok = false;
+	}
+
+	if (HAL_ADCEx_Calibration_Start(&hadc2, ADC_SINGLE_ENDED) == HAL_OK) {	// Leaves ADC2 disabled
+		adc_calfact = HAL_ADCEx_Calibration_GetValue(&hadc2, ADC_SINGLE_ENDED);
+		acquisition_set_adc_calibration(adc_calfact);
+	} else {
+		ok = false;
+	}
+
+	if (opamp_running) {
+		HAL_OPAMP_Start(&hopamp2);
+		pga_restore();														// Self-calibration leaves the gain setting as is; make sure
+	}
+
+	if (ok) {
+		config_set(CONFIG_KEY_OPAMP_TRIM, opamp_trim);
+		config_set(CONFIG_KEY_ADC_CALFACT, adc_calfact);
+		status &= ~ANALOG_CAL_STATUS_FAILED;
+	} else {
+		status |= ANALOG_CAL_STATUS_FAILED;
+	}
+
+	runs++;
+	duration_ms = HAL_GetTick() - start;
+	return ok;
+}
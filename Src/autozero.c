@@ -0,0 +1,280 @@
+#include "autozero.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include <math.h>
+
+#define AUTOZERO_DEFAULT_DEADBAND		2									// Flow units
+#define AUTOZERO_DEFAULT_HOLD_TIME		60									// s
+#define AUTOZERO_DEFAULT_TAU			600									// s
+
+static volatile float acc_sum = 0;											// Sum of block averages since last update; written by acquisition
+static volatile uint32_t acc_count = 0;
+
+static uint32_t control = 0;												// AUTOZERO_CONTROL_x bits
+static uint32_t deadband = AUTOZERO_DEFAULT_DEADBAND;						// |flow| below this counts as zero flow
+static uint32_t hold_time_s = AUTOZERO_DEFAULT_HOLD_TIME;					// Time within deadband before tracking starts; 0 disables
+static uint32_t tau_s = AUTOZERO_DEFAULT_TAU;								// Time constant of the zero estimator
+static bool modbus_valve_closed = false;									// Valve closed signal written over Modbus
+
+static float estimate = 0;													// Estimated zero drift relative to the calibrated zero, V
+static float correction = 0;												// Correction applied to the calibrated zero, slewed towards estimate
+static uint32_t quiet_ms = 0;												// Time the flow has been within the deadband
+static uint16_t status = 0;													// AUTOZERO_STATUS_x bits
+static uint32_t last_update_tick = 0;
+static uint32_t last_history_tick = 0;
+static uint32_t minute_tick = 0;											// HAL tick of the last whole minute counted
+static uint32_t uptime_minutes = 0;											// Minutes since boot, carried over the HAL tick wrap
+
+static AutozeroHistoryEntry history[AUTOZERO_HISTORY_SIZE];					// Drift history ring
+static uint8_t history_head = 0;
+static uint8_t history_count = 0;
+
+static void autozero_record_history(uint32_t now);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load auto-zero settings from the configuration store
+ */
+/****************************************************************************************************************/
+void autozero_init(void) {
+	config_get(CONFIG_KEY_AUTOZERO_CONTROL, &control);
+	config_get(CONFIG_KEY_AUTOZERO_DEADBAND, &deadband);
+	config_get(CONFIG_KEY_AUTOZERO_HOLD_TIME, &hold_time_s);
+	config_get(CONFIG_KEY_AUTOZERO_TAU, &tau_s);
+	if (tau_s == 0) {
+		tau_s = AUTOZERO_DEFAULT_TAU;
+	}
+
+	last_update_tick = HAL_GetTick();
+	last_history_tick = last_update_tick;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Add a channel 3 block average to the estimator input. Called by the acquisition callbacks (interrupt
+ * context) for every block; the estimator itself runs in autozero_task()
+ * @param voltage Channel 3 voltage, V
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void autozero_accumulate(float voltage) {
+	acc_sum += voltage;
+	acc_count++;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Auto-zero estimator, called from the main loop. Every AUTOZERO_UPDATE_PERIOD_MS the blocks accumulated
+ * since the last update are averaged; if the flow is known to be zero the drift estimate follows the average with
+ * time constant tau_s. The applied correction moves towards the estimate by at most AUTOZERO_MAX_STEP_V per update.
+ * @param zero_offset Calibrated zero, V
+ * @param step_per_liter Calibrated step per liter, V
+ */
+/****************************************************************************************************************/
+void autozero_task(float zero_offset, float step_per_liter) {
+	uint32_t now = HAL_GetTick();
+
+	if ((now - last_update_tick) < AUTOZERO_UPDATE_PERIOD_MS) {
+		return;
+	}
+	last_update_tick = now;
+
+	__disable_irq();														// Take the accumulated blocks
+	float sum = acc_sum;
+	uint32_t count = acc_count;
+	acc_sum = 0;
+	acc_count = 0;
+	__enable_irq();
+
+	if (((control & AUTOZERO_CONTROL_ENABLE) == 0) || (count == 0) || (step_per_liter <= 0)) {
+		status = 0;
+		quiet_ms = 0;
+		return;
+	}
+
+	float mean = sum / count;
+	float flow = (mean - (zero_offset + correction)) / step_per_liter;
+	bool valve_closed = modbus_valve_closed
+			|| ((control & AUTOZERO_CONTROL_GPIO) && (HAL_GPIO_ReadPin(VALVE_CLOSED_GPIO_Port, VALVE_CLOSED_Pin) == GPIO_PIN_RESET));
+
+	if (fabsf(flow) <= (float) deadband) {
+		if (quiet_ms < 0xFFFF0000UL) {
+			quiet_ms += AUTOZERO_UPDATE_PERIOD_MS;
+		}
+	} else {
+		quiet_ms = 0;
+	}
+	bool quiet = (hold_time_s > 0) && (quiet_ms >= hold_time_s * 1000UL);
+
+	status = 0;
+	if (valve_closed) status |= AUTOZERO_STATUS_VALVE_CLOSED;
+	if (quiet) status |= AUTOZERO_STATUS_QUIET;
+
+	if (valve_closed || quiet) {											// First order low pass with time constant tau_s
+		float alpha = (float) AUTOZERO_UPDATE_PERIOD_MS / (tau_s * 1000.0f);
+		estimate += ((mean - zero_offset) - estimate) * alpha;
+		status |= AUTOZERO_STATUS_TRACKING;
+	}
+	if (fabsf(estimate) > AUTOZERO_MAX_CORRECTION_V) {						// Drift this large is a fault, not drift
+		estimate = (estimate > 0) ? AUTOZERO_MAX_CORRECTION_V : -AUTOZERO_MAX_CORRECTION_V;
+		status |= AUTOZERO_STATUS_LIMIT;
+	}
+
+	float step = estimate - correction;										// Slew limit the applied correction
+	if (step > AUTOZERO_MAX_STEP_V) step = AUTOZERO_MAX_STEP_V;
+	if (step < -AUTOZERO_MAX_STEP_V) step = -AUTOZERO_MAX_STEP_V;
+	correction += step;
+
+	if ((now - last_history_tick) >= AUTOZERO_HISTORY_PERIOD_MS) {
+		last_history_tick = now;
+		autozero_record_history(now);
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Drop the drift estimate after the sensor has been calibrated
+ */
+/****************************************************************************************************************/
+void autozero_reset(void) {
+	estimate = 0;
+	correction = 0;
+	quiet_ms = 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Correction to add to the calibrated zero offset
+ * @return Correction, V
+ */
+/****************************************************************************************************************/
+float autozero_correction(void) {
+	return correction;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Set the valve closed signal
+ */
+/****************************************************************************************************************/
+void autozero_set_valve_closed(bool closed) {
+	modbus_valve_closed = closed;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read an auto-zero register
+ * @param reg Register address, MODBUS_REG_AUTOZERO_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool autozero_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_AUTOZERO_HISTORY) && (reg < MODBUS_REG_AUTOZERO_HISTORY + 2 * AUTOZERO_HISTORY_SIZE)) {
+		uint16_t n = (reg - MODBUS_REG_AUTOZERO_HISTORY) / 2;				// Entry number, 0 is the newest
+		if (n >= history_count) {
+			*value = 0;
+			return true;
+		}
+		const AutozeroHistoryEntry *e = &history[(history_head + AUTOZERO_HISTORY_SIZE - 1 - n) % AUTOZERO_HISTORY_SIZE];
+		*value = ((reg - MODBUS_REG_AUTOZERO_HISTORY) & 1) ? (uint16_t) e->drift_uv : e->minutes;
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_AUTOZERO_CONTROL:
+		*value = (uint16_t) control;
+		return true;
+
+	case MODBUS_REG_AUTOZERO_VALVE_CLOSED:
+		*value = modbus_valve_closed;
+		return true;
+
+	case MODBUS_REG_AUTOZERO_DEADBAND:
+		*value = (uint16_t) deadband;
+		return true;
+
+	case MODBUS_REG_AUTOZERO_HOLD_TIME:
+		*value = (uint16_t) hold_time_s;
+		return true;
+
+	case MODBUS_REG_AUTOZERO_TAU:
+		*value = (uint16_t) tau_s;
+		return true;
+
+	case MODBUS_REG_AUTOZERO_STATUS:
+		*value = status;
+		return true;
+
+	case MODBUS_REG_AUTOZERO_CORRECTION_UV:
+		*value = (uint16_t) (int16_t) (correction * 1000000.0f);
+		return true;
+
+	case MODBUS_REG_AUTOZERO_HISTORY_COUNT:
+		*value = history_count;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write an auto-zero register. Settings are kept in the configuration store
+ * @param reg Register address, MODBUS_REG_AUTOZERO_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool autozero_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_AUTOZERO_CONTROL:
+		if (value & ~(AUTOZERO_CONTROL_ENABLE | AUTOZERO_CONTROL_GPIO)) {
+			return false;
+		}
+		control = value;
+		return config_set(CONFIG_KEY_AUTOZERO_CONTROL, control);
+
+	case MODBUS_REG_AUTOZERO_VALVE_CLOSED:
+		autozero_set_valve_closed(value != 0);
+		return true;
+
+	case MODBUS_REG_AUTOZERO_DEADBAND:
+		deadband = value;
+		return config_set(CONFIG_KEY_AUTOZERO_DEADBAND, deadband);
+
+	case MODBUS_REG_AUTOZERO_HOLD_TIME:
+		hold_time_s = value;
+		return config_set(CONFIG_KEY_AUTOZERO_HOLD_TIME, hold_time_s);
+
+	case MODBUS_REG_AUTOZERO_TAU:
+		if (value == 0) {
+			return false;
+		}
+		tau_s = value;
+		return config_set(CONFIG_KEY_AUTOZERO_TAU, tau_s);
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Add the current correction to the drift history
+ */
+/****************************************************************************************************************/
+static void autozero_record_history(uint32_t now) {
+	uint32_t whole = (now - minute_tick) / 60000UL;
+
+	minute_tick += whole * 60000UL;
+	uptime_minutes += whole;
+	history[history_head].minutes = (uint16_t) uptime_minutes;				// Wraps every 45.5 days
+	history[history_head].drift_uv = (int16_t) (correction * 1000000.0f);
+	history_head = (history_head + 1) % AUTOZERO_HISTORY_SIZE;
+	if (history_count < AUTOZERO_HISTORY_SIZE) {
+		history_count++;
+	}
+}
@@ -0,0 +1,178 @@
+#include "aux_input.h"
+#include "acquisition.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+
+#define AUX_DEFAULT_FILTER			4
+#define AUX_DEFAULT_ZERO_MV			0
+#define AUX_DEFAULT_SPAN_MV			3300
+#define AUX_DEFAULT_FULL_SCALE		3300									// Default scaling reads the input in mV
+
+static uint32_t control = 0;												// AUX_CONTROL_x bits
+static uint32_t filter_shift = AUX_DEFAULT_FILTER;
+static uint32_t zero_mv = AUX_DEFAULT_ZERO_MV;
+static uint32_t span_mv = AUX_DEFAULT_SPAN_MV;
+static int32_t full_scale = AUX_DEFAULT_FULL_SCALE;
+
+static volatile float voltage = 0;											// Filtered channel 4 voltage, V; written by acquisition
+static volatile bool primed = false;										// First block loads the filter directly
+
+/****************************************************************************************************************/
+/**
+ * @brief Load the auxiliary input settings and select the ADC2 scan. Call before acquisition_start()
+ */
+/****************************************************************************************************************/
+void aux_input_init(void) {
+	uint32_t temp = 0;
+
+	config_get(CONFIG_KEY_AUX_CONTROL, &control);
+	config_get(CONFIG_KEY_AUX_FILTER, &filter_shift);
+	config_get(CONFIG_KEY_AUX_ZERO_MV, &zero_mv);
+	config_get(CONFIG_KEY_AUX_SPAN_MV, &span_mv);
+	if (config_get(CONFIG_KEY_AUX_FULL_SCALE, &temp)) {
+		full_scale = (int32_t) temp;
+	}
+	if (filter_shift > AUX_FILTER_SHIFT_MAX) {
+		filter_shift = AUX_DEFAULT_FILTER;
+	}
+
+	acquisition_set_channel_4(control & AUX_CONTROL_ENABLE);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Filter a channel 4 block average. Called by the acquisition callbacks (interrupt context) for every block
+ * while channel 4 is scanned
+ * @param v Channel 4 voltage, V
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void aux_input_update(float v) {
+	if (primed == false) {
+		voltage = v;
+		primed = true;
+		return;
+	}
+	voltage += (v - voltage) / (1 << filter_shift);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Auxiliary input enabled
+ */
+/****************************************************************************************************************/
+bool aux_input_enabled(void) {
+	return (control & AUX_CONTROL_ENABLE) != 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Filtered input voltage
+ * @return Voltage, V; 0 if the input is disabled
+ */
+/****************************************************************************************************************/
+float aux_input_voltage(void) {
+	return aux_input_enabled() ? voltage : 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Input scaled linearly: zero_mv reads as 0, span_mv reads as full_scale
+ */
+/****************************************************************************************************************/
+float aux_input_value(void) {
+	if (span_mv == zero_mv) {
+		return 0;
+	}
+	return (aux_input_voltage() * 1000.0f - (float) zero_mv) * full_scale / ((float) span_mv - (float) zero_mv);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read an auxiliary input register
+ * @param reg Register address, MODBUS_REG_AUX_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool aux_input_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_AUX_CONTROL:
+		*value = (uint16_t) control;
+		return true;
+
+	case MODBUS_REG_AUX_FILTER:
+		*value = (uint16_t) filter_shift;
+		return true;
+
+	case MODBUS_REG_AUX_ZERO_MV:
+		*value = (uint16_t) zero_mv;
+		return true;
+
+	case MODBUS_REG_AUX_SPAN_MV:
+		*value = (uint16_t) span_mv;
+		return true;
+
+	case MODBUS_REG_AUX_FULL_SCALE:
+		*value = (uint16_t) (int16_t) full_scale;
+		return true;
+
+	case MODBUS_REG_AUX_VOLTAGE:
+		*value = (uint16_t) (aux_input_voltage() * 10000.0f);
+		return true;
+
+	case MODBUS_REG_AUX_VALUE:
+		*value = (uint16_t) (int16_t) aux_input_value();
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write an auxiliary input register. Settings are kept in the configuration store; enabling or disabling
+ * the input restarts the acquisition with the new scan
+ * @param reg Register address, MODBUS_REG_AUX_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool aux_input_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_AUX_CONTROL:
+		if (value & ~AUX_CONTROL_ENABLE) {
+			return false;
+		}
+		if ((value & AUX_CONTROL_ENABLE) && !aux_input_enabled()) {
+			primed = false;
+		}
+		control = value;
+		acquisition_set_channel_4(control & AUX_CONTROL_ENABLE);
+		return config_set(CONFIG_KEY_AUX_CONTROL, control);
+
+	case MODBUS_REG_AUX_FILTER:
+		if (value > AUX_FILTER_SHIFT_MAX) {
+			return false;
+		}
+		filter_shift = value;
+		return config_set(CONFIG_KEY_AUX_FILTER, filter_shift);
+
+	case MODBUS_REG_AUX_ZERO_MV:
+		zero_mv = value;
+		return config_set(CONFIG_KEY_AUX_ZERO_MV, zero_mv);
+
+	case MODBUS_REG_AUX_SPAN_MV:
+		span_mv = value;
+		return config_set(CONFIG_KEY_AUX_SPAN_MV, span_mv);
+
+	case MODBUS_REG_AUX_FULL_SCALE:
+		full_scale = (int16_t) value;
+		return config_set(CONFIG_KEY_AUX_FULL_SCALE, (uint32_t) full_scale);
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,309 @@
+#include "capture.h"
+#include "acquisition.h"
+#include "pga.h"
+#include "modbus_registers.h"
+#include "sample_codec.h"
+
+static uint16_t buffer[CAPTURE_SIZE];										// Ring while capturing; oldest value at start once done
+static volatile uint8_t state = CAPTURE_STATE_IDLE;							// CAPTURE_STATE_x; written by acquisition
+static volatile uint16_t head = 0;											// Next value to write
+static volatile uint16_t collected = 0;										// Values written since arming, up to CAPTURE_SIZE
+static volatile uint16_t remaining = 0;										// Post-trigger values still to write
+static volatile uint16_t start = 0;											// Oldest value of the frozen buffer
+static volatile uint16_t trigger_index = 0;									// Position of the trigger in the frozen buffer
+static uint32_t divider_sum = 0;											// Conversions summed for the next value
+static uint16_t divider_count = 0;
+
+static uint16_t trigger_mode = CAPTURE_TRIGGER_RISING;						// CAPTURE_TRIGGER_x
+static uint16_t trigger_mv = 1000;											// Level, or change for CAPTURE_TRIGGER_SLOPE, mV at the ADC input
+static uint16_t trigger_code = 0;											// trigger_mv as an ADC code, set when armed
+static uint16_t pre_samples = CAPTURE_SIZE / 4;
+static uint16_t divider_shift = 0;
+
+static uint32_t sample_rate_hz = 0;											// Captured with the buffer
+static uint16_t full_scale = 0;
+static uint16_t vdd_mv = 0;
+static uint8_t gain = 1;
+
+static SampleCodecChunk packed;												// Compressed chunk being read
+static bool packed_valid = false;
+
+_Static_assert(sizeof(buffer) <= CAPTURE_RAM_BUDGET, "capture buffer exceeds CAPTURE_RAM_BUDGET");
+_Static_assert((CAPTURE_SIZE & (CAPTURE_SIZE - 1)) == 0, "CAPTURE_SIZE must be a power of 2");
+_Static_assert(MODBUS_REG_CAPTURE_DATA_END - MODBUS_REG_CAPTURE_DATA_BASE == CAPTURE_SIZE, "capture data window size");
+_Static_assert(MODBUS_REG_CAPTURE_PACKED_STRIDE >= SAMPLE_CODEC_MAX_WORDS, "compressed chunk window size");
+_Static_assert((MODBUS_REG_CAPTURE_PACKED_END - MODBUS_REG_CAPTURE_PACKED_BASE) / MODBUS_REG_CAPTURE_PACKED_STRIDE
+		== CAPTURE_SIZE / SAMPLE_CODEC_CHUNK_VALUES, "compressed chunk windows");
+
+static void capture_arm(void);
+static uint16_t capture_value(void *context, uint16_t n);
+static bool capture_triggered(uint16_t value);
+
+/****************************************************************************************************************/
+/**
+ * @brief Capture the channel 3 conversions of one block. Called by the acquisition callbacks (interrupt context)
+ * for every block before it is averaged
+ * @param block First conversion of the block
+ * @param scan_length Conversions per scan; channel 3 is the first of each scan
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void capture_process_block(const uint16_t *block, uint8_t scan_length) {
+	if ((state != CAPTURE_STATE_ARMED) && (state != CAPTURE_STATE_TRIGGERED)) {
+		return;
+	}
+
+	for (int x = 0; x < ACQ_BLOCK_SCANS; x++, block += scan_length) {
+		divider_sum += block[0];
+		if (++divider_count < (1U << divider_shift)) {
+			continue;
+		}
+		uint16_t value = (uint16_t) (divider_sum >> divider_shift);
+		divider_sum = 0;
+		divider_count = 0;
+
+		if ((state == CAPTURE_STATE_ARMED) && (collected >= pre_samples) && capture_triggered(value)) {
+			state = CAPTURE_STATE_TRIGGERED;
+			remaining = CAPTURE_SIZE - pre_samples;
+			trigger_index = pre_samples;
+			gain = pga_gain();
+		}
+
+		buffer[head] = value;
+		head = (head + 1) & (CAPTURE_SIZE - 1);
+		if (collected < CAPTURE_SIZE) {
+			collected++;
+		}
+
+		if ((state == CAPTURE_STATE_TRIGGERED) && (--remaining == 0)) {
+			start = head;
+			state = CAPTURE_STATE_DONE;
+			return;
+		}
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Drop a running capture. Called when the acquisition is reconfigured, which changes the rate and scale of
+ * the values; a frozen buffer is kept
+ */
+/****************************************************************************************************************/
+void capture_abort(void) {
+	if ((state == CAPTURE_STATE_ARMED) || (state == CAPTURE_STATE_TRIGGERED)) {
+		state = CAPTURE_STATE_IDLE;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check if a capture is armed or filling its post-trigger part
+ */
+/****************************************************************************************************************/
+bool capture_active(void) {
+	return (state == CAPTURE_STATE_ARMED) || (state == CAPTURE_STATE_TRIGGERED);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a capture register. Buffer values are only returned once the capture is done
+ * @param reg Register address, MODBUS_REG_CAPTURE_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool capture_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_CAPTURE_DATA_BASE) && (reg < MODBUS_REG_CAPTURE_DATA_END)) {
+		uint16_t n = reg - MODBUS_REG_CAPTURE_DATA_BASE;
+		*value = (state == CAPTURE_STATE_DONE) ? buffer[(start + n) & (CAPTURE_SIZE - 1)] : 0;
+		return true;
+	}
+
+	if ((reg >= MODBUS_REG_CAPTURE_PACKED_BASE) && (reg < MODBUS_REG_CAPTURE_PACKED_END)) {
+		uint16_t chunk = (reg - MODBUS_REG_CAPTURE_PACKED_BASE) / MODBUS_REG_CAPTURE_PACKED_STRIDE;
+		uint16_t n = (reg - MODBUS_REG_CAPTURE_PACKED_BASE) % MODBUS_REG_CAPTURE_PACKED_STRIDE;
+
+		if ((packed_valid == false) || (packed.index != chunk)) {			// Encode the chunk once per download
+			uint16_t count = (state == CAPTURE_STATE_DONE) ? SAMPLE_CODEC_CHUNK_VALUES : 0;
+			sample_codec_chunk_init(&packed, capture_value, NULL, chunk, chunk * SAMPLE_CODEC_CHUNK_VALUES, count);
+			packed_valid = (state == CAPTURE_STATE_DONE);
+		}
+		*value = sample_codec_chunk_word(&packed, n);
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_CAPTURE_STATE:
+		*value = state;
+		return true;
+
+	case MODBUS_REG_CAPTURE_TRIGGER_MODE:
+		*value = trigger_mode;
+		return true;
+
+	case MODBUS_REG_CAPTURE_TRIGGER_MV:
+		*value = trigger_mv;
+		return true;
+
+	case MODBUS_REG_CAPTURE_PRE_SAMPLES:
+		*value = pre_samples;
+		return true;
+
+	case MODBUS_REG_CAPTURE_DIVIDER_SHIFT:
+		*value = divider_shift;
+		return true;
+
+	case MODBUS_REG_CAPTURE_SAMPLE_RATE_HZ:
+		*value = (uint16_t) (sample_rate_hz >> 16);
+		return true;
+
+	case MODBUS_REG_CAPTURE_SAMPLE_RATE_HZ + 1:
+		*value = (uint16_t) sample_rate_hz;
+		return true;
+
+	case MODBUS_REG_CAPTURE_COUNT:
+		*value = collected;
+		return true;
+
+	case MODBUS_REG_CAPTURE_TRIGGER_INDEX:
+		*value = trigger_index;
+		return true;
+
+	case MODBUS_REG_CAPTURE_FULL_SCALE:
+		*value = full_scale;
+		return true;
+
+	case MODBUS_REG_CAPTURE_VDD_MV:
+		*value = vdd_mv;
+		return true;
+
+	case MODBUS_REG_CAPTURE_GAIN:
+		*value = gain;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a capture register. Settings are not stored and can only be changed while no capture is running
+ * @param reg Register address, MODBUS_REG_CAPTURE_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool capture_write_register(uint16_t reg, uint16_t value) {
+	bool running = (state == CAPTURE_STATE_ARMED) || (state == CAPTURE_STATE_TRIGGERED);
+
+	switch (reg) {
+	case MODBUS_REG_CAPTURE_STATE:
+		if (value == CAPTURE_STATE_IDLE) {
+			state = CAPTURE_STATE_IDLE;
+		} else if (value == CAPTURE_STATE_ARMED) {
+			capture_arm();
+		} else if ((value == CAPTURE_STATE_TRIGGERED) && (state == CAPTURE_STATE_ARMED)) {
+			__disable_irq();												// Force the trigger; the pre-trigger part may be short
+			trigger_index = (collected < pre_samples) ? collected : pre_samples;
+			remaining = CAPTURE_SIZE - trigger_index;
+			state = CAPTURE_STATE_TRIGGERED;
+			gain = pga_gain();
+			__enable_irq();
+		} else {
+			return false;
+		}
+		return true;
+
+	case MODBUS_REG_CAPTURE_TRIGGER_MODE:
+		if (running || (value > CAPTURE_TRIGGER_SLOPE)) {
+			return false;
+		}
+		trigger_mode = value;
+		return true;
+
+	case MODBUS_REG_CAPTURE_TRIGGER_MV:
+		if (running) {
+			return false;
+		}
+		trigger_mv = value;
+		return true;
+
+	case MODBUS_REG_CAPTURE_PRE_SAMPLES:
+		if (running || (value >= CAPTURE_SIZE)) {
+			return false;
+		}
+		pre_samples = value;
+		return true;
+
+	case MODBUS_REG_CAPTURE_DIVIDER_SHIFT:
+		if (running || (value > CAPTURE_DIVIDER_SHIFT_MAX)) {
+			return false;
+		}
+		divider_shift = value;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Take the scale of the values and start a capture
+ */
+/****************************************************************************************************************/
+static void capture_arm(void) {
+	float vdd = acquisition_get_vdd();
+
+	if (vdd <= 0) {
+		vdd = 3.3f;
+	}
+	full_scale = acquisition_full_scale();
+	vdd_mv = (uint16_t) (vdd * 1000.0f);
+	sample_rate_hz = (uint32_t) (acquisition_scan_rate() / (1U << divider_shift) + 0.5f);
+	trigger_code = (uint16_t) ((uint32_t) trigger_mv * full_scale / vdd_mv);
+	gain = pga_gain();
+
+	packed_valid = false;
+	__disable_irq();
+	head = 0;
+	collected = 0;
+	divider_sum = 0;
+	divider_count = 0;
+	state = CAPTURE_STATE_ARMED;
+	__enable_irq();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Value n of the frozen buffer, the source of the compressed download
+ */
+/****************************************************************************************************************/
+static uint16_t capture_value(void *context, uint16_t n) {
+	return buffer[(start + n) & (CAPTURE_SIZE - 1)];
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check the trigger condition for a new value, before it is written
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC static bool capture_triggered(uint16_t value) {
+	uint16_t previous = buffer[(head - 1) & (CAPTURE_SIZE - 1)];
+
+	switch (trigger_mode) {
+	case CAPTURE_TRIGGER_RISING:
+		return (collected > 0) && (previous < trigger_code) && (value >= trigger_code);
+
+	case CAPTURE_TRIGGER_FALLING:
+		return (collected > 0) && (previous > trigger_code) && (value <= trigger_code);
+
+	default:
+		if (collected < CAPTURE_SLOPE_SPAN) {
+			return false;
+		}
+		previous = buffer[(head - CAPTURE_SLOPE_SPAN) & (CAPTURE_SIZE - 1)];
+		return (value >= previous + trigger_code) || (previous >= value + trigger_code);
+	}
+}
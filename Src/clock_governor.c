@@ -0,0 +1,232 @@
+#include "clock_governor.h"
+#include "capture.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "pga.h"
+#include "rs485_modbus_rtu.h"
+#include "scheduler.h"
+#include "timebase.h"
+
+#define CLOCK_GOV_HIGH_HZ			72000000UL								// PLL, HSE x 9
+#define CLOCK_GOV_LOW_HZ			HSE_VALUE
+
+extern UART_HandleTypeDef huart2;
+
+static uint32_t control = 0;												// CLOCK_GOV_CONTROL_x bits
+static bool low = false;													// SYSCLK is the HSE
+static uint32_t demand_tick = 0;											// Last time the speed was needed
+static uint32_t switch_tick = 0;											// Last switch
+static uint16_t switches = 0;												// Since boot
+static uint16_t down_us = 0;												// Duration of the last switch to 8 MHz
+static uint16_t up_us = 0;													// Duration of the last switch to 72 MHz
+
+static uint32_t stats_tick = 0;												// Start of the residency window
+static uint32_t low_ms = 0;													// Time at 8 MHz in the current window, up to low_tick
+static uint32_t low_tick = 0;												// Start of the current time at 8 MHz
+static uint16_t low_permil = 0;
+static uint16_t saving_ua = 0;
+
+static void clock_governor_switch(bool to_low);
+static void clock_governor_statistics(uint32_t now);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load the governor settings. The clock starts at 72 MHz
+ */
+/****************************************************************************************************************/
+void clock_governor_init(void) {
+	config_get(CONFIG_KEY_CLOCK_GOV_CONTROL, &control);
+	control &= CLOCK_GOV_CONTROL_ENABLE;
+
+	demand_tick = HAL_GetTick();
+	switch_tick = demand_tick;
+	stats_tick = demand_tick;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Select SYSCLK, called first in every scheduler pass
+ */
+/****************************************************************************************************************/
+void clock_governor_task(void) {
+	uint32_t now = HAL_GetTick();
+	bool demand = (modbus_command_available() != 0) || (modbus_bus_idle() == false) || capture_active()
+			|| pga_calibrating() || (get_calibration_status() & CAL_STATUS_REZERO_BUSY);
+
+	clock_governor_statistics(now);
+
+	if (demand || ((control & CLOCK_GOV_CONTROL_ENABLE) == 0)) {
+		demand_tick = now;
+		if (low) {
+			clock_governor_switch(false);
+		}
+		return;
+	}
+
+	if ((now - switch_tick) < CLOCK_GOV_SETTLE_MS) {						// The load still includes the other clock
+		return;
+	}
+
+	uint16_t load = scheduler_load_permil();
+	if (low) {
+		if (load > CLOCK_GOV_UP_LOAD_PERMIL) {
+			clock_governor_switch(false);
+		}
+	} else if (((now - demand_tick) >= CLOCK_GOV_HOLD_MS) && (load < CLOCK_GOV_DOWN_LOAD_PERMIL)) {
+		clock_governor_switch(true);
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a clock governor register
+ * @param reg Register address, MODBUS_REG_CLK_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool clock_governor_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_CLK_CONTROL:
+		*value = (uint16_t) control;
+		return true;
+
+	case MODBUS_REG_CLK_SYSCLK_MHZ:
+		*value = (uint16_t) (SystemCoreClock / 1000000);
+		return true;
+
+	case MODBUS_REG_CLK_LOW_PERMIL:
+		*value = low_permil;
+		return true;
+
+	case MODBUS_REG_CLK_SWITCHES:
+		*value = switches;
+		return true;
+
+	case MODBUS_REG_CLK_DOWN_US:
+		*value = down_us;
+		return true;
+
+	case MODBUS_REG_CLK_UP_US:
+		*value = up_us;
+		return true;
+
+	case MODBUS_REG_CLK_SAVING_UA:
+		*value = saving_ua;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a clock governor register. The control bits are kept in the configuration store
+ * @param reg Register address, MODBUS_REG_CLK_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool clock_governor_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_CLK_CONTROL:
+		if (value & ~CLOCK_GOV_CONTROL_ENABLE) {
+			return false;
+		}
+		control = value;
+		return config_set(CONFIG_KEY_CLOCK_GOV_CONTROL, control);
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Switch SYSCLK between the PLL and the HSE and update everything that depends on it. The flash latency is
+ * raised before and lowered after the switch. The duration counts the cycles before the switch at the old clock
+ * and the cycles after it at the new one
+ * @param to_low true for 8 MHz
+ */
+/****************************************************************************************************************/
+static void clock_governor_switch(bool to_low) {
+	uint32_t old_hz = SystemCoreClock;
+	uint32_t start = DWT->CYCCNT;
+
+	if (to_low) {
+		RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSE;
+		while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSE);
+	} else {
+		__HAL_FLASH_SET_LATENCY(FLASH_LATENCY_2);
+		while (__HAL_FLASH_GET_LATENCY() != FLASH_LATENCY_2);
+		RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_PLL;
+		while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+	}
+	uint32_t switched = DWT->CYCCNT;
+
+	SystemCoreClock = to_low ? CLOCK_GOV_LOW_HZ : CLOCK_GOV_HIGH_HZ;
+	if (to_low) {
+		__HAL_FLASH_SET_LATENCY(FLASH_LATENCY_0);
+	}
+	HAL_InitTick(uwTickPrio);												// SysTick reload for 1 ms at the new clock
+	USART2->CR1 &= ~USART_CR1_UE;											// BRR is only writable with the USART disabled
+	USART2->BRR = UART_DIV_SAMPLING16(HAL_RCC_GetPCLK1Freq(), huart2.Init.BaudRate);
+	USART2->CR1 |= USART_CR1_UE;
+	timebase_clock_changed();												// TIM2 prescaler for PCLK1
+	scheduler_clock_changed(old_hz);
+
+	uint32_t us = (switched - start) / (old_hz / 1000000) + (DWT->CYCCNT - switched) / (SystemCoreClock / 1000000);
+	if (to_low) {
+		down_us = (uint16_t) us;
+	} else {
+		up_us = (uint16_t) us;
+	}
+
+	uint32_t now = HAL_GetTick();
+	if (to_low) {
+		low_tick = now;
+	} else {
+		low_ms += now - low_tick;
+	}
+	low = to_low;
+	switch_tick = now;
+	switches++;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Close the residency window every CLOCK_GOV_STATS_PERIOD_MS and estimate the average current saved. The
+ * same work at 72 MHz takes 1/9 of the awake time at 8 MHz
+ */
+/****************************************************************************************************************/
+static void clock_governor_statistics(uint32_t now) {
+	uint32_t elapsed = now - stats_tick;
+
+	if (elapsed < CLOCK_GOV_STATS_PERIOD_MS) {
+		return;
+	}
+
+	uint32_t ms = low_ms;
+	if (low) {
+		ms += now - low_tick;
+		low_tick = now;
+	}
+	low_permil = (uint16_t) ((ms >= elapsed) ? 1000 : (ms * 1000UL) / elapsed);
+
+	float load = scheduler_load_permil() / 1000.0f;
+	float awake_high = low ? load / (CLOCK_GOV_HIGH_HZ / CLOCK_GOV_LOW_HZ) : load;
+	float awake_low = awake_high * (CLOCK_GOV_HIGH_HZ / CLOCK_GOV_LOW_HZ);
+	if (awake_low > 1.0f) {
+		awake_low = 1.0f;
+	}
+	float high_ua = awake_high * CLOCK_GOV_IDD_RUN_72_UA + (1.0f - awake_high) * CLOCK_GOV_IDD_SLEEP_72_UA;
+	float low_ua = awake_low * CLOCK_GOV_IDD_RUN_8_UA + (1.0f - awake_low) * CLOCK_GOV_IDD_SLEEP_8_UA;
+	float saving = (high_ua - low_ua) * low_permil / 1000.0f;
+	saving_ua = (uint16_t) ((saving > 0) ? saving : 0);
+
+	stats_tick = now;
+	low_ms = 0;
+}
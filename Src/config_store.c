@@ -0,0 +1,297 @@
+#include "config_store.h"
+#include "rs485_modbus_rtu.h"
+#include <stddef.h>
+#include <string.h>
+
+#define CONFIG_PAGE_MAGIC			0x43464731UL						// "CFG1"
+#define CONFIG_RECORD_ERASED		0xFFFFU
+
+// Page header, placed at the start of each config page. Written after the records when a page is compacted
+typedef struct ConfigPageHeader {
+	uint32_t	magic;
+	uint32_t	generation;
+}ConfigPageHeader;
+
+// Single record in a config page. Written key first, value second and CRC last, so a torn write fails the CRC check
+typedef struct ConfigRecord {
+	uint16_t	key;
+	uint16_t	crc;
+	uint32_t	value;
+}ConfigRecord;
+
+#define CONFIG_RECORDS_PER_PAGE		((CONFIG_PAGE_SIZE - sizeof(ConfigPageHeader)) / sizeof(ConfigRecord))
+
+static uint32_t config_cache[CONFIG_KEY_COUNT];								// RAM copy of the latest value of each key
+static uint64_t config_valid = 0;											// Bit n set if key n has a value
+_Static_assert(CONFIG_KEY_COUNT <= 64, "config_valid holds 64 keys");
+static uint32_t active_page = CONFIG_PAGE_A_ADDRESS;						// Address of the active page
+static uint32_t next_record = 0;											// Index of the next free record in the active page
+static uint32_t page_generation = 0;										// Generation of the active page; increases on each compaction
+
+static uint16_t config_record_crc(uint16_t key, uint32_t value);
+static bool config_page_erase(uint32_t page);
+static bool config_record_write(uint32_t page, uint32_t index, uint16_t key, uint32_t value);
+static bool config_page_write_header(uint32_t page, uint32_t generation);
+static void config_page_load(uint32_t page);
+
+/****************************************************************************************************************/
+/**
+ * @brief Find the active configuration page and load all stored values in RAM. If no valid page is found,
+ * page A is formatted. Requires the CRC unit to be initialized (MX_CRC_Init)
+ */
+/****************************************************************************************************************/
+void config_store_init(void) {
+	const ConfigPageHeader *header_a = (const ConfigPageHeader *) CONFIG_PAGE_A_ADDRESS;
+	const ConfigPageHeader *header_b = (const ConfigPageHeader *) CONFIG_PAGE_B_ADDRESS;
+	bool a_valid = (header_a->magic == CONFIG_PAGE_MAGIC);
+	bool b_valid = (header_b->magic == CONFIG_PAGE_MAGIC);
+
+	config_valid = 0;
+
+	if (a_valid && b_valid) {												// Both pages valid - compaction was interrupted before the old page was reused
+		if (header_b->generation > header_a->generation) {
+			active_page = CONFIG_PAGE_B_ADDRESS;
+		} else {
+			active_page = CONFIG_PAGE_A_ADDRESS;
+		}
+	} else if (a_valid) {
+		active_page = CONFIG_PAGE_A_ADDRESS;
+	} else if (b_valid) {
+		active_page = CONFIG_PAGE_B_ADDRESS;
+	} else {																// Blank or corrupted store
+		if ((config_page_erase(CONFIG_PAGE_A_ADDRESS) == false) || (config_page_write_header(CONFIG_PAGE_A_ADDRESS, 1) == false)) {
+			Error_Handler();
+		}
+		active_page = CONFIG_PAGE_A_ADDRESS;
+	}
+
+	page_generation = ((const ConfigPageHeader *) active_page)->generation;
+	config_page_load(active_page);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a configuration value from the RAM cache
+ * @param key
+ * @param value Not modified if the key has never been written
+ * @return true if the key has a stored value
+ */
+/****************************************************************************************************************/
+bool config_get(ConfigKey key, uint32_t *value) {
+	if ((key >= CONFIG_KEY_COUNT) || ((config_valid & (1ULL << key)) == 0)) {
+		return false;
+	}
+
+	*value = config_cache[key];
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a float configuration value from the RAM cache
+ */
+/****************************************************************************************************************/
+bool config_get_float(ConfigKey key, float *value) {
+	uint32_t raw;
+
+	if (config_get(key, &raw) == false) {
+		return false;
+	}
+
+	memcpy(value, &raw, sizeof(float));
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Store a configuration value. Nothing is written if the value did not change. If the active page is full,
+ * the store is compacted into the other page first.
+ * @note Blocks while flash is programmed; the CPU stalls for a page erase (~40ms) during compaction.
+ * Not to be called from interrupt context
+ * @param key
+ * @param value
+ * @return true on success
+ */
+/****************************************************************************************************************/
+bool config_set(ConfigKey key, uint32_t value) {
+	if (key >= CONFIG_KEY_COUNT) {
+		return false;
+	}
+
+	if ((config_valid & (1ULL << key)) && (config_cache[key] == value)) {
+		return true;
+	}
+
+	config_cache[key] = value;
+	config_valid |= (1ULL << key);
+
+	if (next_record < CONFIG_RECORDS_PER_PAGE) {							// Append if there is room in the active page
+		if (config_record_write(active_page, next_record, (uint16_t) key, value)) {
+			next_record++;
+			return true;
+		}
+		next_record++;														// Failed slot is left behind; fall through to compaction
+	}
+
+	// Compaction: copy the latest value of each key to the other page, then validate it by writing its header.
+	// If power is lost before the header is written, the old page stays active
+	uint32_t target = (active_page == CONFIG_PAGE_A_ADDRESS) ? CONFIG_PAGE_B_ADDRESS : CONFIG_PAGE_A_ADDRESS;
+	uint32_t index = 0;
+
+	if (config_page_erase(target) == false) {
+		return false;
+	}
+
+	for (uint32_t k = 0; k < CONFIG_KEY_COUNT; k++) {
+		if (config_valid & (1ULL << k)) {
+			if (config_record_write(target, index++, (uint16_t) k, config_cache[k]) == false) {
+				return false;
+			}
+		}
+	}
+
+	if (config_page_write_header(target, page_generation + 1) == false) {
+		return false;
+	}
+
+	active_page = target;
+	page_generation++;
+	next_record = index;
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Store a float configuration value
+ */
+/****************************************************************************************************************/
+bool config_set_float(ConfigKey key, float value) {
+	uint32_t raw;
+
+	memcpy(&raw, &value, sizeof(float));
+	return config_set(key, raw);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Generation of the active page; incremented each time the store is compacted
+ */
+/****************************************************************************************************************/
+uint32_t config_store_generation(void) {
+	return page_generation;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Number of records that can be appended before the next compaction
+ */
+/****************************************************************************************************************/
+uint16_t config_store_free_records(void) {
+	return (uint16_t) (CONFIG_RECORDS_PER_PAGE - next_record);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Modbus CRC of a record's key and value, using the CRC unit
+ */
+/****************************************************************************************************************/
+static uint16_t config_record_crc(uint16_t key, uint32_t value) {
+	uint8_t temp[6];
+
+	temp[0] = (uint8_t) (key >> 8);
+	temp[1] = (uint8_t) key;
+	temp[2] = (uint8_t) (value >> 24);
+	temp[3] = (uint8_t) (value >> 16);
+	temp[4] = (uint8_t) (value >> 8);
+	temp[5] = (uint8_t) value;
+
+	return modbus_generate_crc(temp, 6);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Erase a single config page
+ */
+/****************************************************************************************************************/
+static bool config_page_erase(uint32_t page) {
+	FLASH_EraseInitTypeDef erase = {0};
+	uint32_t page_error = 0;
+	HAL_StatusTypeDef status;
+
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = page;
+	erase.NbPages = 1;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &page_error);
+	HAL_FLASH_Lock();
+
+	return (status == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Program a record into a page
+ * @param page Page address
+ * @param index Record index within the page
+ */
+/****************************************************************************************************************/
+static bool config_record_write(uint32_t page, uint32_t index, uint16_t key, uint32_t value) {
+	uint32_t address = page + sizeof(ConfigPageHeader) + index * sizeof(ConfigRecord);
+	HAL_StatusTypeDef status;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + offsetof(ConfigRecord, key), key);
+	if (status == HAL_OK) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + offsetof(ConfigRecord, value), value);
+	}
+	if (status == HAL_OK) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + offsetof(ConfigRecord, crc), config_record_crc(key, value));
+	}
+	HAL_FLASH_Lock();
+
+	return (status == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write the header of a page, marking it valid
+ */
+/****************************************************************************************************************/
+static bool config_page_write_header(uint32_t page, uint32_t generation) {
+	HAL_StatusTypeDef status;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, page + offsetof(ConfigPageHeader, generation), generation);
+	if (status == HAL_OK) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, page + offsetof(ConfigPageHeader, magic), CONFIG_PAGE_MAGIC);
+	}
+	HAL_FLASH_Lock();
+
+	return (status == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Replay all records of a page into the RAM cache and find the first free record. Records with a bad CRC
+ * (torn writes) are skipped
+ */
+/****************************************************************************************************************/
+static void config_page_load(uint32_t page) {
+	const ConfigRecord *records = (const ConfigRecord *) (page + sizeof(ConfigPageHeader));
+
+	next_record = CONFIG_RECORDS_PER_PAGE;
+	for (uint32_t i = 0; i < CONFIG_RECORDS_PER_PAGE; i++) {
+		const ConfigRecord *r = &records[i];
+
+		if ((r->key == CONFIG_RECORD_ERASED) && (r->crc == CONFIG_RECORD_ERASED) && (r->value == 0xFFFFFFFFUL)) {
+			next_record = i;												// First blank record - end of log
+			break;
+		}
+
+		if ((r->key < CONFIG_KEY_COUNT) && (r->crc == config_record_crc(r->key, r->value))) {
+			config_cache[r->key] = r->value;
+			config_valid |= (1ULL << r->key);
+		}
+	}
+}
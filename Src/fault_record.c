@@ -0,0 +1,209 @@
+#include "fault_record.h"
+#include "modbus_registers.h"
+
+#define FAULT_RECORD_WORDS			(sizeof(FaultRecord) / sizeof(uint32_t))
+#define FAULT_RECORD_REG_WORDS		(FAULT_RECORD_WORDS - 4)				// From r0 to the backtrace
+#define FAULT_RAM_START				0x20000000UL
+#define FAULT_FLASH_START			0x08000000UL
+
+_Static_assert(MODBUS_REG_FAULT_RECORD + 2 * FAULT_RECORD_REG_WORDS == MODBUS_REG_FAULT_END,
+		"Fault registers do not match the record");
+
+extern uint32_t _estack;													// Linker script
+extern uint32_t _etext;
+
+static FaultRecord record __attribute__((section(".noinit")));				// Kept over a reset
+
+static uint32_t fault_record_sum(const FaultRecord *r);
+static bool fault_record_in_ram(const uint32_t *p, uint32_t words);
+static void fault_record_finish(FaultRecord *r) __attribute__((noreturn));
+
+/****************************************************************************************************************/
+/**
+ * @brief Check the record left by the previous run and enable the MemManage, BusFault and UsageFault handlers,
+ * which otherwise escalate to HardFault
+ */
+/****************************************************************************************************************/
+void fault_record_init(void) {
+	if ((record.magic != FAULT_RECORD_MAGIC) || (record.check != ~fault_record_sum(&record))) {
+		uint32_t *p = (uint32_t *) &record;									// Power-on: random contents
+		for (uint32_t i = 0; i < FAULT_RECORD_WORDS; i++) {
+			p[i] = 0;
+		}
+	}
+
+	SCB->SHCSR |= SCB_SHCSR_USGFAULTENA_Msk | SCB_SHCSR_BUSFAULTENA_Msk | SCB_SHCSR_MEMFAULTENA_Msk;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Save a fault and reset. Entered from FAULT_RECORD_ENTRY() with the exception frame; uses little stack, as
+ * the fault may be a stack overflow
+ * @param frame Stacked r0-r3, r12, lr, pc, xPSR
+ * @param exc_return LR on exception entry
+ * @param type FAULT_TYPE_x
+ */
+/****************************************************************************************************************/
+void fault_record_save(const uint32_t *frame, uint32_t exc_return, uint32_t type) {
+	FaultRecord *r = &record;
+
+	r->type = type;
+	r->cfsr = SCB->CFSR;
+	r->hfsr = SCB->HFSR;
+	r->mmfar = SCB->MMFAR;
+	r->bfar = SCB->BFAR;
+	r->exc_return = exc_return;
+
+	if (fault_record_in_ram(frame, 8)) {
+		r->r0 = frame[0];
+		r->r1 = frame[1];
+		r->r2 = frame[2];
+		r->r3 = frame[3];
+		r->r12 = frame[4];
+		r->lr = frame[5];
+		r->pc = frame[6];
+		r->xpsr = frame[7];
+		uint32_t frame_words = (exc_return & 0x10) ? 8 : 26;				// Basic or extended (FPU) frame
+		r->sp = (uint32_t) (frame + frame_words) + ((r->xpsr & (1UL << 9)) ? 4 : 0);	// Stack realigned on entry
+
+		const uint32_t *p = (const uint32_t *) r->sp;
+		uint8_t n = 0;
+		for (uint32_t i = 0; (i < FAULT_RECORD_SCAN_WORDS) && (n < FAULT_RECORD_BACKTRACE)
+				&& fault_record_in_ram(&p[i], 1); i++) {
+			if ((p[i] & 1) && (p[i] >= FAULT_FLASH_START) && (p[i] < (uint32_t) &_etext)) {
+				r->backtrace[n++] = p[i] & ~1UL;
+			}
+		}
+		while (n < FAULT_RECORD_BACKTRACE) {
+			r->backtrace[n++] = 0;
+		}
+	} else {																// Stack pointer outside RAM: nothing to read
+		r->r0 = r->r1 = r->r2 = r->r3 = r->r12 = r->lr = r->pc = r->xpsr = 0;
+		r->sp = (uint32_t) frame;
+		for (uint8_t n = 0; n < FAULT_RECORD_BACKTRACE; n++) {
+			r->backtrace[n] = 0;
+		}
+	}
+
+	fault_record_finish(r);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Save a call to Error_Handler() and reset
+ * @param caller Return address of the Error_Handler() call
+ */
+/****************************************************************************************************************/
+void fault_record_error(uint32_t caller) {
+	FaultRecord *r = &record;
+
+	__disable_irq();
+	r->type = FAULT_TYPE_ERROR_HANDLER;
+	r->r0 = r->r1 = r->r2 = r->r3 = r->r12 = r->xpsr = 0;
+	r->lr = caller;
+	r->pc = caller & ~1UL;
+	r->cfsr = r->hfsr = r->mmfar = r->bfar = 0;
+	r->sp = __get_MSP();
+	r->exc_return = 0;
+	for (uint8_t n = 0; n < FAULT_RECORD_BACKTRACE; n++) {
+		r->backtrace[n] = 0;
+	}
+
+	fault_record_finish(r);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a fault record register
+ * @param reg Register address, MODBUS_REG_FAULT_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool fault_record_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_FAULT_RECORD) && (reg < MODBUS_REG_FAULT_END)) {
+		uint32_t v = (&record.r0)[(reg - MODBUS_REG_FAULT_RECORD) / 2];
+		*value = ((reg - MODBUS_REG_FAULT_RECORD) & 1) ? (uint16_t) v : (uint16_t) (v >> 16);	// High word first
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_FAULT_TYPE:
+		*value = (uint16_t) record.type;
+		return true;
+
+	case MODBUS_REG_FAULT_COUNT:
+		*value = (uint16_t) record.count;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a fault record register: writing 0 to the type clears the record, the count is kept
+ * @param reg Register address, MODBUS_REG_FAULT_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool fault_record_write_register(uint16_t reg, uint16_t value) {
+
+	if ((reg != MODBUS_REG_FAULT_TYPE) || (value != FAULT_TYPE_NONE)) {
+		return false;
+	}
+
+	uint32_t count = record.count;
+	uint32_t *p = (uint32_t *) &record;
+	for (uint32_t i = 0; i < FAULT_RECORD_WORDS; i++) {
+		p[i] = 0;
+	}
+	record.count = count;
+	record.magic = FAULT_RECORD_MAGIC;
+	record.check = ~fault_record_sum(&record);
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Sum of the record words before the check
+ */
+/****************************************************************************************************************/
+static uint32_t fault_record_sum(const FaultRecord *r) {
+	const uint32_t *p = (const uint32_t *) r;
+	uint32_t sum = 0;
+
+	for (uint32_t i = 0; i < FAULT_RECORD_WORDS - 1; i++) {
+		sum += p[i];
+	}
+	return sum;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check that words can be read from RAM without another fault
+ */
+/****************************************************************************************************************/
+static bool fault_record_in_ram(const uint32_t *p, uint32_t words) {
+	return (((uint32_t) p & 3) == 0) && ((uint32_t) p >= FAULT_RAM_START)
+			&& ((uint32_t) (p + words) <= (uint32_t) &_estack);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Count the fault, seal the record and reset. Halts first if a debugger is attached
+ */
+/****************************************************************************************************************/
+static void fault_record_finish(FaultRecord *r) {
+	r->count = (r->magic == FAULT_RECORD_MAGIC) ? r->count + 1 : 1;
+	r->magic = FAULT_RECORD_MAGIC;
+	r->check = ~fault_record_sum(r);
+
+	if (CoreDebug->DHCSR & CoreDebug_DHCSR_C_DEBUGEN_Msk) {
+		__BKPT(1);
+	}
+	NVIC_SystemReset();
+}
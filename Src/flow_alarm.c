@@ -0,0 +1,200 @@
+#include "flow_alarm.h"
+#include "acquisition.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "pga.h"
+
+extern ADC_HandleTypeDef hadc2;
+
+static uint32_t control = 0;												// FLOW_ALARM_CONTROL_x bits
+static uint32_t low_mv = FLOW_ALARM_DEFAULT_LOW_MV;
+static uint32_t high_mv = FLOW_ALARM_DEFAULT_HIGH_MV;
+static uint16_t low_code = 0;												// Thresholds programmed into ADC2
+static uint16_t high_code = 0xFFFF;
+static volatile uint16_t status = 0;										// FLOW_ALARM_STATUS_x bits; written by the ADC interrupt
+static volatile uint16_t events = 0;										// Alarms latched since boot
+
+static uint16_t flow_alarm_mv_to_code(uint32_t mv);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load the alarm settings. The watchdog itself is programmed by flow_alarm_configure() when the acquisition
+ * configures ADC2
+ */
+/****************************************************************************************************************/
+void flow_alarm_init(void) {
+	config_get(CONFIG_KEY_ALARM_CONTROL, &control);
+	config_get(CONFIG_KEY_ALARM_LOW_MV, &low_mv);
+	config_get(CONFIG_KEY_ALARM_HIGH_MV, &high_mv);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Program the ADC2 analog watchdog 1 on channel 3. Thresholds can only be changed while ADC2 is not
+ * converting, so this is called by the acquisition while ADC2 is stopped. The high threshold is set to full scale,
+ * i.e. off, while the PGA is auto-ranging
+ */
+/****************************************************************************************************************/
+void flow_alarm_configure(void) {
+	ADC_AnalogWDGConfTypeDef AnalogWDGConfig = {0};
+
+	low_code = flow_alarm_mv_to_code(low_mv);
+	high_code = pga_auto_ranging() ? acquisition_full_scale() : flow_alarm_mv_to_code(high_mv);
+
+	AnalogWDGConfig.WatchdogNumber = ADC_ANALOGWATCHDOG_1;
+	AnalogWDGConfig.WatchdogMode = (control & FLOW_ALARM_CONTROL_ENABLE) ? ADC_ANALOGWATCHDOG_SINGLE_REG : ADC_ANALOGWATCHDOG_NONE;
+	AnalogWDGConfig.Channel = ADC_CHANNEL_3;
+	AnalogWDGConfig.ITMode = ((control & FLOW_ALARM_CONTROL_ENABLE) && !(status & FLOW_ALARM_STATUS_LATCHED)) ? ENABLE : DISABLE;
+	AnalogWDGConfig.HighThreshold = high_code;
+	AnalogWDGConfig.LowThreshold = low_code;
+	if (HAL_ADC_AnalogWDGConfig(&hadc2, &AnalogWDGConfig) != HAL_OK) {
+		Error_Handler();
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Alarm latched and not yet acknowledged
+ */
+/****************************************************************************************************************/
+bool flow_alarm_latched(void) {
+	return (status & FLOW_ALARM_STATUS_LATCHED) != 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Alarms latched since boot
+ */
+/****************************************************************************************************************/
+uint16_t flow_alarm_events(void) {
+	return events;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read an alarm register
+ * @param reg Register address, MODBUS_REG_ALARM_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool flow_alarm_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_ALARM_CONTROL:
+		*value = (uint16_t) control;
+		return true;
+
+	case MODBUS_REG_ALARM_LOW_MV:
+		*value = (uint16_t) low_mv;
+		return true;
+
+	case MODBUS_REG_ALARM_HIGH_MV:
+		*value = (uint16_t) high_mv;
+		return true;
+
+	case MODBUS_REG_ALARM_STATUS:
+		*value = status;
+		return true;
+
+	case MODBUS_REG_ALARM_EVENTS:
+		*value = events;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write an alarm register. Settings are kept in the configuration store; changing them restarts the
+ * acquisition to reprogram the watchdog. Any write to the status register acknowledges the alarm
+ * @param reg Register address, MODBUS_REG_ALARM_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool flow_alarm_write_register(uint16_t reg, uint16_t value) {
+	bool ok = true;
+
+	switch (reg) {
+	case MODBUS_REG_ALARM_CONTROL:
+		if (value & ~(FLOW_ALARM_CONTROL_ENABLE | FLOW_ALARM_CONTROL_GPIO)) {
+			return false;
+		}
+		control = value;
+		ok = config_set(CONFIG_KEY_ALARM_CONTROL, control);
+		break;
+
+	case MODBUS_REG_ALARM_LOW_MV:
+		if (value >= high_mv) {
+			return false;
+		}
+		low_mv = value;
+		ok = config_set(CONFIG_KEY_ALARM_LOW_MV, low_mv);
+		break;
+
+	case MODBUS_REG_ALARM_HIGH_MV:
+		if (value <= low_mv) {
+			return false;
+		}
+		high_mv = value;
+		ok = config_set(CONFIG_KEY_ALARM_HIGH_MV, high_mv);
+		break;
+
+	case MODBUS_REG_ALARM_STATUS:
+		__disable_irq();
+		status = 0;
+		HAL_GPIO_WritePin(ALARM_OUT_GPIO_Port, ALARM_OUT_Pin, GPIO_PIN_RESET);
+		if (control & FLOW_ALARM_CONTROL_ENABLE) {							// Re-arm; thresholds are unchanged
+			__HAL_ADC_CLEAR_FLAG(&hadc2, ADC_FLAG_AWD1);
+			__HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_AWD1);
+		}
+		__enable_irq();
+		return true;
+
+	default:
+		return false;
+	}
+
+	acquisition_reconfigure();
+	return ok;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert a threshold to an ADC code with the current Vdd and resolution
+ */
+/****************************************************************************************************************/
+static uint16_t flow_alarm_mv_to_code(uint32_t mv) {
+	float vdd = acquisition_get_vdd();
+	float code = 0;
+
+	if (vdd <= 0) {
+		vdd = 3.3f;															// No sample yet
+	}
+	code = mv * (float) acquisition_full_scale() / (vdd * 1000.0f);
+	return (code > acquisition_full_scale()) ? acquisition_full_scale() : (uint16_t) code;
+}
+
+/**
+ * ADC analog watchdog 1 callback: channel 3 is outside the window. Latch the alarm and disarm the interrupt, which
+ * would otherwise fire on every conversion while the signal stays out of the window. The direction comes from the
+ * last channel 3 conversion in the DMA buffer; DR may already hold VREFINT or channel 4. If channel 3 is back in
+ * the window by then, the nearer threshold gives the direction. With the high threshold off only LOW can fire
+ * @param hadc
+ */
+void HAL_ADC_LevelOutOfWindowCallback(ADC_HandleTypeDef* hadc)
+{
+	uint16_t code = acquisition_last_channel_3();
+	bool high = (high_code < acquisition_full_scale()) && (2UL * code > (uint32_t) high_code + low_code);
+
+	__HAL_ADC_DISABLE_IT(hadc, ADC_IT_AWD1);
+	status = FLOW_ALARM_STATUS_LATCHED | (high ? FLOW_ALARM_STATUS_HIGH : FLOW_ALARM_STATUS_LOW);
+	events++;
+
+	if (control & FLOW_ALARM_CONTROL_GPIO) {
+		ALARM_OUT_GPIO_Port->BSRR = ALARM_OUT_Pin;
+	}
+}
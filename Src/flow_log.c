@@ -0,0 +1,522 @@
+#include "flow_log.h"
+#include "flow_alarm.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "rs485_modbus_rtu.h"
+#include "watchdog.h"
+#include <stddef.h>
+
+#define FLOW_LOG_NO_ERASE			0xFF
+#define FLOW_LOG_SLOTS				(FLOW_LOG_PAGES * FLOW_LOG_RECORDS_PER_PAGE)
+#define FLOW_LOG_EMPTY_SEQUENCE		0xFFFFFFFFUL
+
+static uint32_t control = FLOW_LOG_CONTROL_AGGREGATES | FLOW_LOG_CONTROL_EVENTS;	// FLOW_LOG_CONTROL_x bits
+
+static uint8_t write_page = 0;												// Page and slot of the next record
+static uint16_t write_slot = 0;
+static uint8_t erase_page = FLOW_LOG_NO_ERASE;								// Page waiting to be erased
+static uint32_t next_sequence = 1;
+static uint32_t first_sequence = FLOW_LOG_EMPTY_SEQUENCE;					// Oldest record in flash
+
+static FlowLogRecord queue[FLOW_LOG_QUEUE_SIZE];							// Records waiting for a write window
+static uint8_t queue_tail = 0;
+static uint8_t queue_count = 0;
+static uint32_t pending_tick = 0;											// Time the oldest pending work was queued
+static uint16_t dropped = 0;												// Records lost because the queue was full
+static bool failing = false;												// Last erase or program attempt failed
+static bool window_open = false;											// Response sent; write once the bus is idle
+static uint16_t alarm_events = 0;
+
+static uint32_t read_sequence = 0;											// First record of the read window
+static uint16_t read_sequence_high = 0;										// High word written, waiting for the low word
+static const FlowLogRecord *cursor = NULL;									// Record n = cursor_index of the read window
+static uint16_t cursor_index = 0;
+static bool cursor_valid = false;
+
+static const FlowLogRecord *flow_log_slot(uint16_t slot);
+static bool flow_log_record_valid(const FlowLogRecord *r);
+static bool flow_log_slot_blank(uint16_t slot);
+static bool flow_log_page_blank(uint8_t page);
+static void flow_log_prepare_page(void);
+static void flow_log_find_oldest(void);
+static const FlowLogRecord *flow_log_find(uint32_t sequence);
+static void flow_log_waiting(void);
+static const FlowLogRecord *flow_log_next(const FlowLogRecord *r);
+static uint16_t flow_log_crc(const FlowLogRecord *r);
+static bool flow_log_erase(uint8_t page);
+static bool flow_log_program(uint16_t slot, const FlowLogRecord *r);
+
+/****************************************************************************************************************/
+/**
+ * @brief Scan the log for the newest record and continue after it. Call after flow_alarm_init(); requires the CRC
+ * unit (MX_CRC_Init)
+ */
+/****************************************************************************************************************/
+void flow_log_init(void) {
+	const FlowLogRecord *newest = NULL;
+	uint16_t newest_slot = 0;
+
+	config_get(CONFIG_KEY_LOG_CONTROL, &control);
+
+	for (uint16_t s = 0; s < FLOW_LOG_SLOTS; s++) {
+		const FlowLogRecord *r = flow_log_slot(s);
+		if (flow_log_record_valid(r) && ((newest == NULL) || (r->sequence > newest->sequence))) {
+			newest = r;
+			newest_slot = s;
+		}
+	}
+
+	if (newest != NULL) {
+		next_sequence = newest->sequence + 1;
+		write_page = newest_slot / FLOW_LOG_RECORDS_PER_PAGE;
+		write_slot = newest_slot % FLOW_LOG_RECORDS_PER_PAGE + 1;
+		while ((write_slot < FLOW_LOG_RECORDS_PER_PAGE)						// Step over records torn after the newest one
+				&& (flow_log_slot_blank(write_page * FLOW_LOG_RECORDS_PER_PAGE + write_slot) == false)) {
+			write_slot++;
+		}
+		if (write_slot >= FLOW_LOG_RECORDS_PER_PAGE) {
+			write_page = (write_page + 1) % FLOW_LOG_PAGES;
+			write_slot = 0;
+		}
+	}
+	flow_log_prepare_page();
+	flow_log_find_oldest();
+
+	alarm_events = flow_alarm_events();
+	flow_log_append(FLOW_LOG_TYPE_BOOT, (int32_t) watchdog_reset_cause(), 0, 0);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Queue a record for the log. Records of a type disabled in the control register are ignored
+ * @param type FLOW_LOG_TYPE_x
+ */
+/****************************************************************************************************************/
+void flow_log_append(uint16_t type, int32_t data_0, int32_t data_1, int32_t data_2) {
+	uint32_t enable = (type == FLOW_LOG_TYPE_MINUTE) ? FLOW_LOG_CONTROL_AGGREGATES : FLOW_LOG_CONTROL_EVENTS;
+
+	if ((control & enable) == 0) {
+		return;
+	}
+	if (queue_count >= FLOW_LOG_QUEUE_SIZE) {
+		dropped++;
+		return;
+	}
+	if ((queue_count == 0) && (erase_page == FLOW_LOG_NO_ERASE)) {
+		pending_tick = HAL_GetTick();
+	}
+
+	FlowLogRecord *r = &queue[(queue_tail + queue_count) % FLOW_LOG_QUEUE_SIZE];
+	r->sequence = next_sequence++;
+	r->type = type;
+	r->uptime_s = HAL_GetTick() / 1000;
+	r->data[0] = data_0;
+	r->data[1] = data_1;
+	r->data[2] = data_2;
+	r->crc = flow_log_crc(r);
+	queue_count++;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write queued records, called from the main loop. Flash is only touched while the bus is idle: in the gap
+ * after a response of this node, or between frames once work has been pending for FLOW_LOG_FORCE_DELAY_MS. An erase
+ * takes a window of its own and also waits for a quiet bus
+ * @param response_sent true if a Modbus response was sent in this loop iteration
+ */
+/****************************************************************************************************************/
+void flow_log_task(bool response_sent) {
+	uint16_t events = flow_alarm_events();
+
+	if (events != alarm_events) {
+		alarm_events = events;
+		flow_log_append(FLOW_LOG_TYPE_ALARM, events, 0, 0);
+	}
+
+	if (response_sent) {
+		window_open = true;
+	}
+	if ((queue_count == 0) && (erase_page == FLOW_LOG_NO_ERASE)) {			// Nothing to do
+		watchdog_checkin(WATCHDOG_FLASH_WRITER);
+	}
+	if (modbus_bus_idle() == false) {										// Response still being sent, or a request coming in
+		flow_log_waiting();
+		return;
+	}
+
+	bool window = window_open;
+	window_open = false;
+	if ((queue_count == 0) && (erase_page == FLOW_LOG_NO_ERASE)) {
+		return;
+	}
+	if ((window == false) && ((HAL_GetTick() - pending_tick) < FLOW_LOG_FORCE_DELAY_MS)) {
+		return;
+	}
+
+	if ((queue_count == 0) || (erase_page == write_page)) {					// An erase takes the window on its own
+		if (modbus_bus_quiet(FLOW_LOG_ERASE_QUIET_FRAMES) == false) {		// USART1 RX is not served while flash is erased
+			flow_log_waiting();
+			return;
+		}
+		failing = (flow_log_erase(erase_page) == false);
+		if (failing == false) {
+			erase_page = FLOW_LOG_NO_ERASE;
+			cursor_valid = false;
+			flow_log_find_oldest();
+			flow_log_prepare_page();
+			watchdog_checkin(WATCHDOG_FLASH_WRITER);						// Only progress counts, not attempts
+		}
+		pending_tick = HAL_GetTick();										// Retry after FLOW_LOG_FORCE_DELAY_MS
+		return;
+	}
+
+	while ((queue_count > 0) && (erase_page != write_page)) {
+		uint16_t slot = write_page * FLOW_LOG_RECORDS_PER_PAGE + write_slot;
+		bool written = flow_log_program(slot, &queue[queue_tail]);
+
+		if (written) {
+			if (first_sequence == FLOW_LOG_EMPTY_SEQUENCE) {
+				first_sequence = queue[queue_tail].sequence;
+			}
+			queue_tail = (queue_tail + 1) % FLOW_LOG_QUEUE_SIZE;
+			queue_count--;
+			cursor_valid = false;
+			failing = false;
+			watchdog_checkin(WATCHDOG_FLASH_WRITER);
+		} else {
+			failing = true;
+		}
+		if (++write_slot >= FLOW_LOG_RECORDS_PER_PAGE) {					// Failed slots are left behind
+			write_page = (write_page + 1) % FLOW_LOG_PAGES;
+			write_slot = 0;
+			flow_log_prepare_page();
+		}
+		if (written == false) {
+			break;
+		}
+	}
+	pending_tick = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a log register. Record n of the read window is the n-th record at or after the read sequence
+ * @param reg Register address, MODBUS_REG_LOG_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool flow_log_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_LOG_RECORDS_BASE) && (reg < MODBUS_REG_LOG_RECORDS_END)) {
+		uint16_t n = (reg - MODBUS_REG_LOG_RECORDS_BASE) / MODBUS_REG_LOG_RECORD_SIZE;
+		uint16_t field = (reg - MODBUS_REG_LOG_RECORDS_BASE) % MODBUS_REG_LOG_RECORD_SIZE;
+		uint32_t v = 0xFFFFFFFFUL;
+
+		if ((cursor_valid == false) || (cursor_index > n)) {				// Records are normally read in order
+			cursor = flow_log_find(read_sequence);
+			cursor_index = 0;
+			cursor_valid = true;
+		}
+		while (cursor_index < n) {
+			if (cursor != NULL) {
+				cursor = flow_log_next(cursor);
+			}
+			cursor_index++;
+		}
+
+		if (cursor != NULL) {
+			switch (field / 2) {
+			case 0:
+				v = cursor->sequence;
+				break;
+			case 1:
+				v = cursor->type;
+				break;
+			case 2:
+				v = cursor->uptime_s;
+				break;
+			default:
+				v = (uint32_t) cursor->data[field / 2 - 3];
+				break;
+			}
+		}
+		*value = (field & 1) ? (uint16_t) v : (uint16_t) (v >> 16);			// High word first
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_LOG_CONTROL:
+		*value = (uint16_t) control;
+		return true;
+
+	case MODBUS_REG_LOG_FIRST_SEQUENCE:
+		*value = (uint16_t) (first_sequence >> 16);
+		return true;
+
+	case MODBUS_REG_LOG_FIRST_SEQUENCE + 1:
+		*value = (uint16_t) first_sequence;
+		return true;
+
+	case MODBUS_REG_LOG_NEXT_SEQUENCE:
+		*value = (uint16_t) (next_sequence >> 16);
+		return true;
+
+	case MODBUS_REG_LOG_NEXT_SEQUENCE + 1:
+		*value = (uint16_t) next_sequence;
+		return true;
+
+	case MODBUS_REG_LOG_READ_SEQUENCE:
+		*value = (uint16_t) (read_sequence >> 16);
+		return true;
+
+	case MODBUS_REG_LOG_READ_SEQUENCE + 1:
+		*value = (uint16_t) read_sequence;
+		return true;
+
+	case MODBUS_REG_LOG_PENDING:
+		*value = queue_count;
+		return true;
+
+	case MODBUS_REG_LOG_DROPPED:
+		*value = dropped;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a log register. The read sequence is written high word first; it takes effect with the low word
+ * @param reg Register address, MODBUS_REG_LOG_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool flow_log_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_LOG_CONTROL:
+		if (value & ~(FLOW_LOG_CONTROL_AGGREGATES | FLOW_LOG_CONTROL_EVENTS)) {
+			return false;
+		}
+		control = value;
+		return config_set(CONFIG_KEY_LOG_CONTROL, control);
+
+	case MODBUS_REG_LOG_READ_SEQUENCE:
+		read_sequence_high = value;
+		return true;
+
+	case MODBUS_REG_LOG_READ_SEQUENCE + 1:
+		read_sequence = ((uint32_t) read_sequence_high << 16) | value;
+		read_sequence_high = 0;
+		cursor_valid = false;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Record slot in flash, counted from the first log page
+ */
+/****************************************************************************************************************/
+static const FlowLogRecord *flow_log_slot(uint16_t slot) {
+	uint32_t page = slot / FLOW_LOG_RECORDS_PER_PAGE;
+
+	return (const FlowLogRecord *) (FLOW_LOG_START_ADDRESS + page * FLOW_LOG_PAGE_SIZE)
+			+ (slot % FLOW_LOG_RECORDS_PER_PAGE);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check a record in flash. Blank slots and torn writes fail the CRC check
+ */
+/****************************************************************************************************************/
+static bool flow_log_record_valid(const FlowLogRecord *r) {
+	return (r->sequence != FLOW_LOG_EMPTY_SEQUENCE) && (r->crc == flow_log_crc(r));
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check that a slot can be programmed
+ */
+/****************************************************************************************************************/
+static bool flow_log_slot_blank(uint16_t slot) {
+	const uint32_t *words = (const uint32_t *) flow_log_slot(slot);
+
+	for (uint32_t i = 0; i < sizeof(FlowLogRecord) / 4; i++) {
+		if (words[i] != 0xFFFFFFFFUL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check that a page is erased
+ */
+/****************************************************************************************************************/
+static bool flow_log_page_blank(uint8_t page) {
+	const uint32_t *words = (const uint32_t *) (FLOW_LOG_START_ADDRESS + page * FLOW_LOG_PAGE_SIZE);
+
+	for (uint32_t i = 0; i < FLOW_LOG_PAGE_SIZE / 4; i++) {
+		if (words[i] != 0xFFFFFFFFUL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Schedule the erases the write position needs: the page being entered if it still holds old records,
+ * otherwise the page after it, which is kept erased ahead of time
+ */
+/****************************************************************************************************************/
+static void flow_log_prepare_page(void) {
+	uint8_t next = (write_page + 1) % FLOW_LOG_PAGES;
+
+	if ((write_slot == 0) && (flow_log_page_blank(write_page) == false)) {
+		erase_page = write_page;
+	} else if (flow_log_page_blank(next) == false) {
+		erase_page = next;
+	} else {
+		return;
+	}
+	if (queue_count == 0) {
+		pending_tick = HAL_GetTick();
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Find the sequence of the oldest record in flash
+ */
+/****************************************************************************************************************/
+static void flow_log_find_oldest(void) {
+	first_sequence = FLOW_LOG_EMPTY_SEQUENCE;
+
+	for (uint16_t s = 0; s < FLOW_LOG_SLOTS; s++) {
+		const FlowLogRecord *r = flow_log_slot(s);
+		if (flow_log_record_valid(r) && (r->sequence < first_sequence)) {
+			first_sequence = r->sequence;
+		}
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Find the oldest record with a sequence number at or after the given one
+ * @return NULL if there is none
+ */
+/****************************************************************************************************************/
+static const FlowLogRecord *flow_log_find(uint32_t sequence) {
+	const FlowLogRecord *found = NULL;
+
+	for (uint16_t s = 0; s < FLOW_LOG_SLOTS; s++) {
+		const FlowLogRecord *r = flow_log_slot(s);
+		if (flow_log_record_valid(r) && (r->sequence >= sequence) && ((found == NULL) || (r->sequence < found->sequence))) {
+			found = r;
+		}
+	}
+	return found;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Next newer record. Records are written in slot order, so it is the first valid slot after r; wrapping
+ * around to an older record means r is the newest
+ * @return NULL if r is the newest record
+ */
+/****************************************************************************************************************/
+static const FlowLogRecord *flow_log_next(const FlowLogRecord *r) {
+	uint32_t offset = (uint32_t) r - FLOW_LOG_START_ADDRESS;
+	uint16_t slot = offset / FLOW_LOG_PAGE_SIZE * FLOW_LOG_RECORDS_PER_PAGE + offset % FLOW_LOG_PAGE_SIZE / sizeof(FlowLogRecord);
+
+	for (uint16_t i = 1; i < FLOW_LOG_SLOTS; i++) {
+		const FlowLogRecord *n = flow_log_slot((slot + i) % FLOW_LOG_SLOTS);
+		if (flow_log_record_valid(n)) {
+			return (n->sequence > r->sequence) ? n : NULL;
+		}
+	}
+	return NULL;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Modbus CRC of a record with the CRC field erased, using the CRC unit
+ */
+/****************************************************************************************************************/
+static uint16_t flow_log_crc(const FlowLogRecord *r) {
+	FlowLogRecord temp = *r;
+
+	temp.crc = 0xFFFF;
+	return modbus_generate_crc((uint8_t *) &temp, sizeof(temp));
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Erase a log page
+ */
+/****************************************************************************************************************/
+static bool flow_log_erase(uint8_t page) {
+	FLASH_EraseInitTypeDef erase = {0};
+	uint32_t page_error = 0;
+	HAL_StatusTypeDef status;
+
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = FLOW_LOG_START_ADDRESS + page * FLOW_LOG_PAGE_SIZE;
+	erase.NbPages = 1;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &page_error);
+	HAL_FLASH_Lock();
+
+	return (status == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Program a record into a slot. The CRC is written last, so a torn write fails the CRC check
+ */
+/****************************************************************************************************************/
+static bool flow_log_program(uint16_t slot, const FlowLogRecord *r) {
+	uint32_t address = (uint32_t) flow_log_slot(slot);
+	HAL_StatusTypeDef status;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + offsetof(FlowLogRecord, sequence), r->sequence);
+	if (status == HAL_OK) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + offsetof(FlowLogRecord, type), r->type);
+	}
+	if (status == HAL_OK) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + offsetof(FlowLogRecord, uptime_s), r->uptime_s);
+	}
+	for (uint32_t i = 0; (i < 3) && (status == HAL_OK); i++) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + offsetof(FlowLogRecord, data) + 4 * i, (uint32_t) r->data[i]);
+	}
+	if (status == HAL_OK) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + offsetof(FlowLogRecord, crc), r->crc);
+	}
+	HAL_FLASH_Lock();
+
+	return (status == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check in with the watchdog while pending work waits for the bus on purpose. After a failed erase or
+ * program attempt only a success checks in again, so a writer that keeps failing misses WATCHDOG_FLASH_WRITER_MS
+ */
+/****************************************************************************************************************/
+static void flow_log_waiting(void) {
+	if (failing == false) {
+		watchdog_checkin(WATCHDOG_FLASH_WRITER);
+	}
+}
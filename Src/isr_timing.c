@@ -0,0 +1,90 @@
+#include "isr_timing.h"
+#include "modbus_registers.h"
+
+_Static_assert(MODBUS_REG_ISR_TIMING + MODBUS_REG_ISR_ENTRY_SIZE * ISR_TIMING_COUNT <= MODBUS_REG_ISR_CCMRAM_BYTES,
+		"ISR timing entries overlap the CCMRAM register");
+
+extern uint32_t _sccmram;													// Linker script
+extern uint32_t _eccmram;
+
+static volatile IsrTiming timing[ISR_TIMING_COUNT] = {						// Written by the interrupts
+	{ 0, 0xFFFF, 0 }, { 0, 0xFFFF, 0 }, { 0, 0xFFFF, 0 }, { 0, 0xFFFF, 0 },
+};
+
+/****************************************************************************************************************/
+/**
+ * @brief Record one measurement. Called by the interrupt handlers, each with its own entry
+ * @param isr ISR_TIMING_x
+ * @param cycles
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void isr_timing_record(uint8_t isr, uint32_t cycles) {
+	volatile IsrTiming *t = &timing[isr];
+	uint16_t c = (cycles > 0xFFFF) ? 0xFFFF : (uint16_t) cycles;
+
+	t->last = c;
+	if (c < t->min) {
+		t->min = c;
+	}
+	if (c > t->max) {
+		t->max = c;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read an ISR timing register
+ * @param reg Register address, MODBUS_REG_ISR_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool isr_timing_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_ISR_TIMING) && (reg < MODBUS_REG_ISR_TIMING + MODBUS_REG_ISR_ENTRY_SIZE * ISR_TIMING_COUNT)) {
+		uint16_t n = (reg - MODBUS_REG_ISR_TIMING) / MODBUS_REG_ISR_ENTRY_SIZE;
+		switch ((reg - MODBUS_REG_ISR_TIMING) % MODBUS_REG_ISR_ENTRY_SIZE) {
+		case 0:
+			*value = timing[n].last;
+			break;
+		case 1:
+			*value = (timing[n].min == 0xFFFF) ? 0 : timing[n].min;		// No measurement yet
+			break;
+		default:
+			*value = timing[n].max;
+			break;
+		}
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_ISR_CCMRAM_BYTES:
+		*value = (uint16_t) ((uint32_t) &_eccmram - (uint32_t) &_sccmram);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write an ISR timing register: any write to an entry restarts its minimum and maximum
+ * @param reg Register address, MODBUS_REG_ISR_x
+ * @param value
+ * @return false if the register does not exist or is read-only
+ */
+/****************************************************************************************************************/
+bool isr_timing_write_register(uint16_t reg, uint16_t value) {
+
+	if ((reg >= MODBUS_REG_ISR_TIMING) && (reg < MODBUS_REG_ISR_TIMING + MODBUS_REG_ISR_ENTRY_SIZE * ISR_TIMING_COUNT)) {
+		uint16_t n = (reg - MODBUS_REG_ISR_TIMING) / MODBUS_REG_ISR_ENTRY_SIZE;
+		__disable_irq();
+		timing[n].min = 0xFFFF;
+		timing[n].max = 0;
+		__enable_irq();
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,439 @@
+#include "low_power.h"
+#include "acquisition.h"
+#include "capture.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "pga.h"
+#include "rs485_modbus_rtu.h"
+#include "timebase.h"
+
+#define LOW_POWER_RTC_PREDIV_A		3										// ck_apre = LSI / 4, about 10 kHz
+#define LOW_POWER_RTC_PREDIV_S		9999									// Sub-second counter, about 100 us per step
+#define LOW_POWER_RTC_WRAP			(60UL * (LOW_POWER_RTC_PREDIV_S + 1))	// Seconds and sub-seconds repeat every minute
+#define LOW_POWER_WUT_DIVIDER		16										// Wake-up timer clock RTCCLK / 16
+#define LOW_POWER_RTC_TIMEOUT_MS	2										// RTC initialization mode entry
+#define LOW_POWER_RTC_TIMEOUT_CYCLES	72000								// Wake-up timer write access, 1 ms at 72 MHz
+#define LOW_POWER_STOP_EXIT_US		9										// Datasheet tWUSTOP, low power regulator, rounded up
+
+static uint32_t period_ms = 0;												// Sample period; 0 disables STOP
+static bool rtc_ready = false;
+static bool parked = false;													// Acquisition stopped between samples
+static uint32_t sample_tick = 0;											// Start of the last sample burst
+static uint32_t burst_sequence = 0;											// Sample sequence when the burst started
+static volatile bool rtc_wakeup = false;									// Set by the wake-up timer interrupt
+static uint32_t tick_remainder = 0;											// RTC ticks not yet added to the HAL tick
+
+static uint32_t apre_hz = 0;												// Measured ck_apre frequency; 0 until measured
+static bool cal_running = false;
+static uint32_t cal_tick = 0;												// Start of the LSI measurement window
+static uint32_t cal_rtc = 0;
+static uint32_t cal_done_tick = 0;
+
+static uint32_t stats_tick = 0;												// Start of the residency window
+static uint32_t stats_stopped_ms = 0;										// Time in STOP in the current window
+static uint16_t residency_permil = 0;
+static uint16_t wakeups_timer = 0;											// Since boot
+static uint16_t wakeups_bus = 0;
+static uint16_t latency_us = 0;												// Last wake-up event to the run clock
+static uint16_t latency_max_us = 0;
+
+static bool low_power_rtc_init(void);
+static uint32_t low_power_rtc_ticks(void);
+static uint32_t low_power_rtc_elapsed(uint32_t start, uint32_t end);
+static void low_power_rtc_wakeup(uint32_t counts);
+static void low_power_calibrate(uint32_t now);
+static void low_power_statistics(uint32_t now);
+static bool low_power_stop(uint32_t ms, uint32_t *stopped_ms);
+static uint32_t low_power_restore_clock(void);
+static void low_power_release(void);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load the sample period and start the RTC on the LSI for the wake-up timer. The LSI is running, it is
+ * started by MX_IWDG_Init()
+ */
+/****************************************************************************************************************/
+void low_power_init(void) {
+	config_get(CONFIG_KEY_LP_PERIOD_MS, &period_ms);
+	if ((period_ms != 0) && ((period_ms < LOW_POWER_MIN_PERIOD_MS) || (period_ms > LOW_POWER_MAX_PERIOD_MS))) {
+		period_ms = 0;
+	}
+
+	rtc_ready = low_power_rtc_init();
+	if (rtc_ready) {
+		EXTI->IMR |= EXTI_IMR_MR20;											// RTC wake-up timer
+		EXTI->RTSR |= EXTI_RTSR_TR20;
+		EXTI->IMR |= EXTI_IMR_MR25;											// USART1 wake-up
+		HAL_NVIC_SetPriority(RTC_WKUP_IRQn, 5, 0);
+		HAL_NVIC_EnableIRQ(RTC_WKUP_IRQn);
+	}
+
+	acquisition_set_sample_hold(period_ms);
+	stats_tick = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Duty cycle the acquisition and enter STOP until the next sample when possible. Called by the scheduler
+ * in place of WFI
+ * @param stopped_ms Time spent in STOP, added to the HAL tick
+ * @return false if STOP was not entered and the caller has to sleep in WFI instead
+ */
+/****************************************************************************************************************/
+bool low_power_idle(uint32_t *stopped_ms) {
+	uint32_t now = HAL_GetTick();
+
+	*stopped_ms = 0;
+	low_power_statistics(now);
+
+	if ((period_ms == 0) || (rtc_ready == false)) {
+		low_power_release();
+		return false;
+	}
+	low_power_calibrate(now);
+
+	if (parked && acquisition_running()) {									// Restarted by the analog calibration
+		parked = false;
+	}
+	if (capture_active() || pga_calibrating() || (get_calibration_status() & CAL_STATUS_REZERO_BUSY)) {
+		low_power_release();												// These need every block
+		return false;
+	}
+
+	if (parked == false) {													// Stop ADC2 once the burst has published its sample
+		AcquisitionSample sample;
+		acquisition_get_sample(&sample);
+		if (sample.sequence == burst_sequence) {
+			return false;
+		}
+		acquisition_stop();
+		parked = true;
+	}
+
+	if ((now - sample_tick) >= period_ms) {									// Next sample is due
+		AcquisitionSample sample;
+		acquisition_get_sample(&sample);
+		burst_sequence = sample.sequence;
+		sample_tick = now;
+		parked = false;
+		acquisition_resume();
+		return false;
+	}
+
+	uint32_t remaining = period_ms - (now - sample_tick);
+	if (cal_running || (remaining < LOW_POWER_MIN_STOP_MS)) {
+		return false;
+	}
+	if ((modbus_command_available() != 0) || (modbus_bus_idle() == false)) {
+		return false;
+	}
+
+	return low_power_stop((remaining > LOW_POWER_MAX_STOP_MS) ? LOW_POWER_MAX_STOP_MS : remaining, stopped_ms);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief RTC wake-up timer interrupt (EXTI line 20)
+ */
+/****************************************************************************************************************/
+void RTC_WKUP_IRQHandler(void) {
+	RTC->ISR = ~((RTC_ISR_WUTF | RTC_ISR_INIT) & 0x0000FFFFU) | (RTC->ISR & RTC_ISR_INIT);
+	EXTI->PR = EXTI_PR_PR20;
+	rtc_wakeup = true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a low power register
+ * @param reg Register address, MODBUS_REG_LP_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool low_power_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_LP_PERIOD_MS:
+		*value = (uint16_t) period_ms;
+		return true;
+
+	case MODBUS_REG_LP_LSI_HZ:
+		*value = (uint16_t) (apre_hz * (LOW_POWER_RTC_PREDIV_A + 1));
+		return true;
+
+	case MODBUS_REG_LP_RESIDENCY_PERMIL:
+		*value = residency_permil;
+		return true;
+
+	case MODBUS_REG_LP_WAKEUPS_TIMER:
+		*value = wakeups_timer;
+		return true;
+
+	case MODBUS_REG_LP_WAKEUPS_BUS:
+		*value = wakeups_bus;
+		return true;
+
+	case MODBUS_REG_LP_WAKE_LATENCY_US:
+		*value = latency_us;
+		return true;
+
+	case MODBUS_REG_LP_WAKE_LATENCY_MAX_US:
+		*value = latency_max_us;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a low power register. The sample period is kept in the configuration store
+ * @param reg Register address, MODBUS_REG_LP_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool low_power_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_LP_PERIOD_MS:
+		if ((value != 0) && ((value < LOW_POWER_MIN_PERIOD_MS) || (value > LOW_POWER_MAX_PERIOD_MS))) {
+			return false;
+		}
+		period_ms = value;
+		acquisition_set_sample_hold(period_ms);
+		return config_set(CONFIG_KEY_LP_PERIOD_MS, period_ms);
+
+	case MODBUS_REG_LP_WAKE_LATENCY_MAX_US:
+		latency_max_us = 0;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Clock the RTC from the LSI and set the prescalers. The calendar is left at its reset value; only the
+ * seconds and sub-seconds are used as a counter. Shadow registers are bypassed, so the counter can be read right
+ * after a wake-up without waiting for a resynchronization
+ * @return false if the RTC did not enter initialization mode
+ */
+/****************************************************************************************************************/
+static bool low_power_rtc_init(void) {
+	HAL_PWR_EnableBkUpAccess();
+	if ((RCC->BDCR & (RCC_BDCR_RTCSEL | RCC_BDCR_RTCEN)) != (RCC_BDCR_RTCSEL_LSI | RCC_BDCR_RTCEN)) {
+		RCC->BDCR |= RCC_BDCR_BDRST;										// RTCSEL can only be changed after a backup domain reset
+		RCC->BDCR &= ~RCC_BDCR_BDRST;
+		RCC->BDCR |= RCC_BDCR_RTCSEL_LSI | RCC_BDCR_RTCEN;
+	}
+
+	RTC->WPR = 0xCA;														// Unlock the RTC registers
+	RTC->WPR = 0x53;
+	RTC->ISR |= RTC_ISR_INIT;
+	uint32_t start = HAL_GetTick();
+	while ((RTC->ISR & RTC_ISR_INITF) == 0) {
+		if ((HAL_GetTick() - start) > LOW_POWER_RTC_TIMEOUT_MS) {
+			RTC->WPR = 0xFF;
+			return false;
+		}
+	}
+	RTC->PRER = LOW_POWER_RTC_PREDIV_S;										// Two writes, synchronous prescaler first
+	RTC->PRER |= (LOW_POWER_RTC_PREDIV_A << RTC_PRER_PREDIV_A_Pos);
+	RTC->CR |= RTC_CR_BYPSHAD;
+	RTC->ISR &= ~RTC_ISR_INIT;
+	RTC->WPR = 0xFF;
+
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief RTC counter in ck_apre periods within the minute. The registers are read until the sub-seconds did not
+ * change, as the shadow registers are bypassed
+ */
+/****************************************************************************************************************/
+static uint32_t low_power_rtc_ticks(void) {
+	uint32_t ssr;
+	uint32_t tr;
+
+	do {
+		ssr = RTC->SSR;
+		tr = RTC->TR;
+	} while (ssr != RTC->SSR);
+
+	uint32_t seconds = ((tr & RTC_TR_ST) >> RTC_TR_ST_Pos) * 10 + ((tr & RTC_TR_SU) >> RTC_TR_SU_Pos);
+	return seconds * (LOW_POWER_RTC_PREDIV_S + 1) + (LOW_POWER_RTC_PREDIV_S - ssr);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief ck_apre periods from start to end, for intervals shorter than a minute
+ */
+/****************************************************************************************************************/
+static uint32_t low_power_rtc_elapsed(uint32_t start, uint32_t end) {
+	return (end + LOW_POWER_RTC_WRAP - start) % LOW_POWER_RTC_WRAP;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Start the wake-up timer, or stop it
+ * @param counts RTCCLK / 16 periods to the wake-up; 0 stops the timer
+ */
+/****************************************************************************************************************/
+static void low_power_rtc_wakeup(uint32_t counts) {
+	RTC->WPR = 0xCA;
+	RTC->WPR = 0x53;
+	RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+
+	if (counts != 0) {
+		uint32_t start = DWT->CYCCNT;										// WUTR is writable up to 2 RTCCLK periods later
+		while (((RTC->ISR & RTC_ISR_WUTWF) == 0) && ((DWT->CYCCNT - start) < LOW_POWER_RTC_TIMEOUT_CYCLES));
+		RTC->WUTR = (counts > 0x10000) ? 0xFFFF : counts - 1;
+		RTC->CR &= ~RTC_CR_WUCKSEL;											// RTCCLK / 16
+		RTC->ISR = ~((RTC_ISR_WUTF | RTC_ISR_INIT) & 0x0000FFFFU) | (RTC->ISR & RTC_ISR_INIT);
+		EXTI->PR = EXTI_PR_PR20;
+		RTC->CR |= RTC_CR_WUTIE | RTC_CR_WUTE;
+	}
+
+	RTC->WPR = 0xFF;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Measure the LSI against the HAL tick. STOP is held off during the measurement window, as the time spent
+ * in STOP is itself measured with the LSI
+ */
+/****************************************************************************************************************/
+static void low_power_calibrate(uint32_t now) {
+
+	if (cal_running == false) {
+		if ((apre_hz != 0) && ((now - cal_done_tick) < LOW_POWER_RECAL_PERIOD_MS)) {
+			return;
+		}
+		cal_running = true;
+		cal_tick = now;
+		cal_rtc = low_power_rtc_ticks();
+		return;
+	}
+
+	if ((now - cal_tick) < LOW_POWER_CAL_WINDOW_MS) {
+		return;
+	}
+	apre_hz = low_power_rtc_elapsed(cal_rtc, low_power_rtc_ticks()) * 1000UL / (now - cal_tick);
+	cal_running = false;
+	cal_done_tick = now;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Close the residency window every LOW_POWER_STATS_PERIOD_MS
+ */
+/****************************************************************************************************************/
+static void low_power_statistics(uint32_t now) {
+	uint32_t elapsed = now - stats_tick;
+
+	if (elapsed < LOW_POWER_STATS_PERIOD_MS) {
+		return;
+	}
+
+	residency_permil = (uint16_t) ((stats_stopped_ms >= elapsed) ? 1000 : (stats_stopped_ms * 1000UL) / elapsed);
+	stats_tick = now;
+	stats_stopped_ms = 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Enter STOP with the low power regulator until the wake-up timer or a USART1 start bit. Interrupts are
+ * enabled again right after the wake-up, while the core still runs from the HSI, so received bytes are read while
+ * the PLL locks
+ * @param ms Longest time in STOP
+ * @param stopped_ms Time spent in STOP; 0 if STOP was not entered
+ * @return false if STOP was not entered: a byte arrived since the bus check, or ms is below one wake-up timer count
+ */
+/****************************************************************************************************************/
+static bool low_power_stop(uint32_t ms, uint32_t *stopped_ms) {
+	uint32_t counts = ms * apre_hz * (LOW_POWER_RTC_PREDIV_A + 1) / (LOW_POWER_WUT_DIVIDER * 1000UL);
+
+	__disable_irq();
+	if ((modbus_bus_idle() == false) || (counts == 0)) {					// A byte arrived since the check
+		__enable_irq();
+		return false;
+	}
+
+	low_power_rtc_wakeup(counts);
+	rtc_wakeup = false;
+	USART1_stop_mode(true);
+	HAL_SuspendTick();
+	uint32_t start = low_power_rtc_ticks();
+	uint32_t start_us = timebase_us();
+
+	HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+
+	uint32_t wake_cycles = DWT->CYCCNT;										// CYCCNT does not count in STOP
+	__enable_irq();
+	uint32_t hsi_cycles = low_power_restore_clock() - wake_cycles;			// Core clock is the HSI until the switch
+	latency_us = (uint16_t) (LOW_POWER_STOP_EXIT_US + hsi_cycles / (HSI_VALUE / 1000000));
+	if (latency_us > latency_max_us) {
+		latency_max_us = latency_us;
+	}
+
+	USART1_stop_mode(false);
+	low_power_rtc_wakeup(0);
+	uint32_t elapsed = low_power_rtc_elapsed(start, low_power_rtc_ticks());
+	timebase_stopped(start_us, (uint32_t) ((uint64_t) elapsed * 1000000UL / apre_hz));	// TIM2 did not count either
+	uint32_t ticks = elapsed + tick_remainder;
+	uint32_t stopped = ticks * 1000UL / apre_hz;
+	tick_remainder = ticks - stopped * apre_hz / 1000UL;
+	uwTick += stopped;														// SysTick did not run in STOP
+	HAL_ResumeTick();
+
+	if (rtc_wakeup) {
+		wakeups_timer++;
+	} else {
+		wakeups_bus++;
+	}
+	stats_stopped_ms += stopped;
+	*stopped_ms = stopped;
+
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Restore the clock in use before STOP: the PLL, or the HSE if the clock governor had lowered it. The PLL
+ * is started in both cases, it clocks ADC2. STOP clears HSEON and PLLON and leaves the HSI as the system clock;
+ * HSE bypass, the PLL source and multiplier, the bus prescalers and the flash latency are kept. A lost HSE ends in
+ * a watchdog reset
+ * @return DWT cycle count when the switch from the HSI completed
+ */
+/****************************************************************************************************************/
+static uint32_t low_power_restore_clock(void) {
+	RCC->CR |= RCC_CR_HSEON;
+	while ((RCC->CR & RCC_CR_HSERDY) == 0);
+	RCC->CR |= RCC_CR_PLLON;
+	while ((RCC->CR & RCC_CR_PLLRDY) == 0);
+	if (SystemCoreClock == HSE_VALUE) {										// Lowered by the clock governor
+		RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSE;
+		while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSE);
+	} else {
+		RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_PLL;
+		while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+	}
+	return DWT->CYCCNT;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Return to continuous acquisition
+ */
+/****************************************************************************************************************/
+static void low_power_release(void) {
+	if (parked) {
+		parked = false;
+		acquisition_resume();
+	}
+	burst_sequence = 0;
+}
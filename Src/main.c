@@ -3,91 +3,190 @@
 #include <stdbool.h>
 #include <math.h>
 #include "rs485_modbus_rtu.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include "acquisition.h"
+#include "autozero.h"
+#include "temperature.h"
+#include "aux_input.h"
+#include "pga.h"
+#include "analog_cal.h"
+#include "flow_alarm.h"
+#include "trend.h"
+#include "flow_log.h"
+#include "scheduler.h"
+#include "low_power.h"
+#include "clock_governor.h"
+#include "fault_record.h"
+#include "watchdog.h"
+#include "timebase.h"
 
 #define MEASURE	0x00010001
-#define VREFINT_CAL_ADDR ((uint16_t*)((uint32_t)0x1FFFF7BA))			// VREFINT_CAL value. See datasheet for converting ADC to absolute voltage
 
 // Peripheral handles as generated by Cube
 UART_HandleTypeDef huart2;
 IWDG_HandleTypeDef hiwdg;
+ADC_HandleTypeDef hadc1;
 ADC_HandleTypeDef hadc2;
 OPAMP_HandleTypeDef hopamp2;
 DMA_HandleTypeDef hdma_adc2;
 
-// ADC Data structure, also accessed by ADC callback
-typedef struct ADC_Data {
-	volatile uint32_t adc_value_channel_3;
-	volatile uint32_t adc_vrefint_data;
-	volatile bool adc_conversion_complete;
-	uint16_t vrefint_cal;
-	double vdd;
-}ADC_Data;
-
 // Functions generated by Cube
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
 static void MX_DMA_Init(void);
 static void MX_USART2_UART_Init(void);
 static void MX_IWDG_Init(void);
+static void MX_ADC1_Init(void);
 static void MX_ADC2_Init(void);
 static void MX_OPAMP2_Init(void);
 
 // User functions
 uint32_t get_modbus_address();											// Function to get modbus device address from reading 5-bit dip switch
-void process_modbus_command(ModbusCommand mc, float step_per_liter, float zero_value);		// Process the received modbus command and respond
+uint32_t get_baud_rate(void);											// Function to get USART1 baud rate from the configuration store
+bool process_modbus_command(ModbusCommand mc);							// Process the received modbus command and respond
 float get_adc_value(void);												// Return the ADC value on channel 3
 bool self_calibration(float *spl, float *zo);							// Perform sensor calibration. See function description below
-int16_t get_flow(float step_per_liter, float zero_value);
+void boot_calibration(void);											// Load or perform calibration at boot depending on boot mode
+void rezero_task(void);													// Background re-zero, called from the main loop
+static bool compute_flow(float *flow);									// Flow from the current reading; shared by get_flow() and get_flow_milli()
+static void modbus_task(void);											// Scheduler tasks needing arguments from main
+static void analog_cal_main_task(void);
+static void autozero_main_task(void);
+static void flow_log_main_task(void);
 void HAL_IncTick(void);													// The function is defined as weak in stm32f3xx_hal.c and is redefined in main in order to use the sys tick interrupt (ocurring each ms)
 
 // User variables
 static uint8_t uart_buffer[64] = {0};									// Buffer used for printing strings to USART
 static uint32_t device_modbus_address = 0;								// Device modbus address is self-populated by get_modbus_address()
-static volatile uint32_t adc_value = 0;									// The ADC value is the average of 16 measurements
-static volatile uint32_t vrefint_value = 0;								// Internal VREFINT value; connected to channel 18, also averaged
-static volatile bool adc_conversion_complete = false;					// This flag needs to be polled when an ADC conversion is started
-uint32_t adc_buffer[48];												// Buffer used for ADC2 DMA interrupt
-ADC_Data adc_data;														// ADC_Data structure used for passing data between main and the ADC interrupt callback
 static float adc_step_per_liter = 0;
 static float zero_offset = 0;
+static volatile uint16_t calibration_status = 0;						// CAL_STATUS_x bits
+#define REZERO_SAMPLES	256												// Number of acquisition blocks averaged by a background re-zero
+static uint16_t rezero_count = 0;
+static float rezero_sum = 0;
+static uint32_t rezero_sequence = 0;									// Last acquisition block used by the re-zero
+static uint32_t boot_cycles_hsi = 0;									// DWT cycles from reset to the switch to the PLL, at HSI_VALUE
+static uint32_t boot_tick_offset_ms = 0;								// Time from reset to HAL_Init(), where the HAL tick starts
+static uint32_t boot_ready_us = 0;										// Time from reset to main loop
+static uint32_t first_response_ms = 0;									// Time from reset to first Modbus response
+static bool response_sent = false;										// Modbus response sent in the current scheduler pass
+static uint32_t response_latency_us = 0;								// End of the last request frame to its response
+
+// Scheduler tasks in the order they run. Tasks with period 0 run on every pass and keep their own time
+static SchedulerTask tasks[] = {
+	// Task					Period ms	Deadline ms
+	{ clock_governor_task,	0,			2 },
+	{ modbus_task,			0,			2 },
+	{ acquisition_task,		0,			ACQ_VREF_DEFAULT_PERIOD_MS },
+	{ analog_cal_main_task,	0,			100 },
+	{ rezero_task,			0,			10 },
+	{ pga_task,				0,			10 },
+	{ temperature_task,		0,			TEMPERATURE_PERIOD_MS / 2 },
+	{ autozero_main_task,	0,			AUTOZERO_UPDATE_PERIOD_MS / 2 },
+	{ trend_task,			0,			TREND_PERIOD_MS / 10 },
+	{ flow_log_main_task,	0,			100 },
+};
 
 int main(void) {
 
+	// The DWT cycle counter runs from reset (Reset_Handler), for the boot time
+	fault_record_init();													// Keep the previous crash record, enable the fault handlers
+
 	// Initialize peripherals
+	boot_tick_offset_ms = DWT->CYCCNT / (HSI_VALUE / 1000);
 	HAL_Init();
-	SystemClock_Config();
+	SystemClock_Config();													// Sets boot_cycles_hsi
 	MX_DMA_Init();
 	MX_ADC2_Init();
+	MX_ADC1_Init();															// Must be configured before ADC2 is enabled (shared temperature sensor enable)
 	MX_OPAMP2_Init();
 	MX_GPIO_Init();
 	MX_USART2_UART_Init();
+	MX_CRC_Init();
+	timebase_init();
+	config_store_init();
+	analog_cal_init();														// Stored trims, or calibrate OPAMP2 and ADC2
 	HAL_OPAMP_Start(&hopamp2);
 	device_modbus_address = get_modbus_address();
-	USART1_RS485_Init(device_modbus_address);
+	USART1_RS485_Init(device_modbus_address, get_baud_rate());
 	MX_IWDG_Init();
+	watchdog_init();														// Reads the reset cause before flow_log_init() logs it
 
-	adc_data.adc_conversion_complete = false;
-	adc_data.adc_value_channel_3 = 0;
-	adc_data.adc_vrefint_data = 0;
-	adc_data.vrefint_cal = *VREFINT_CAL_ADDR;
-	adc_data.vdd = 0.0;
+	pga_init();
+	flow_alarm_init();
+	aux_input_init();														// Selects the ADC2 scan length
+	acquisition_start();
+	temperature_init();
+	autozero_init();
+	boot_calibration();
+	trend_init();
+	flow_log_init();
+	low_power_init();
+	clock_governor_init();
 
-	if ( self_calibration(&adc_step_per_liter, &zero_offset) == false ) {
-		// @TODO: Take action if calibration fails
-	}
+	boot_ready_us = boot_cycles_hsi / (HSI_VALUE / 1000000) + (DWT->CYCCNT - boot_cycles_hsi) / (SystemCoreClock / 1000000);
+
+	scheduler_init(tasks, sizeof(tasks) / sizeof(tasks[0]));
 
 	while (1) {
 
-		if (modbus_command_available()) {																// Check if a command has been received
-			ModbusCommand mc = get_modbus_command();													// Read modbus command
-			if (mc.address ==  device_modbus_address & (modbus_command_check_crc(mc) == 0)) {			// Check command validity
-				process_modbus_command(mc, adc_step_per_liter, zero_offset);							// Parse command and take action
+		scheduler_run();													// Run due tasks, then sleep until the next interrupt
+
+		watchdog_task();													// Feed the IWDG while every supervised task checks in
+
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Handle a received Modbus command. Runs first in every scheduler pass
+ */
+/****************************************************************************************************************/
+static void modbus_task(void) {
+	response_sent = false;
+
+	if (modbus_command_available()) {																// Check if a command has been received
+		ModbusCommand mc = get_modbus_command();													// Read modbus command
+		if (mc.address ==  device_modbus_address & (modbus_command_check_crc(mc) == 0)) {			// Check command validity
+			if (process_modbus_command(mc)) {														// Parse command and take action
+				response_latency_us = timebase_us() - mc.timestamp_us;
+				response_sent = true;
+				if (first_response_ms == 0) {
+					first_response_ms = boot_tick_offset_ms + HAL_GetTick();
+				}
 			}
 		}
+	}
 
-		HAL_IWDG_Refresh(&hiwdg);
+	modbus_watchdog_checkin();
+}
 
-	}
+/****************************************************************************************************************/
+/**
+ * @brief Periodic OPAMP2/ADC2 calibration; prefers the bus gap after a response
+ */
+/****************************************************************************************************************/
+static void analog_cal_main_task(void) {
+	analog_cal_task(response_sent);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Auto-zero with the temperature compensated calibration
+ */
+/****************************************************************************************************************/
+static void autozero_main_task(void) {
+	autozero_task(zero_offset + temperature_zero_shift(), adc_step_per_liter * temperature_span_factor());
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Flash log writes; prefer the bus gap after a response
+ */
+/****************************************************************************************************************/
+static void flow_log_main_task(void) {
+	flow_log_task(response_sent);
 }
 
 /****************************************************************************************************************/
@@ -115,6 +214,8 @@ void SystemClock_Config(void) {
 	if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
 		Error_Handler();
 	}
+	boot_cycles_hsi = DWT->CYCCNT;											// Still on the HSI; the few cycles HAL_RCC_ClockConfig()
+																			// spends before the switch count at the PLL rate
 	/** Initializes the CPU, AHB and APB busses clocks
 	 */
 	RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_SYSCLK
@@ -129,7 +230,7 @@ void SystemClock_Config(void) {
 	}
 	PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_USART1
 			| RCC_PERIPHCLK_ADC12;
-	PeriphClkInit.Usart1ClockSelection = RCC_USART1CLKSOURCE_PCLK1;
+	PeriphClkInit.Usart1ClockSelection = RCC_USART1CLKSOURCE_HSI;			// Keeps receiving in STOP (low_power.h)
 	PeriphClkInit.Adc12ClockSelection = RCC_ADC12PLLCLK_DIV1;
 	if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK) {
 		Error_Handler();
@@ -207,6 +308,22 @@ static void MX_GPIO_Init(void)
 	GPIO_InitStruct.Pull = GPIO_PULLUP;
 	HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
+	/*Configure GPIO pin : VALVE_CLOSED_Pin */
+	GPIO_InitStruct.Pin = VALVE_CLOSED_Pin;
+	GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+	GPIO_InitStruct.Pull = GPIO_PULLUP;
+	HAL_GPIO_Init(VALVE_CLOSED_GPIO_Port, &GPIO_InitStruct);
+
+	/*Configure GPIO pin Output Level */
+	HAL_GPIO_WritePin(ALARM_OUT_GPIO_Port, ALARM_OUT_Pin, GPIO_PIN_RESET);
+
+	/*Configure GPIO pin : ALARM_OUT_Pin */
+	GPIO_InitStruct.Pin = ALARM_OUT_Pin;
+	GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+	GPIO_InitStruct.Pull = GPIO_NOPULL;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+	HAL_GPIO_Init(ALARM_OUT_GPIO_Port, &GPIO_InitStruct);
+
 	/*Configure GPIO pins : LD3_Pin Debug_Pin_Pin */
 	GPIO_InitStruct.Pin = LD3_Pin;
 	GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
@@ -244,7 +361,7 @@ static void MX_ADC2_Init(void)
   hadc2.Init.ExternalTrigConv = ADC_SOFTWARE_START;
   hadc2.Init.DataAlign = ADC_DATAALIGN_RIGHT;
   hadc2.Init.NbrOfConversion = 3;
-  hadc2.Init.DMAContinuousRequests = DISABLE;
+  hadc2.Init.DMAContinuousRequests = ENABLE;
   hadc2.Init.EOCSelection = ADC_EOC_SEQ_CONV;
   hadc2.Init.LowPowerAutoWait = DISABLE;
   hadc2.Init.Overrun = ADC_OVR_DATA_OVERWRITTEN;
@@ -291,16 +408,58 @@ static void MX_ADC2_Init(void)
 
   /* USER CODE BEGIN ADC2_Init 2 */
 
-  // Calibration as per https://www.youtube.com/watch?v=qqGsy06mris
-  ADC2->CR &= ~ADC_CR_ADEN;			// Disable ADC
-  ADC2->CR |= ADC_CR_ADCAL;			// Start calibration
-  while ( (ADC2->CR & ADC_CR_ADCAL) != 0);
-  uint32_t calfact = ADC2->CALFACT;
+  // Calibration factor is found or restored by analog_cal_init()
   /* USER CODE END ADC2_Init 2 */
 
 
 }
 
+/**
+  * @brief ADC1 Initialization Function. ADC1 only converts the internal temperature sensor (channel 16),
+  * one software triggered conversion at a time
+  * @param None
+  * @retval None
+  */
+static void MX_ADC1_Init(void)
+{
+  ADC_ChannelConfTypeDef sConfig = {0};
+
+  hadc1.Instance = ADC1;
+  hadc1.Init.ClockPrescaler = ADC_CLOCK_ASYNC_DIV1;
+  hadc1.Init.Resolution = ADC_RESOLUTION_12B;
+  hadc1.Init.ScanConvMode = ADC_SCAN_DISABLE;
+  hadc1.Init.ContinuousConvMode = DISABLE;
+  hadc1.Init.DiscontinuousConvMode = DISABLE;
+  hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+  hadc1.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  hadc1.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+  hadc1.Init.NbrOfConversion = 1;
+  hadc1.Init.DMAContinuousRequests = DISABLE;
+  hadc1.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
+  hadc1.Init.LowPowerAutoWait = DISABLE;
+  hadc1.Init.Overrun = ADC_OVR_DATA_OVERWRITTEN;
+  if (HAL_ADC_Init(&hadc1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  sConfig.Channel = ADC_CHANNEL_TEMPSENSOR;
+  sConfig.Rank = ADC_REGULAR_RANK_1;
+  sConfig.SingleDiff = ADC_SINGLE_ENDED;
+  sConfig.SamplingTime = ADC_SAMPLETIME_601CYCLES_5;						// Sensor needs > 2.2us sampling time
+  sConfig.OffsetNumber = ADC_OFFSET_NONE;
+  sConfig.Offset = 0;
+  if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  if (HAL_ADCEx_Calibration_Start(&hadc1, ADC_SINGLE_ENDED) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+
 /**
   * Enable DMA controller clock
   */
@@ -343,28 +502,12 @@ static void MX_OPAMP2_Init(void)
 	  {
 	    Error_Handler();
 	  }
-//	  if (HAL_OPAMP_SelfCalibrate(&hopamp2) != HAL_OK)
-//	  {
-//	    Error_Handler();
-//	  }
   /* USER CODE BEGIN OPAMP2_Init 2 */
 
-  /* USER CODE END OPAMP2_Init 2 */
+	  // Offset trims are found or restored by analog_cal_init()
 
-}
+  /* USER CODE END OPAMP2_Init 2 */
 
-/**
- * ADC Conversion via interrupt callback function. Path of execution:
- * The ADC interrupt handler in stm32f3xx_it.c calls the handler HAL_ADC_IRQHandler(&hadc2) in the
- * driver files. The HAL_ADC_ConvCpltCallback() function is the called after conversion is complete.
- *
- * Need to perform 16 consecutive conversions and average the result
- *
- * @param hadc
- */
-void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc)
-{
-	adc_data.adc_conversion_complete = true;
 }
 
 
@@ -372,7 +515,8 @@ void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc)
 /**
  * @brief Get device modbus address from reading 5-bit dip switch connected to PA0, PA1, PA3, PA4, PA5
  * @note The function is called immediately after boot ONCE. If change in address is needed, set up the address
- * and reset the circuit
+ * and reset the circuit. If the switch is set to 0 (broadcast address), the address from the configuration
+ * store is used
  * @return Modbus address
  */
 /****************************************************************************************************************/
@@ -394,120 +538,252 @@ uint32_t get_modbus_address() {
 	porta_idr &= 0x00000003;
 	porta_idr |= mask;
 
+	if (porta_idr == 0) {
+		config_get(CONFIG_KEY_MODBUS_ADDRESS, &porta_idr);				// Stays 0 if never configured
+	}
+
 	return porta_idr;
 }
 
+/****************************************************************************************************************/
+/**
+ * @brief Get USART1 baud rate from the configuration store. Defaults to 9600 if not set or invalid
+ * @return Baud rate in bps
+ */
+/****************************************************************************************************************/
+uint32_t get_baud_rate(void) {
+	uint32_t baud_rate = MODBUS_DEFAULT_BAUD_RATE;
+
+	if ((config_get(CONFIG_KEY_BAUD_RATE, &baud_rate) == false) || (modbus_baud_rate_valid(baud_rate) == false)) {
+		baud_rate = MODBUS_DEFAULT_BAUD_RATE;
+	}
+
+	return baud_rate;
+}
+
 /****************************************************************************************************************/
 /**
  * @brief Process modbus command
- * @note Description of commands under function code 0x04
- * Register 0x01 - flow measurement; 1 register
- * Register 0x02 - serial number; 2 registers
- * Register 0x03 - soft reset; response OK in ASCII
+ * @note Function codes 0x03 and 0x04 read a block of registers, 0x06 writes a single register. See
+ * modbus_registers.h for the register map. Other function codes are not answered
  * @param mc The command for processing
+ * @return true if a response or an exception response was sent
  */
 /****************************************************************************************************************/
-void process_modbus_command(ModbusCommand mc, float step_per_liter, float zero_value) {
+bool process_modbus_command(ModbusCommand mc) {
 
-	// Get modbus start register and number of registers from data field
-	uint32_t data_field = (uint32_t)(mc.data[0] << 24UL) | (uint32_t)(mc.data[1] << 16UL) | (uint32_t)(mc.data[2] << 8UL) | (uint32_t)(mc.data[3]);
-	uint8_t response[9] = {};												// Response array
+	// Get modbus start register and quantity of registers (or register value for writes) from data field
+	uint16_t start_register = (uint16_t) ((mc.data[0] << 8) | mc.data[1]);
+	uint16_t data_field = (uint16_t) ((mc.data[2] << 8) | mc.data[3]);
+	uint8_t response[5 + 2 * MODBUS_MAX_READ_REGISTERS];					// Response array
 	response[0] = mc.address;												// Copy device address
 	response[1] = mc.function_code;											// Copy function code
 
-	if (mc.function_code == 0x04) {											// Function code 0x04 - Read Holding registers
-		// Address 0x01; 1 register of 16 bits (int16_t)
-		if (data_field == 0x00010001) {										// Starting address 0001, quantity of input registers: 0001
-			int16_t temp = 0xffff;
-			response[2] = 2;												// 2 bytes (1 register) in payload
-			temp = get_flow(step_per_liter, zero_value);					// Get measurement
-			response[3] = (uint8_t) (temp >> 8);							// Copy measurement in buffer
-			response[4] = (uint8_t) (temp & 0xff);
-			uint16_t crc = modbus_generate_crc(response, 5);				// Generate CRC
-			response[5] = (uint8_t) (crc & 0xff);							// Copy CRC in buffer
-			response[6] = (uint8_t) (crc >> 8);
-			USART1_putstring(response, 7);									// Send measurement to USART1 (rs485)
+	if ((mc.function_code == MODBUS_FC_READ_INPUT_REGISTERS) || (mc.function_code == MODBUS_FC_READ_HOLDING_REGISTERS)) {
+		if ((data_field == 0) || (data_field > MODBUS_MAX_READ_REGISTERS)) {	// Quantity of registers out of range
+			modbus_send_exception(mc, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+			return true;
+		}
+
+		response[2] = (uint8_t) (data_field * 2);							// Number of bytes in payload
+		acquisition_freeze_sample(true);									// Flow and its timestamp from the same sample
+		for (uint16_t i = 0; i < data_field; i++) {
+			uint16_t value = 0;
+			if (modbus_read_register(start_register + i, &value) == false) {
+				acquisition_freeze_sample(false);
+				modbus_send_exception(mc, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+				return true;
+			}
+			response[3 + 2 * i] = (uint8_t) (value >> 8);					// Copy register in buffer
+			response[4 + 2 * i] = (uint8_t) (value & 0xff);
+		}
+		acquisition_freeze_sample(false);
+		modbus_send_response(response, 3 + response[2]);					// Send registers to USART1 (rs485)
+		return true;
+	}
+
+	if (mc.function_code == MODBUS_FC_WRITE_SINGLE_REGISTER) {
+		if (modbus_write_register(start_register, data_field) == false) {
+			modbus_send_exception(mc, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+			return true;
 		}
 
-//		// SFM4100 Serial number; 0x02; 2 registers
-//		if (data_field == 0x00020002) {
-//			uint32_t sfm4100_serial_number = 0;
-//			sfm_err = sfm4100_read_serial_number(&sfm4100_serial_number);	// Read sensor serial number
-//
-//			response[2] = 4;												// 4 bytes in payload
-//			response[3] = (uint8_t) (sfm4100_serial_number >> 24);
-//			response[4] = (uint8_t) (sfm4100_serial_number >> 16);
-//			response[5] = (uint8_t) (sfm4100_serial_number >> 8);
-//			response[6] = (uint8_t) (sfm4100_serial_number);
-//			uint16_t crc = modbus_generate_crc(response, 7);				// Generate CRC
-//			response[7] = (uint8_t) (crc & 0xff);
-//			response[8] = (uint8_t) (crc >> 8);
-//			USART1_putstring(response, 9);									// Send serial no. to USART1 (rs485)
-//
-//			if (sfm_err) sfm4100_soft_reset();								// If an error is returned when reading sensor, issue soft reset
-//		}
-//
-//		// Address 0x03; 1 register
-//		if (data_field == 0x00030001) {
-//			sfm4100_soft_reset();											// Issue soft reset
-//			response[2] = 2;												// 2 bytes (1 register) in payload
-//			response[3] = 0x4f;												// ASCII 'O'
-//			response[4] = 0x4b;												// ASCII 'K'
-//			uint16_t crc = modbus_generate_crc(response, 5);				// Generate CRC
-//			response[5] = (uint8_t) (crc & 0xff);							// Copy CRC in buffer
-//			response[6] = (uint8_t) (crc >> 8);
-//			USART1_putstring(response, 7);									// Send response to USART1 (rs485)
-//		}
-//
-//		// Address 0x04; 1 register; report slave ID
-//		if (data_field == 0x00040001) {
-//			response[2] = 2;												// 2 bytes (1 register) in payload
-//			response[3] = (uint8_t) (device_modbus_address >> 8);			// Copy measurement in buffer
-//			response[4] = (uint8_t) (device_modbus_address & 0xff);
-//			uint16_t crc = modbus_generate_crc(response, 5);				// Generate CRC
-//			response[5] = (uint8_t) (crc & 0xff);							// Copy CRC in buffer
-//			response[6] = (uint8_t) (crc >> 8);
-//			USART1_putstring(response, 7);									// Send response to USART1 (rs485)
-//		}
+		memcpy(&response[2], mc.data, 4);									// Normal response is an echo of the request
+		modbus_send_response(response, 6);
+		return true;
 	}
 
+	return false;
 }
 
 /****************************************************************************************************************/
 /**
- * The function triggers an ADC conversion, waits 1ms and polls the data ready flag of the ADC_Data structure.
- * The ADC scans channel 3 (connected to OPAMP2 output) and Vrefint, which is done to get the Vdd.
- * After that the function calculates the true value on ADC channel 3 using Vdd and returns it
+ * The function returns the latest channel 3 block average from the continuous acquisition (see acquisition.c).
+ * Channel 3 is connected to OPAMP2 output; the value is corrected for Vdd using Vrefint.
+ * Returns -1 if the acquisition has stalled.
  */
 /****************************************************************************************************************/
 float get_adc_value() {
-	HAL_ADC_Start_DMA(&hadc2, (uint32_t*)adc_buffer, 48);					// Start a new conversion
-	HAL_Delay(1);															// Wait a predetermined amount of time
-	if (adc_data.adc_conversion_complete != true) {							// Poll flag in adc_data
+	AcquisitionSample sample;
+
+	if (acquisition_get_sample(&sample) == false) {						// No block completed recently
 		return -1.0;
 	}
 
-	adc_data.adc_conversion_complete = false;								// Reset flag
-	adc_data.adc_value_channel_3 = 0;										// Clear ADC channel 3 data
-	adc_data.adc_vrefint_data = 0;											// Clear ADC Vrefint data
-	uint32_t channel4_adc = 0;
-	uint32_t *tempbuf = adc_buffer;											// Get a pointer to the ADC buffer
+	return sample.channel_3;
+}
+
+
+/****************************************************************************************************************/
+/**
+ * @brief Set up the sensor calibration at boot.
+ * In BOOT_MODE_CACHED the last good calibration is loaded from the configuration store and the device starts
+ * answering immediately; self_calibration() only runs if nothing is stored. In BOOT_MODE_CALIBRATE (default)
+ * self_calibration() runs first and the cached calibration is used if it fails (e.g. flow is not zero).
+ * If neither is available, the calibration stays invalid and get_flow() returns -1 until a re-zero succeeds.
+ */
+/****************************************************************************************************************/
+void boot_calibration(void) {
+	uint32_t boot_mode = BOOT_MODE_CALIBRATE;
+	float cached_zo = 0;
+	float cached_spl = 0;
+
+	config_get(CONFIG_KEY_BOOT_MODE, &boot_mode);
+	bool cached = config_get_float(CONFIG_KEY_ZERO_OFFSET, &cached_zo)
+			&& config_get_float(CONFIG_KEY_STEP_PER_LITER, &cached_spl)
+			&& (cached_spl > 0);
+
+	if ((boot_mode != BOOT_MODE_CACHED) || (cached == false)) {
+		if (self_calibration(&adc_step_per_liter, &zero_offset)) {
+			config_set_float(CONFIG_KEY_ZERO_OFFSET, zero_offset);			// Keep last good calibration in flash
+			config_set_float(CONFIG_KEY_STEP_PER_LITER, adc_step_per_liter);
+			calibration_status = CAL_STATUS_VALID;
+			temperature_set_calibration_point();
+			autozero_reset();
+			return;
+		}
+	}
+
+	if (cached) {
+		zero_offset = cached_zo;
+		adc_step_per_liter = cached_spl;
+		calibration_status = CAL_STATUS_VALID | CAL_STATUS_CACHED;
+	} else {
+		adc_step_per_liter = 0;
+		calibration_status = 0;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Request a background re-zero. The flow must be zero until CAL_STATUS_REZERO_BUSY clears
+ * @return false if a re-zero is already running
+ */
+/****************************************************************************************************************/
+bool start_rezero(void) {
+	if (calibration_status & CAL_STATUS_REZERO_BUSY) {
+		return false;
+	}
+
+	rezero_count = 0;
+	rezero_sum = 0;
+	calibration_status = (calibration_status & ~CAL_STATUS_REZERO_FAILED) | CAL_STATUS_REZERO_BUSY;
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Background re-zero. Takes at most one new acquisition block per call, so Modbus commands are still
+ * served while the zero is averaged over REZERO_SAMPLES blocks. On success the new calibration is used and stored in flash;
+ * on failure the previous calibration is kept
+ */
+/****************************************************************************************************************/
+void rezero_task(void) {
+	if ((calibration_status & CAL_STATUS_REZERO_BUSY) == 0) {
+		return;
+	}
+
+	AcquisitionSample sample;
+	if (acquisition_get_sample(&sample) == false) {							// Acquisition stalled
+		calibration_status = (calibration_status & ~CAL_STATUS_REZERO_BUSY) | CAL_STATUS_REZERO_FAILED;
+		return;
+	}
+	if (sample.sequence == rezero_sequence) {								// Wait for the next block
+		return;
+	}
+
+	rezero_sequence = sample.sequence;
+	rezero_sum += sample.channel_3;
+	if (++rezero_count < REZERO_SAMPLES) {
+		return;
+	}
 
-	for (int x = 0; x < 16; x++) {											// Iterate over the ADC buffer and copy the data
-		adc_data.adc_value_channel_3 += *tempbuf++;
-		adc_data.adc_vrefint_data += *tempbuf++;
-		channel4_adc += *tempbuf++;
+	float zo = rezero_sum / REZERO_SAMPLES;
+	if (zo < 0.5) {															// Input voltage is not correct - it should be 0.65V
+		calibration_status = (calibration_status & ~CAL_STATUS_REZERO_BUSY) | CAL_STATUS_REZERO_FAILED;
+		return;
 	}
 
-	channel4_adc = channel4_adc >> 4;
-	adc_data.adc_value_channel_3 = adc_data.adc_value_channel_3 >> 4;		// Divide values by 16
-	adc_data.adc_vrefint_data = adc_data.adc_vrefint_data >> 4;
-	adc_data.vdd = 3.3 * adc_data.vrefint_cal / adc_data.adc_vrefint_data;	// Get current Vdd value
-	float adc_result = adc_data.vdd * adc_data.adc_value_channel_3 / 4095; 	// Convert raw ADC data from channel 3
-	float temp = channel4_adc * adc_data.vdd / 4095;
-	return adc_result;
+	zero_offset = zo;
+	adc_step_per_liter = ((acquisition_get_vdd() - zo) / 200);
+	config_set_float(CONFIG_KEY_ZERO_OFFSET, zero_offset);
+	config_set_float(CONFIG_KEY_STEP_PER_LITER, adc_step_per_liter);
+	calibration_status = CAL_STATUS_VALID;
+	temperature_set_calibration_point();
+	autozero_reset();														// New zero supersedes the tracked drift
+	flow_log_append(FLOW_LOG_TYPE_REZERO, (int32_t) (zero_offset * 1000000.0f), (int32_t) (adc_step_per_liter * 1000000.0f), 0);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Calibration status for the register map
+ * @return CAL_STATUS_x bits
+ */
+/****************************************************************************************************************/
+uint16_t get_calibration_status(void) {
+	return calibration_status;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Time from reset until the main loop started answering Modbus commands
+ */
+/****************************************************************************************************************/
+uint32_t get_boot_ready_time_us(void) {
+	return boot_ready_us;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Time from reset until the first Modbus response was sent; 0 if none was sent yet
+ */
+/****************************************************************************************************************/
+uint32_t get_first_response_time_ms(void) {
+	return first_response_ms;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Time base timestamp of the sample behind get_flow() and get_flow_milli(); 0 if there is none
+ */
+/****************************************************************************************************************/
+uint32_t get_flow_timestamp_us(void) {
+	AcquisitionSample sample;
+
+	if (acquisition_get_sample(&sample) == false) {
+		return 0;
+	}
+	return sample.timestamp_us;
 }
 
+/****************************************************************************************************************/
+/**
+ * @brief Time from the receiver timeout that ended the last request to its response being queued
+ */
+/****************************************************************************************************************/
+uint32_t get_response_latency_us(void) {
+	return response_latency_us;
+}
 
 /****************************************************************************************************************/
 /**
@@ -522,31 +798,87 @@ bool self_calibration(float *spl, float *zo)
 		return false;
 	}
 
-	*spl = ((adc_data.vdd - *zo) / 200);
+	*spl = ((acquisition_get_vdd() - *zo) / 200);
 	return true;
 }
 
 
-int16_t get_flow(float step_per_liter, float zero_value) {
+/****************************************************************************************************************/
+/**
+ * @brief Convert the current ADC reading to flow using the sensor calibration
+ * @return Flow; -1 on ADC timeout or if no calibration is available
+ */
+/****************************************************************************************************************/
+int16_t get_flow(void) {
 	float flow = -1;
-	// Get current ADC reading
-	float adc_reading = get_adc_value();
 
-	if (adc_reading == -1) {
+	if (compute_flow(&flow) == false) {
 		return -1;
 	}
-
-	flow = (adc_reading - zero_value) / step_per_liter;
 	flow = round(flow);
 	return (int16_t) flow;
 }
 
+/****************************************************************************************************************/
+/**
+ * @brief Flow with three decimals, so the resolution from oversampling reaches the master
+ * @return Flow * 1000; INT32_MIN on ADC timeout or if no calibration is available
+ */
+/****************************************************************************************************************/
+int32_t get_flow_milli(void) {
+	float flow = 0;
+
+	if (compute_flow(&flow) == false) {
+		return INT32_MIN;
+	}
+	return (int32_t) roundf(flow * 1000.0f);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert the current ADC reading to flow using the sensor calibration
+ * @param flow
+ * @return false on ADC timeout or if no calibration is available
+ */
+/****************************************************************************************************************/
+static bool compute_flow(float *flow) {
+	float zero = 0;
+	float span = 0;
+	// Get current ADC reading
+	float adc_reading = get_adc_value();
+
+	if ((adc_reading == -1) || (get_flow_scale(&zero, &span) == false)) {
+		return false;														// ADC timeout or no calibration - avoid division by zero
+	}
+
+	*flow = (adc_reading - zero) / span;
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Current zero and span with auto-zero and temperature compensation applied: flow = (V - zero) / span
+ * @param zero Zero offset, V
+ * @param span Step per liter, V
+ * @return false if no calibration is available
+ */
+/****************************************************************************************************************/
+bool get_flow_scale(float *zero, float *span) {
+	if (((calibration_status & CAL_STATUS_VALID) == 0) || (adc_step_per_liter <= 0)) {
+		return false;
+	}
+
+	*zero = zero_offset + autozero_correction() + temperature_zero_shift();
+	*span = adc_step_per_liter * temperature_span_factor();
+	return true;
+}
+
 /****************************************************************************************************************/
 /**
  * The function is called each time a sys tick interrupt occurs. See void SysTick_Handler(void) in stm32f3xx_it.c
  */
 /****************************************************************************************************************/
-void HAL_IncTick(void)
+CCMRAM_FUNC void HAL_IncTick(void)
 {
 	uwTick += uwTickFreq;
 	// User code begin
@@ -564,10 +896,6 @@ void HAL_IncTick(void)
 void Error_Handler(void) {
 	/* USER CODE BEGIN Error_Handler_Debug */
 	/* User can add his own implementation to report the HAL error return state */
-	// @TODO Blink a LED if error handler called
-	__ASM volatile("BKPT #01");
-	while (1) {
-
-	}
+	fault_record_error((uint32_t) __builtin_return_address(0));			// Save the caller and reset
 	/* USER CODE END Error_Handler_Debug */
 }
@@ -0,0 +1,305 @@
+#include "modbus_registers.h"
+#include "config_store.h"
+#include "rs485_modbus_rtu.h"
+#include "autozero.h"
+#include "temperature.h"
+#include "aux_input.h"
+#include "acquisition.h"
+#include "pga.h"
+#include "analog_cal.h"
+#include "flow_alarm.h"
+#include "statistics.h"
+#include "trend.h"
+#include "flow_log.h"
+#include "capture.h"
+#include "scheduler.h"
+#include "low_power.h"
+#include "clock_governor.h"
+#include "fault_record.h"
+#include "isr_timing.h"
+#include "watchdog.h"
+#include "timebase.h"
+#include "ram_budget.h"
+
+static uint32_t time_us = 0;												// MODBUS_REG_TIME_US, taken when the high word is read
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a single register from the register map
+ * @param reg Register address
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool modbus_read_register(uint16_t reg, uint16_t *value) {
+	uint32_t temp = 0;
+
+	if ((reg >= MODBUS_REG_AUTOZERO_BASE) && (reg < MODBUS_REG_AUTOZERO_END)) {
+		return autozero_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_TEMPERATURE_BASE) && (reg < MODBUS_REG_TEMPERATURE_END)) {
+		return temperature_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_AUX_BASE) && (reg < MODBUS_REG_AUX_END)) {
+		return aux_input_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ACQ_BASE) && (reg < MODBUS_REG_ACQ_END)) {
+		return acquisition_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_PGA_BASE) && (reg < MODBUS_REG_PGA_END)) {
+		return pga_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ANALOG_CAL_BASE) && (reg < MODBUS_REG_ANALOG_CAL_END)) {
+		return analog_cal_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ALARM_BASE) && (reg < MODBUS_REG_ALARM_END)) {
+		return flow_alarm_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_STATS_BASE) && (reg < MODBUS_REG_STATS_END)) {
+		return stats_read_register(reg, value);
+	}
+
+	if (((reg >= MODBUS_REG_TREND_BASE) && (reg < MODBUS_REG_TREND_END))
+			|| ((reg >= MODBUS_REG_TREND_ENTRIES_BASE) && (reg < MODBUS_REG_TREND_ENTRIES_END))) {
+		return trend_read_register(reg, value);
+	}
+
+	if (((reg >= MODBUS_REG_LOG_BASE) && (reg < MODBUS_REG_LOG_END))
+			|| ((reg >= MODBUS_REG_LOG_RECORDS_BASE) && (reg < MODBUS_REG_LOG_RECORDS_END))) {
+		return flow_log_read_register(reg, value);
+	}
+
+	if (((reg >= MODBUS_REG_CAPTURE_BASE) && (reg < MODBUS_REG_CAPTURE_END))
+			|| ((reg >= MODBUS_REG_CAPTURE_DATA_BASE) && (reg < MODBUS_REG_CAPTURE_DATA_END))
+			|| ((reg >= MODBUS_REG_CAPTURE_PACKED_BASE) && (reg < MODBUS_REG_CAPTURE_PACKED_END))) {
+		return capture_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_SCHED_BASE) && (reg < MODBUS_REG_SCHED_END)) {
+		return scheduler_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_LP_BASE) && (reg < MODBUS_REG_LP_END)) {
+		return low_power_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_CLK_BASE) && (reg < MODBUS_REG_CLK_END)) {
+		return clock_governor_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ISR_BASE) && (reg < MODBUS_REG_ISR_END)) {
+		return isr_timing_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_RAM_BASE) && (reg < MODBUS_REG_RAM_END)) {
+		return ram_budget_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_FAULT_BASE) && (reg < MODBUS_REG_FAULT_END)) {
+		return fault_record_read_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_WDG_BASE) && (reg < MODBUS_REG_WDG_END)) {
+		return watchdog_read_register(reg, value);
+	}
+
+	switch (reg) {
+	case MODBUS_REG_FLOW:
+		*value = (uint16_t) get_flow();
+		return true;
+
+	case MODBUS_REG_FLOW_MILLI:
+		*value = (uint16_t) ((uint32_t) get_flow_milli() >> 16);
+		return true;
+
+	case MODBUS_REG_FLOW_MILLI + 1:
+		*value = (uint16_t) get_flow_milli();
+		return true;
+
+	case MODBUS_REG_FLOW_TIMESTAMP_US:
+		*value = (uint16_t) (get_flow_timestamp_us() >> 16);
+		return true;
+
+	case MODBUS_REG_FLOW_TIMESTAMP_US + 1:
+		*value = (uint16_t) get_flow_timestamp_us();
+		return true;
+
+	case MODBUS_REG_TIME_US:
+		time_us = timebase_us();											// Low word from the same reading
+		*value = (uint16_t) (time_us >> 16);
+		return true;
+
+	case MODBUS_REG_TIME_US + 1:
+		*value = (uint16_t) time_us;
+		return true;
+
+	case MODBUS_REG_CAL_STATUS:
+		*value = get_calibration_status();
+		return true;
+
+	case MODBUS_REG_BOOT_MODE:
+		temp = BOOT_MODE_CALIBRATE;
+		config_get(CONFIG_KEY_BOOT_MODE, &temp);
+		*value = (uint16_t) temp;
+		return true;
+
+	case MODBUS_REG_COMMAND:
+		*value = 0;
+		return true;
+
+	case MODBUS_REG_BOOT_READY_US:
+		*value = (uint16_t) (get_boot_ready_time_us() >> 16);
+		return true;
+
+	case MODBUS_REG_BOOT_READY_US + 1:
+		*value = (uint16_t) get_boot_ready_time_us();
+		return true;
+
+	case MODBUS_REG_FIRST_RESPONSE_MS:
+		*value = (uint16_t) (get_first_response_time_ms() >> 16);
+		return true;
+
+	case MODBUS_REG_FIRST_RESPONSE_MS + 1:
+		*value = (uint16_t) get_first_response_time_ms();
+		return true;
+
+	case MODBUS_REG_RESPONSE_LATENCY_US:
+		*value = (uint16_t) ((get_response_latency_us() > 0xFFFF) ? 0xFFFF : get_response_latency_us());
+		return true;
+
+	case MODBUS_REG_CFG_MODBUS_ADDRESS:
+		config_get(CONFIG_KEY_MODBUS_ADDRESS, &temp);						// 0 if never set
+		*value = (uint16_t) temp;
+		return true;
+
+	case MODBUS_REG_CFG_BAUD_RATE:
+		temp = MODBUS_DEFAULT_BAUD_RATE;
+		config_get(CONFIG_KEY_BAUD_RATE, &temp);
+		*value = (uint16_t) (temp / 100);
+		return true;
+
+	case MODBUS_REG_CFG_STORE_GENERATION:
+		*value = (uint16_t) config_store_generation();
+		return true;
+
+	case MODBUS_REG_CFG_STORE_FREE:
+		*value = config_store_free_records();
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a single register
+ * @param reg Register address
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool modbus_write_register(uint16_t reg, uint16_t value) {
+
+	if ((reg >= MODBUS_REG_AUTOZERO_BASE) && (reg < MODBUS_REG_AUTOZERO_END)) {
+		return autozero_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_TEMPERATURE_BASE) && (reg < MODBUS_REG_TEMPERATURE_END)) {
+		return temperature_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_AUX_BASE) && (reg < MODBUS_REG_AUX_END)) {
+		return aux_input_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ACQ_BASE) && (reg < MODBUS_REG_ACQ_END)) {
+		return acquisition_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_PGA_BASE) && (reg < MODBUS_REG_PGA_END)) {
+		return pga_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ANALOG_CAL_BASE) && (reg < MODBUS_REG_ANALOG_CAL_END)) {
+		return analog_cal_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ALARM_BASE) && (reg < MODBUS_REG_ALARM_END)) {
+		return flow_alarm_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_LOG_BASE) && (reg < MODBUS_REG_LOG_END)) {
+		return flow_log_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_CAPTURE_BASE) && (reg < MODBUS_REG_CAPTURE_END)) {
+		return capture_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_LP_BASE) && (reg < MODBUS_REG_LP_END)) {
+		return low_power_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_CLK_BASE) && (reg < MODBUS_REG_CLK_END)) {
+		return clock_governor_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_ISR_BASE) && (reg < MODBUS_REG_ISR_END)) {
+		return isr_timing_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_RAM_BASE) && (reg < MODBUS_REG_RAM_END)) {
+		return ram_budget_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_FAULT_BASE) && (reg < MODBUS_REG_FAULT_END)) {
+		return fault_record_write_register(reg, value);
+	}
+
+	if ((reg >= MODBUS_REG_WDG_BASE) && (reg < MODBUS_REG_WDG_END)) {
+		return watchdog_write_register(reg, value);
+	}
+
+	switch (reg) {
+	case MODBUS_REG_BOOT_MODE:
+		if ((value != BOOT_MODE_CALIBRATE) && (value != BOOT_MODE_CACHED)) {
+			return false;
+		}
+		return config_set(CONFIG_KEY_BOOT_MODE, value);
+
+	case MODBUS_REG_COMMAND:
+		if (value == MODBUS_COMMAND_REZERO) {
+			return start_rezero();											// Fails if a re-zero is already running
+		}
+		if ((value == MODBUS_COMMAND_PGA_CALIBRATE) || (value == MODBUS_COMMAND_PGA_CALIBRATE_2)) {
+			return pga_start_calibration(value == MODBUS_COMMAND_PGA_CALIBRATE_2);
+		}
+		if (value == MODBUS_COMMAND_ANALOG_CALIBRATE) {
+			return analog_cal_request();
+		}
+		return false;
+
+	case MODBUS_REG_CFG_MODBUS_ADDRESS:
+		if ((value < 1) || (value > 247)) {								// Valid Modbus slave addresses
+			return false;
+		}
+		return config_set(CONFIG_KEY_MODBUS_ADDRESS, value);
+
+	case MODBUS_REG_CFG_BAUD_RATE:
+		if (modbus_baud_rate_valid((uint32_t) value * 100) == false) {
+			return false;
+		}
+		return config_set(CONFIG_KEY_BAUD_RATE, (uint32_t) value * 100);
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,406 @@
+#include "pga.h"
+#include "acquisition.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+#include <math.h>
+
+extern OPAMP_HandleTypeDef hopamp2;
+
+// OPAMP2 CSR settings for each gain index
+static const uint32_t pga_csr[PGA_GAIN_COUNT] = {
+	OPAMP_FOLLOWER_MODE,
+	OPAMP_PGA_MODE | OPAMP_PGA_GAIN_2,
+	OPAMP_PGA_MODE | OPAMP_PGA_GAIN_4,
+	OPAMP_PGA_MODE | OPAMP_PGA_GAIN_8,
+	OPAMP_PGA_MODE | OPAMP_PGA_GAIN_16
+};
+
+static uint32_t control = 0;												// PGA_CONTROL_x bits
+static uint32_t fixed_index = 0;											// Gain index used without auto-ranging
+static uint32_t max_index = PGA_GAIN_COUNT - 1;								// Highest gain index used by auto-ranging
+static float actual_gain[PGA_GAIN_COUNT] = { 1, 2, 4, 8, 16 };				// Calibrated gain of each index
+static float input_offset[PGA_GAIN_COUNT] = { 0 };							// Calibrated input offset relative to x1, V
+
+static volatile uint8_t gain_index = 0;										// Gain in use
+static volatile uint8_t settle = 0;											// Samples left to discard
+static volatile uint32_t up_count = 0;										// Samples the level has allowed the next gain
+static volatile uint32_t switches = 0;										// Gain changes since boot
+static float level = 0;														// Filtered input level, V
+
+static uint16_t status = 0;													// PGA_STATUS_x bits
+static uint8_t cal_index = 0;												// Gain being calibrated; 0 measures the x1 reference
+static bool cal_second = false;												// Taking the second calibration point
+static float cal_point[PGA_GAIN_COUNT] = { 0 };								// Output of each gain at the first point, V
+static uint8_t cal_valid = 0;												// Gains measured at the first point, bit per index
+static float cal_span = 0;													// x1 output change from the first to the second point, V
+static volatile float cal_sum = 0;											// Output sum of the samples of the current calibration step
+static volatile uint32_t cal_count = 0;
+
+static void pga_set_gain(uint8_t index);
+static bool pga_cal_valid(uint8_t index, float gain, float offset);
+static bool pga_store_calibration(uint8_t index, float gain, float offset);
+static uint16_t pga_int16(float value);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load gain settings and calibration from the configuration store and set the initial gain. OPAMP2 must
+ * be initialized
+ */
+/****************************************************************************************************************/
+void pga_init(void) {
+	config_get(CONFIG_KEY_PGA_CONTROL, &control);
+	config_get(CONFIG_KEY_PGA_FIXED_GAIN, &fixed_index);
+	config_get(CONFIG_KEY_PGA_MAX_GAIN, &max_index);
+	if (fixed_index >= PGA_GAIN_COUNT) {
+		fixed_index = 0;
+	}
+	if (max_index >= PGA_GAIN_COUNT) {
+		max_index = PGA_GAIN_COUNT - 1;
+	}
+
+	for (uint8_t i = 1; i < PGA_GAIN_COUNT; i++) {
+		float gain = actual_gain[i];
+		float offset = 0;
+		config_get_float(CONFIG_KEY_PGA_CAL_2 + i - 1, &gain);
+		config_get_float(CONFIG_KEY_PGA_OFFSET_2 + i - 1, &offset);
+		if (pga_cal_valid(i, gain, offset)) {
+			actual_gain[i] = gain;
+			input_offset[i] = offset;
+		}
+	}
+
+	pga_set_gain((control & PGA_CONTROL_AUTO) ? 0 : fixed_index);		// Auto-ranging starts at x1 and steps up
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Gain calibration, called from the main loop. Averages PGA_CAL_SAMPLES samples at x1, then at each higher
+ * gain. The first point stores the ratio to x1 as the actual gain and clears the offset; the second point stores
+ * gain and offset from the change since the first point. Gains that would saturate with the current input, or
+ * were not measured at the first point, are skipped
+ */
+/****************************************************************************************************************/
+void pga_task(void) {
+	if ((status & PGA_STATUS_CALIBRATING) == 0) {
+		return;
+	}
+	if (cal_count < PGA_CAL_SAMPLES) {
+		return;
+	}
+
+	float output = cal_sum / cal_count;
+	uint8_t i = cal_index;
+	bool go_on = true;
+
+	if ((i > 0) && (output >= PGA_DOWN_THRESHOLD * acquisition_get_vdd())) {
+		status |= PGA_STATUS_CAL_PARTIAL;
+	} else if (cal_second == false) {
+		cal_point[i] = output;
+		cal_valid |= 1 << i;
+		if (i == 0) {
+			go_on = (output > 0);
+		} else {
+			pga_store_calibration(i, output / cal_point[0], 0);
+		}
+	} else if (i == 0) {
+		cal_span = output - cal_point[0];
+		if (fabsf(cal_span) < PGA_CAL_MIN_SPAN) {
+			status |= PGA_STATUS_CAL_NO_SPAN;
+			go_on = false;
+		}
+	} else if (cal_valid & (1 << i)) {
+		float gain = (output - cal_point[i]) / cal_span;
+		pga_store_calibration(i, gain, cal_point[i] / gain - cal_point[0]);	// x1 offset cancels out
+	} else {
+		status |= PGA_STATUS_CAL_PARTIAL;
+	}
+
+	if ((cal_index + 1 < PGA_GAIN_COUNT) && go_on) {
+		cal_index++;
+		__disable_irq();
+		pga_set_gain(cal_index);
+		cal_sum = 0;
+		cal_count = 0;
+		__enable_irq();
+		return;
+	}
+
+	__disable_irq();														// Done, back to normal ranging
+	status &= ~PGA_STATUS_CALIBRATING;
+	pga_set_gain((control & PGA_CONTROL_AUTO) ? 0 : fixed_index);
+	__enable_irq();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert a channel 3 sample from OPAMP2 output to input voltage and run auto-ranging. Called by the
+ * acquisition callbacks (interrupt context) for every sample
+ * @param voltage OPAMP2 output voltage on entry, input voltage on return, V
+ * @param vdd Vdd the sample was scaled with, V
+ * @return false if the sample was converted while the gain settled and must be discarded
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC bool pga_process_sample(float *voltage, float vdd) {
+	float output = *voltage;
+
+	if (settle) {
+		settle--;
+		return false;
+	}
+
+	*voltage = output / actual_gain[gain_index] - input_offset[gain_index];
+
+	if (status & PGA_STATUS_CALIBRATING) {
+		cal_sum += output;
+		cal_count++;
+		return true;
+	}
+
+	if ((control & PGA_CONTROL_AUTO) == 0) {
+		return true;
+	}
+
+	level += (*voltage - level) / (1 << PGA_FILTER_SHIFT);
+
+	if ((gain_index > 0) && (output > PGA_DOWN_THRESHOLD * vdd)) {		// Near saturation, step down at once
+		pga_set_gain(gain_index - 1);
+		level = *voltage;
+	} else if ((gain_index < max_index) && (level * actual_gain[gain_index + 1] < PGA_UP_THRESHOLD * vdd)) {
+		if (++up_count >= PGA_UP_HOLD_SAMPLES) {
+			pga_set_gain(gain_index + 1);
+		}
+	} else {
+		up_count = 0;
+	}
+
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Nominal gain in use
+ */
+/****************************************************************************************************************/
+uint8_t pga_gain(void) {
+	return 1 << gain_index;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write the gain in use to OPAMP2 again, after OPAMP2 was reinitialized
+ */
+/****************************************************************************************************************/
+void pga_restore(void) {
+	__disable_irq();
+	pga_set_gain(gain_index);
+	__enable_irq();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Auto-ranging enabled; the gain may change with every sample
+ */
+/****************************************************************************************************************/
+bool pga_auto_ranging(void) {
+	return (control & PGA_CONTROL_AUTO) != 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Gain calibration running
+ */
+/****************************************************************************************************************/
+bool pga_calibrating(void) {
+	return (status & PGA_STATUS_CALIBRATING) != 0;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Start a calibration point. The input must be steady, e.g. with the valve closed for the first point and
+ * a steady flow for the second
+ * @param second Take the second point; the first must have been taken since boot
+ * @return false if a calibration is already running, or the second point has no first point
+ */
+/****************************************************************************************************************/
+bool pga_start_calibration(bool second) {
+	if ((status & PGA_STATUS_CALIBRATING) || (second && ((cal_valid & 1) == 0))) {
+		return false;
+	}
+
+	__disable_irq();
+	cal_index = 0;
+	cal_second = second;
+	if (second == false) {
+		cal_valid = 0;
+	}
+	cal_sum = 0;
+	cal_count = 0;
+	status = PGA_STATUS_CALIBRATING;
+	pga_set_gain(0);
+	__enable_irq();
+
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a PGA register
+ * @param reg Register address, MODBUS_REG_PGA_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool pga_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_PGA_CAL_PPM) && (reg < MODBUS_REG_PGA_CAL_PPM + PGA_GAIN_COUNT - 1)) {
+		uint8_t i = reg - MODBUS_REG_PGA_CAL_PPM + 1;
+		*value = pga_int16((actual_gain[i] / (1 << i) - 1.0f) * 1000000.0f);
+		return true;
+	}
+	if ((reg >= MODBUS_REG_PGA_CAL_OFFSET_UV) && (reg < MODBUS_REG_PGA_CAL_OFFSET_UV + PGA_GAIN_COUNT - 1)) {
+		*value = pga_int16(input_offset[reg - MODBUS_REG_PGA_CAL_OFFSET_UV + 1] * 1000000.0f);
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_PGA_CONTROL:
+		*value = (uint16_t) control;
+		return true;
+
+	case MODBUS_REG_PGA_FIXED_GAIN:
+		*value = 1 << fixed_index;
+		return true;
+
+	case MODBUS_REG_PGA_MAX_GAIN:
+		*value = 1 << max_index;
+		return true;
+
+	case MODBUS_REG_PGA_GAIN:
+		*value = pga_gain();
+		return true;
+
+	case MODBUS_REG_PGA_STATUS:
+		*value = status;
+		return true;
+
+	case MODBUS_REG_PGA_SWITCHES:
+		*value = (uint16_t) switches;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a PGA register. Gains are written as 1, 2, 4, 8 or 16; settings are kept in the configuration store
+ * @param reg Register address, MODBUS_REG_PGA_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool pga_write_register(uint16_t reg, uint16_t value) {
+	uint8_t index = 0;
+
+	switch (reg) {
+	case MODBUS_REG_PGA_CONTROL:
+		if ((value & ~PGA_CONTROL_AUTO) || (status & PGA_STATUS_CALIBRATING)) {
+			return false;
+		}
+		control = value;
+		__disable_irq();
+		pga_set_gain((control & PGA_CONTROL_AUTO) ? 0 : fixed_index);
+		__enable_irq();
+		acquisition_reconfigure();											// The alarm window depends on auto-ranging
+		return config_set(CONFIG_KEY_PGA_CONTROL, control);
+
+	case MODBUS_REG_PGA_FIXED_GAIN:
+	case MODBUS_REG_PGA_MAX_GAIN:
+		while ((index < PGA_GAIN_COUNT) && ((1 << index) != value)) {
+			index++;
+		}
+		if (index >= PGA_GAIN_COUNT) {
+			return false;
+		}
+		if (reg == MODBUS_REG_PGA_MAX_GAIN) {
+			max_index = index;
+			return config_set(CONFIG_KEY_PGA_MAX_GAIN, max_index);
+		}
+		fixed_index = index;
+		if (((control & PGA_CONTROL_AUTO) == 0) && ((status & PGA_STATUS_CALIBRATING) == 0)) {
+			__disable_irq();
+			pga_set_gain(fixed_index);
+			__enable_irq();
+		}
+		return config_set(CONFIG_KEY_PGA_FIXED_GAIN, fixed_index);
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Switch OPAMP2 to a gain and discard the samples converted while it settles. Called with the acquisition
+ * interrupt blocked or from it
+ * @param index Gain index, 0 is x1
+ */
+/****************************************************************************************************************/
+static void pga_set_gain(uint8_t index) {
+	if ((index == gain_index) && ((hopamp2.Instance->CSR & (OPAMP_CSR_VMSEL | OPAMP_CSR_PGGAIN)) == pga_csr[index])) {
+		return;
+	}
+
+	MODIFY_REG(hopamp2.Instance->CSR, OPAMP_CSR_VMSEL | OPAMP_CSR_PGGAIN, pga_csr[index]);
+	gain_index = index;
+	settle = PGA_SETTLE_SAMPLES;
+	up_count = 0;
+	switches++;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check a calibration result against the nominal gain and the largest offset
+ * @param index Gain index, 1 is x2
+ */
+/****************************************************************************************************************/
+static bool pga_cal_valid(uint8_t index, float gain, float offset) {
+	float nominal = (float) (1 << index);
+
+	return (fabsf(gain - nominal) <= PGA_CAL_GAIN_TOLERANCE * nominal) && (fabsf(offset) <= PGA_CAL_MAX_OFFSET);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Use and store the calibration of one gain, unless it is out of tolerance
+ * @param index Gain index, 1 is x2
+ * @return false if the result was rejected; PGA_STATUS_CAL_REJECTED is set
+ */
+/****************************************************************************************************************/
+static bool pga_store_calibration(uint8_t index, float gain, float offset) {
+	if (pga_cal_valid(index, gain, offset) == false) {						// Also catches NaN from a bad point
+		status |= PGA_STATUS_CAL_REJECTED;
+		return false;
+	}
+
+	actual_gain[index] = gain;
+	input_offset[index] = offset;
+	return config_set_float(CONFIG_KEY_PGA_CAL_2 + index - 1, gain)
+			&& config_set_float(CONFIG_KEY_PGA_OFFSET_2 + index - 1, offset);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert a value to an int16 register, saturated at INT16_MIN and INT16_MAX
+ */
+/****************************************************************************************************************/
+static uint16_t pga_int16(float value) {
+	if (value >= (float) INT16_MAX) {
+		return (uint16_t) INT16_MAX;
+	}
+	if (value <= (float) INT16_MIN) {
+		return (uint16_t) INT16_MIN;
+	}
+	return (uint16_t) (int16_t) value;
+}
@@ -0,0 +1,148 @@
+#include "ram_budget.h"
+#include "modbus_registers.h"
+
+_Static_assert(MODBUS_REG_RAM_SUBSYSTEM + RAM_BUDGET_SUBSYSTEM_COUNT <= MODBUS_REG_RAM_END,
+		"RAM subsystem table overlaps the end of the block");
+
+// Linker script symbols
+extern uint32_t _sdata, _ebss, _end, _estack, _Min_Stack_Size;
+extern uint32_t _sdata_acquisition, _edata_acquisition, _sbss_acquisition, _ebss_acquisition;
+extern uint32_t _sdata_capture, _edata_capture, _sbss_capture, _ebss_capture;
+extern uint32_t _sdata_trend, _edata_trend, _sbss_trend, _ebss_trend;
+extern uint32_t _sdata_autozero, _edata_autozero, _sbss_autozero, _ebss_autozero;
+extern uint32_t _sdata_flow_log, _edata_flow_log, _sbss_flow_log, _ebss_flow_log;
+extern uint32_t _sdata_modbus, _edata_modbus, _sbss_modbus, _ebss_modbus;
+extern uint32_t _sdata_config, _edata_config, _sbss_config, _ebss_config;
+extern uint32_t _sdata_hal, _edata_hal, _sbss_hal, _ebss_hal;
+
+// .data and .bss bounds of a subsystem
+typedef struct RamBudgetSubsystem {
+	const uint32_t	*sdata;
+	const uint32_t	*edata;
+	const uint32_t	*sbss;
+	const uint32_t	*ebss;
+}RamBudgetSubsystem;
+
+static const RamBudgetSubsystem subsystems[RAM_BUDGET_OTHER] = {
+	{ &_sdata_acquisition, &_edata_acquisition, &_sbss_acquisition, &_ebss_acquisition },
+	{ &_sdata_capture, &_edata_capture, &_sbss_capture, &_ebss_capture },
+	{ &_sdata_trend, &_edata_trend, &_sbss_trend, &_ebss_trend },
+	{ &_sdata_autozero, &_edata_autozero, &_sbss_autozero, &_ebss_autozero },
+	{ &_sdata_flow_log, &_edata_flow_log, &_sbss_flow_log, &_ebss_flow_log },
+	{ &_sdata_modbus, &_edata_modbus, &_sbss_modbus, &_ebss_modbus },
+	{ &_sdata_config, &_edata_config, &_sbss_config, &_ebss_config },
+	{ &_sdata_hal, &_edata_hal, &_sbss_hal, &_ebss_hal },
+};
+
+static uint32_t ram_budget_subsystem_bytes(uint8_t subsystem);
+
+/****************************************************************************************************************/
+/**
+ * @brief Stack high-water mark since the last paint
+ * @return Bytes of stack used at the deepest point
+ */
+/****************************************************************************************************************/
+uint32_t ram_budget_stack_peak(void) {
+	const uint32_t *p = &_end;
+	const uint32_t *sp = (const uint32_t *) __get_MSP();
+
+	while ((p < sp) && (*p == RAM_BUDGET_PAINT)) {
+		p++;
+	}
+
+	return (uint32_t) &_estack - (uint32_t) p;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Paint the area below the current stack pointer again, so that the next peak is measured from now on.
+ * Interrupts are disabled, as their stack frames go into the painted area
+ */
+/****************************************************************************************************************/
+void ram_budget_repaint(void) {
+	__disable_irq();
+	uint32_t *sp = (uint32_t *) __get_MSP();
+	for (uint32_t *p = &_end; p < sp; p++) {
+		*p = RAM_BUDGET_PAINT;
+	}
+	__enable_irq();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a RAM budget register
+ * @param reg Register address, MODBUS_REG_RAM_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool ram_budget_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_RAM_SUBSYSTEM) && (reg < MODBUS_REG_RAM_SUBSYSTEM + RAM_BUDGET_SUBSYSTEM_COUNT)) {
+		*value = (uint16_t) ram_budget_subsystem_bytes(reg - MODBUS_REG_RAM_SUBSYSTEM);
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_RAM_STACK_PEAK:
+		*value = (uint16_t) ram_budget_stack_peak();
+		return true;
+
+	case MODBUS_REG_RAM_STACK_FREE:
+		*value = (uint16_t) ((uint32_t) &_estack - (uint32_t) &_end - ram_budget_stack_peak());
+		return true;
+
+	case MODBUS_REG_RAM_STACK_AREA:
+		*value = (uint16_t) ((uint32_t) &_estack - (uint32_t) &_end);
+		return true;
+
+	case MODBUS_REG_RAM_STACK_RESERVED:
+		*value = (uint16_t) (uint32_t) &_Min_Stack_Size;
+		return true;
+
+	case MODBUS_REG_RAM_STATIC:
+		*value = (uint16_t) ((uint32_t) &_ebss - (uint32_t) &_sdata);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a RAM budget register: any write to the stack peak repaints the stack area
+ * @param reg Register address, MODBUS_REG_RAM_x
+ * @param value
+ * @return false if the register does not exist or is read-only
+ */
+/****************************************************************************************************************/
+bool ram_budget_write_register(uint16_t reg, uint16_t value) {
+
+	if (reg == MODBUS_REG_RAM_STACK_PEAK) {
+		ram_budget_repaint();
+		return true;
+	}
+
+	return false;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Static RAM of a subsystem
+ * @param subsystem RAM_BUDGET_x
+ * @return .data and .bss bytes
+ */
+/****************************************************************************************************************/
+static uint32_t ram_budget_subsystem_bytes(uint8_t subsystem) {
+	if (subsystem < RAM_BUDGET_OTHER) {
+		const RamBudgetSubsystem *s = &subsystems[subsystem];
+		return ((uint32_t) s->edata - (uint32_t) s->sdata) + ((uint32_t) s->ebss - (uint32_t) s->sbss);
+	}
+
+	uint32_t bytes = (uint32_t) &_ebss - (uint32_t) &_sdata;
+	for (uint8_t i = 0; i < RAM_BUDGET_OTHER; i++) {
+		bytes -= ram_budget_subsystem_bytes(i);
+	}
+	return bytes;
+}
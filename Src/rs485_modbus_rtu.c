@@ -1,16 +1,20 @@
 #include "rs485_modbus_rtu.h"
+#include "isr_timing.h"
+#include "watchdog.h"
+#include "timebase.h"
 
 static UART_HandleTypeDef huart1;										// USART1 handle
 CRC_HandleTypeDef hcrc;													// CRC handle
 
 /*
- * UART1 Inettupt based-transmit buffer
+ * UART1 Inettupt based-transmit buffer. Holds a whole response frame, so queueing one never waits for the wire;
+ * with 256 bytes the 8-bit head and tail wrap by themselves
  * */
-#define UART1_TX_BUFFER_SIZE 64
+#define UART1_TX_BUFFER_SIZE 256
 static volatile uint8_t uart1TxHead = 0;
 static volatile uint8_t uart1TxTail = 0;
 static volatile uint8_t uart1TxBuffer[UART1_TX_BUFFER_SIZE];
-static volatile uint8_t uart1TxBufferRemaining;
+static volatile uint16_t uart1TxBufferRemaining;
 
 /*
  * Modbus buffer - 8 bytes, populated by USART1 IRQ. Not to be used by main
@@ -22,7 +26,6 @@ static volatile uint8_t modbus_rx_buffer[MODBUS_COMMAND_LENGTH];
 static volatile uint modbus_buffer_count = 0;
 
 static uint32_t modbus_device_address = 0x0;								// Device address; updated once in USART1_RS485_Init()
-static const uint8_t modbus_function_code = 0x04;							// Function code
 
 #define COMMAND_BUFFER_SIZE	8												// Maximum modbus buffer size
 static volatile ModbusCommand commands[COMMAND_BUFFER_SIZE];				// Declaration of modbus command buffer
@@ -30,20 +33,28 @@ static volatile uint8_t mc_head = 0;
 static volatile uint8_t mc_tail = 0;
 static volatile uint8_t mc_count = 0;
 
+static volatile uint32_t last_rx_us = 0;									// timebase_us() of the last byte received, for any node
+
+static uint32_t supervised_isr = 0;											// USART1 status and TX tail at the previous watchdog check-in
+static uint8_t supervised_tail = 0;
+
 
 
 /****************************************************************************************************************/
 /**
- * @brief USART1 Initialization Function (for USART1 with Modbus and CRC functions)
+ * @brief USART1 Initialization Function (for USART1 with Modbus)
+ * @note The CRC unit used by the Modbus functions is initialized separately by MX_CRC_Init(), as it is also
+ * used by the configuration store before USART1 is set up
  * @param device_address
+ * @param baud_rate
  * @retval None
  */
 /****************************************************************************************************************/
-void USART1_RS485_Init(uint32_t device_address) {
+void USART1_RS485_Init(uint32_t device_address, uint32_t baud_rate) {
 	modbus_device_address = device_address;
 
 	huart1.Instance = USART1;
-	huart1.Init.BaudRate = 9600;
+	huart1.Init.BaudRate = baud_rate;
 	huart1.Init.WordLength = UART_WORDLENGTH_8B;
 	huart1.Init.StopBits = UART_STOPBITS_2;
 	huart1.Init.Parity = UART_PARITY_NONE;
@@ -60,6 +71,13 @@ void USART1_RS485_Init(uint32_t device_address) {
 	huart1.Instance->CR2 |= USART_CR2_RTOEN;						// Enable receiver timeout for Modbus
 	huart1.Instance->RTOR |= 0x50;									// Timeout: 40 bits. 1 bit @ 9600bps = 1/9600 = 104.17us. 40 bits = 4.17ms, approx. 3.5 chars * 11 bits each
 
+	UART_WakeUpTypeDef wake_up = { 0 };								// A start bit wakes the core from STOP (USART1 runs on the HSI)
+	wake_up.WakeUpEvent = UART_WAKEUP_ON_STARTBIT;
+	if (HAL_UARTEx_StopModeWakeUpSourceConfig(&huart1, wake_up) != HAL_OK) {
+		Error_Handler();
+	}
+
+	last_rx_us = timebase_us();
 	uart1TxHead = 0;												// Initialize UART buffer variables
 	uart1TxTail = 0;
 	uart1TxBufferRemaining = sizeof(uart1TxBuffer);
@@ -69,30 +87,31 @@ void USART1_RS485_Init(uint32_t device_address) {
 	__HAL_UART_ENABLE_IT(&huart1, UART_IT_RTO);						// Enable Receive Timeout interrupt
 	__HAL_UART_ENABLE_IT(&huart1, UART_IT_RXNE);					// Enable Receive interrupt
 	HAL_NVIC_EnableIRQ(USART1_IRQn);
-
-	MX_CRC_Init();													// Initialize CRC calculation unit
 }
 
 
 /****************************************************************************************************************/
 /**
- * @brief USART1 interrupt service routine
+ * @brief USART1 interrupt service routine. Register level: the status is read once and the flags are cleared
+ * through ICR. TXE is only served while its interrupt is enabled, as the flag is set whenever TDR is empty
  */
 /****************************************************************************************************************/
-void USART1_IRQHandler(void) {
+CCMRAM_FUNC void USART1_IRQHandler(void) {
+	uint32_t isr_start = DWT->CYCCNT;
+	uint32_t isr = USART1->ISR;
 
-	if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_RXNE)) {											// Handle RX interrupt
-		huart1.Instance->RTOR |= 0x50;															// Test only: set RTOR again after each reception
+	if (isr & USART_ISR_RXNE) {																	// Handle RX interrupt
 		modbus_rx_buffer[modbus_buffer_head++] = USART1->RDR;									// Place char in modbus command buffer (8 bytes only)
 		if (modbus_buffer_head == MODBUS_COMMAND_LENGTH) modbus_buffer_head = 0;				// Wrap-around buffer head
 		modbus_buffer_count++;																	// Increase modbus buffer count
+		last_rx_us = timebase_us();
 	}
 
-	if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_ORE)) {					// Clear overrun flag
-		__HAL_UART_CLEAR_FLAG(&huart1, UART_FLAG_ORE);
+	if (isr & (USART_ISR_ORE | USART_ISR_WUF)) {						// Clear overrun; a wake-up from STOP by a start bit is followed by RXNE
+		USART1->ICR = USART_ICR_ORECF | USART_ICR_WUCF;
 	}
 
-	if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_TXE)) {					// Handle transmit interrupt
+	if ((isr & USART_ISR_TXE) && (USART1->CR1 & USART_CR1_TXEIE)) {	// Handle transmit interrupt
 		if(sizeof(uart1TxBuffer) > uart1TxBufferRemaining) {			// If the number of free spaces in the buffer is less than the size of the buffer that means there's still characters to be sent
 			USART1->TDR = uart1TxBuffer[uart1TxTail++];					// Place char in the TX buffer. This also clears the interrupt flag
 			if(sizeof(uart1TxBuffer) <= uart1TxTail)					// Wrap around tail if needed
@@ -102,19 +121,18 @@ void USART1_IRQHandler(void) {
 			uart1TxBufferRemaining++;			 						// Increase number of remaining characters
 		} else {														// If remaining chars == buffer size, there's nothing to transmit
 			USART1->CR1 &= ~USART_CR1_TXEIE;							// Disable TXE interrupt
-			__HAL_UART_CLEAR_FLAG(&huart1, UART_FLAG_TXE);				// Clear flag
 		}
 	}
 
 
-	if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_RTOF)) {					// The Receive Timeout interrupt happens when an idle tie of more than 40 bits (3.5 modbus 11 bit chars)
-		__HAL_UART_CLEAR_FLAG(&huart1, UART_FLAG_RTOF);					// Clear receive timeout interrupt flag
+	if (isr & USART_ISR_RTOF) {											// The Receive Timeout interrupt happens when an idle tie of more than 40 bits (3.5 modbus 11 bit chars)
+		USART1->ICR = USART_ICR_RTOCF;									// Clear receive timeout interrupt flag
 
 		if (modbus_buffer_head == 0 && modbus_buffer_count == 8) {		// Check modbus command buffer. If head == 0 and count == 8, an 8-byte command has been received and head has wrapped around
 			modbus_buffer_count = 0;									// Zero modbus command buffer count
 
 			if (modbus_rx_buffer[0] == modbus_device_address) {			// Check if modbuss address matches
-				if (modbus_rx_buffer[1] == modbus_function_code) {		// Check if function code matches
+				if (modbus_function_supported(modbus_rx_buffer[1])) {	// Check if function code is supported
 
 					commands[mc_head].address = modbus_rx_buffer[0];	// Copy received data into modbus command buffer
 					commands[mc_head].function_code = modbus_rx_buffer[1];
@@ -124,6 +142,7 @@ void USART1_IRQHandler(void) {
 					commands[mc_head].data[3] = modbus_rx_buffer[5];
 					commands[mc_head].crc[0] = modbus_rx_buffer[6];
 					commands[mc_head].crc[1] = modbus_rx_buffer[7];
+					commands[mc_head].timestamp_us = timebase_us();
 
 					mc_head++;											// Increase and wrap-around buffer head and count variables
 					if (mc_head == COMMAND_BUFFER_SIZE) mc_head = 0;
@@ -138,6 +157,60 @@ void USART1_IRQHandler(void) {
 			modbus_buffer_count = 0;
 		}
 	}
+
+	isr_timing_record(ISR_TIMING_USART1, DWT->CYCCNT - isr_start);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check if a function code is handled by the device. All supported functions use 8-byte request frames
+ * @param function_code
+ * @return true if supported
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC bool modbus_function_supported(uint8_t function_code) {
+	return (function_code == MODBUS_FC_READ_HOLDING_REGISTERS)
+			|| (function_code == MODBUS_FC_READ_INPUT_REGISTERS)
+			|| (function_code == MODBUS_FC_WRITE_SINGLE_REGISTER);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check if a baud rate is one of the standard rates supported on the RS485 bus
+ * @param baud_rate
+ * @return true if supported
+ */
+/****************************************************************************************************************/
+bool modbus_baud_rate_valid(uint32_t baud_rate) {
+	switch (baud_rate) {
+	case 4800:
+	case 9600:
+	case 19200:
+	case 38400:
+	case 57600:
+	case 115200:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Keep USART1 receiving in STOP and let a start bit wake the core. Set before entering STOP and cleared
+ * after the wake-up
+ * @param enable
+ */
+/****************************************************************************************************************/
+void USART1_stop_mode(bool enable) {
+	if (enable) {
+		__HAL_UART_CLEAR_FLAG(&huart1, UART_CLEAR_WUF);
+		__HAL_UART_ENABLE_IT(&huart1, UART_IT_WUF);
+		USART1->CR1 |= USART_CR1_UESM;
+	} else {
+		USART1->CR1 &= ~USART_CR1_UESM;
+		__HAL_UART_DISABLE_IT(&huart1, UART_IT_WUF);
+	}
 }
 
 /****************************************************************************************************************/
@@ -207,6 +280,7 @@ ModbusCommand get_modbus_command(void) {
 		m_command.data[3] = commands[mc_tail].data[3];
 		m_command.crc[0] = commands[mc_tail].crc[0];
 		m_command.crc[1] = commands[mc_tail].crc[1];
+		m_command.timestamp_us = commands[mc_tail].timestamp_us;
 
 		mc_tail++;
 		mc_count--;
@@ -237,7 +311,7 @@ uint8_t modbus_command_check_crc(ModbusCommand mc) {
 	temp[4] = mc.data[2];
 	temp[5] = mc.data[3];
 
-	uint32_t calculated_crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)&temp, 6);
+	uint32_t calculated_crc = modbus_generate_crc(temp, 6);
 
 	if (calculated_crc == message_crc) {
 		return 0;
@@ -248,16 +322,102 @@ uint8_t modbus_command_check_crc(ModbusCommand mc) {
 
 /****************************************************************************************************************/
 /**
- * @brief Generate a CRC for the given message
+ * @brief Generate a CRC for the given message. Feeds the CRC unit set up by MX_CRC_Init() directly, one byte per
+ * write, which gives the same result as HAL_CRC_Calculate() in byte mode
  * @param message
  * @param message_len
  * @return 16-bit CRC
  */
 /****************************************************************************************************************/
-uint16_t modbus_generate_crc(uint8_t *message, uint8_t message_len) {
-	uint32_t temp = HAL_CRC_Calculate(&hcrc, (uint32_t*)message, message_len);
+CCMRAM_FUNC uint16_t modbus_generate_crc(uint8_t *message, uint8_t message_len) {
+	CRC->CR |= CRC_CR_RESET;												// Load the initial value
+	for (uint8_t i = 0; i < message_len; i++) {
+		*(__IO uint8_t *) &CRC->DR = message[i];
+	}
+
+	return (uint16_t) CRC->DR;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Append the CRC to a response frame and send it to USART1
+ * @param response Frame buffer; must have room for 2 more bytes after message_len
+ * @param message_len Length of the frame without CRC
+ */
+/****************************************************************************************************************/
+void modbus_send_response(uint8_t *response, uint8_t message_len) {
+	uint16_t crc = modbus_generate_crc(response, message_len);			// Generate CRC
+	response[message_len] = (uint8_t) (crc & 0xff);					// Copy CRC in buffer
+	response[message_len + 1] = (uint8_t) (crc >> 8);
+	USART1_putstring(response, message_len + 2);						// Send response to USART1 (rs485)
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Send a Modbus exception response for the given command
+ * @param mc
+ * @param exception_code One of MODBUS_EXCEPTION_x
+ */
+/****************************************************************************************************************/
+void modbus_send_exception(ModbusCommand mc, uint8_t exception_code) {
+	uint8_t response[5];
+
+	response[0] = mc.address;
+	response[1] = mc.function_code | 0x80;								// Exception responses have MSB of function code set
+	response[2] = exception_code;
+	modbus_send_response(response, 3);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check that this node is neither sending a response nor receiving a request, so the CPU may stall (e.g.
+ * flash programming) without breaking a frame. Frames for other nodes are not seen as activity
+ * @return true if the transmit buffer and the shift register are empty and no request is pending
+ */
+/****************************************************************************************************************/
+bool modbus_bus_idle(void) {
+	return (uart1TxBufferRemaining == sizeof(uart1TxBuffer))
+			&& ((USART1->CR1 & USART_CR1_TXEIE) == 0)
+			&& (USART1->ISR & USART_ISR_TC)
+			&& (modbus_buffer_count == 0)
+			&& (mc_count == 0);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check that the bus has been silent for long enough that a master polling back-to-back would have sent
+ * something: the receiver timeout plus a number of request frame times since the last byte received for any node.
+ * Used before stalling the CPU for tens of ms
+ * @param frames 8-byte frame times on top of the receiver timeout, up to 40
+ * @return true if this node is idle and nothing was received for that long
+ */
+/****************************************************************************************************************/
+bool modbus_bus_quiet(uint8_t frames) {
+	uint32_t bits = (USART1->RTOR & USART_RTOR_RTO) + frames * MODBUS_COMMAND_LENGTH * 11;	// 11 bits per character
+	uint32_t quiet_us = bits * 1000000UL / huart1.Init.BaudRate;
+
+	return modbus_bus_idle() && ((timebase_us() - last_rx_us) >= quiet_us);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Check in the receive interrupt and the transmit buffer with the watchdog supervisor. Called once per main
+ * loop pass: a received byte still unread from the previous pass means the interrupt no longer runs, and a
+ * transmit buffer that is neither empty nor moving means the transmitter is stuck
+ */
+/****************************************************************************************************************/
+void modbus_watchdog_checkin(void) {
+	uint32_t isr = USART1->ISR;
+
+	if (((isr & supervised_isr & USART_ISR_RXNE) == 0) && (USART1->CR1 & USART_CR1_RXNEIE)) {
+		watchdog_checkin(WATCHDOG_MODBUS_RX);
+	}
+	if ((uart1TxBufferRemaining == sizeof(uart1TxBuffer)) || (uart1TxTail != supervised_tail)) {
+		watchdog_checkin(WATCHDOG_TX_DRAIN);
+	}
 
-	return (uint16_t) temp;
+	supervised_isr = isr;
+	supervised_tail = uart1TxTail;
 }
 
 /****************************************************************************************************************/
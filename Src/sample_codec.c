@@ -0,0 +1,208 @@
+#include "sample_codec.h"
+
+#define SAMPLE_CODEC_CRC_INIT		0xFFFF
+
+static uint32_t sample_codec_zigzag(const SampleCodecChunk *chunk, uint16_t field);
+static uint16_t sample_codec_payload_word(const SampleCodecChunk *chunk, uint16_t p);
+static uint16_t sample_codec_header_word(const SampleCodecChunk *chunk, uint16_t n);
+
+/****************************************************************************************************************/
+/**
+ * @brief Prepare a chunk: find the bit width, the encoded length and the CRC. One pass over the values, one over
+ * the encoded words
+ * @param chunk
+ * @param source Returns the values to encode
+ * @param context Passed to source
+ * @param index Chunk index, sent in the header
+ * @param first Source position of the first value
+ * @param count Values in the chunk, up to SAMPLE_CODEC_CHUNK_VALUES
+ */
+/****************************************************************************************************************/
+void sample_codec_chunk_init(SampleCodecChunk *chunk, SampleCodecSource source, void *context, uint16_t index,
+		uint16_t first, uint16_t count) {
+	uint32_t max = 0;
+
+	chunk->source = source;
+	chunk->context = context;
+	chunk->index = index;
+	chunk->first = first;
+	chunk->count = (count > SAMPLE_CODEC_CHUNK_VALUES) ? SAMPLE_CODEC_CHUNK_VALUES : count;
+	chunk->width = 0;
+
+	for (uint16_t f = 0; f + 1 < chunk->count; f++) {
+		uint32_t z = sample_codec_zigzag(chunk, f);
+		if (z > max) {
+			max = z;
+		}
+	}
+	while (max >> chunk->width) {
+		chunk->width++;
+	}
+
+	chunk->words = SAMPLE_CODEC_HEADER_WORDS;
+	if (chunk->count > 1) {
+		chunk->words += (uint16_t) (((uint32_t) (chunk->count - 1) * chunk->width + 15) / 16);
+	}
+
+	uint16_t crc = SAMPLE_CODEC_CRC_INIT;
+	for (uint16_t n = 0; n < chunk->words; n++) {
+		if (n != 4) {
+			crc = sample_codec_crc(crc, sample_codec_chunk_word(chunk, n));
+		}
+	}
+	chunk->crc = crc;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Encoded word n of a chunk
+ * @return 0 past the end of the chunk
+ */
+/****************************************************************************************************************/
+uint16_t sample_codec_chunk_word(const SampleCodecChunk *chunk, uint16_t n) {
+	if (n < SAMPLE_CODEC_HEADER_WORDS) {
+		return sample_codec_header_word(chunk, n);
+	}
+	if (n >= chunk->words) {
+		return 0;
+	}
+	return sample_codec_payload_word(chunk, n - SAMPLE_CODEC_HEADER_WORDS);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Decode a chunk
+ * @param words Encoded chunk; may be longer than the chunk
+ * @param word_count
+ * @param values Decoded values
+ * @param max_values Room in values
+ * @return Number of values, or SAMPLE_CODEC_ERROR_x
+ */
+/****************************************************************************************************************/
+int sample_codec_decode(const uint16_t *words, uint16_t word_count, uint16_t *values, uint16_t max_values) {
+	if (word_count < SAMPLE_CODEC_HEADER_WORDS) {
+		return SAMPLE_CODEC_ERROR_FORMAT;
+	}
+
+	uint8_t width = (uint8_t) words[0];
+	uint16_t count = words[1];
+	if (((words[0] >> 8) != SAMPLE_CODEC_FORMAT) || (width > SAMPLE_CODEC_MAX_WIDTH)
+			|| (count > SAMPLE_CODEC_CHUNK_VALUES) || (count > max_values)) {
+		return SAMPLE_CODEC_ERROR_FORMAT;
+	}
+
+	uint16_t length = SAMPLE_CODEC_HEADER_WORDS;
+	if (count > 1) {
+		length += (uint16_t) (((uint32_t) (count - 1) * width + 15) / 16);
+	}
+	if (word_count < length) {
+		return SAMPLE_CODEC_ERROR_FORMAT;
+	}
+
+	uint16_t crc = SAMPLE_CODEC_CRC_INIT;
+	for (uint16_t n = 0; n < length; n++) {
+		if (n != 4) {
+			crc = sample_codec_crc(crc, words[n]);
+		}
+	}
+	if (crc != words[4]) {
+		return SAMPLE_CODEC_ERROR_CRC;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+	values[0] = words[3];
+	uint32_t bit = 0;
+	for (uint16_t f = 1; f < count; f++) {
+		uint32_t z = 0;
+		for (uint8_t b = 0; b < width; b++, bit++) {
+			uint16_t word = words[SAMPLE_CODEC_HEADER_WORDS + bit / 16];
+			z = (z << 1) | ((word >> (15 - bit % 16)) & 1);
+		}
+		int32_t delta = (int32_t) (z >> 1) ^ -(int32_t) (z & 1);
+		values[f] = (uint16_t) (values[f - 1] + delta);
+	}
+	return count;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Add a word, high byte first, to a CRC-16/MODBUS (reflected polynomial 0xA001, initial value 0xFFFF)
+ */
+/****************************************************************************************************************/
+uint16_t sample_codec_crc(uint16_t crc, uint16_t word) {
+	uint8_t bytes[2] = { (uint8_t) (word >> 8), (uint8_t) word };
+
+	for (int i = 0; i < 2; i++) {
+		crc ^= bytes[i];
+		for (int b = 0; b < 8; b++) {
+			crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+		}
+	}
+	return crc;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Zig-zag encoded difference between value field + 1 and value field of a chunk
+ */
+/****************************************************************************************************************/
+static uint32_t sample_codec_zigzag(const SampleCodecChunk *chunk, uint16_t field) {
+	int32_t a = chunk->source(chunk->context, chunk->first + field);
+	int32_t b = chunk->source(chunk->context, chunk->first + field + 1);
+	int32_t delta = b - a;
+
+	return ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Payload word p: the bits of the fields it overlaps, MSB first
+ */
+/****************************************************************************************************************/
+static uint16_t sample_codec_payload_word(const SampleCodecChunk *chunk, uint16_t p) {
+	uint32_t bit = (uint32_t) p * 16;
+	uint16_t word = 0;
+	uint8_t b = 0;
+
+	if (chunk->width == 0) {
+		return 0;
+	}
+	while (b < 16) {
+		uint32_t field = (bit + b) / chunk->width;
+		uint8_t offset = (bit + b) % chunk->width;							// Bits of the field already in earlier words
+		if (field + 1 >= chunk->count) {
+			break;															// Past the last field; pad with 0
+		}
+		uint8_t take = chunk->width - offset;
+		if (take > 16 - b) {
+			take = 16 - b;
+		}
+		uint32_t z = sample_codec_zigzag(chunk, (uint16_t) field);
+		uint32_t bits = (z >> (chunk->width - offset - take)) & ((1UL << take) - 1);
+		word |= (uint16_t) (bits << (16 - b - take));
+		b += take;
+	}
+	return word;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Header word n
+ */
+/****************************************************************************************************************/
+static uint16_t sample_codec_header_word(const SampleCodecChunk *chunk, uint16_t n) {
+	switch (n) {
+	case 0:
+		return (SAMPLE_CODEC_FORMAT << 8) | chunk->width;
+	case 1:
+		return chunk->count;
+	case 2:
+		return chunk->index;
+	case 3:
+		return (chunk->count > 0) ? chunk->source(chunk->context, chunk->first) : 0;
+	default:
+		return chunk->crc;
+	}
+}
@@ -0,0 +1,174 @@
+#include "scheduler.h"
+#include "rs485_modbus_rtu.h"
+#include "modbus_registers.h"
+#include "low_power.h"
+
+static SchedulerTask *task_table = NULL;
+static uint8_t task_count = 0;
+
+static uint32_t stats_tick = 0;												// Start of the statistics window
+static uint32_t stats_cycles = 0;											// DWT->CYCCNT at the start of the window, or the last clock switch
+static uint32_t stats_awake_us = 0;										// Awake time before the last clock switch in the window
+static uint32_t wakeups = 0;												// Wake-ups in the current window
+static uint16_t load_permil = 0;											// Awake time in the last window, 1/1000
+static uint16_t wakeups_per_s = 0;
+static uint16_t overruns = 0;												// Deadline overruns since boot, all tasks
+static uint8_t last_overrun_task = 0xFF;
+static uint16_t max_pass_us = 0;											// Longest pass through the tasks
+
+static void scheduler_statistics(uint32_t now);
+
+/****************************************************************************************************************/
+/**
+ * @brief Take the task table. Tasks run in table order; put the most latency sensitive first
+ * @param tasks
+ * @param count
+ */
+/****************************************************************************************************************/
+void scheduler_init(SchedulerTask *tasks, uint8_t count) {
+	uint32_t now = HAL_GetTick();
+
+	task_table = tasks;
+	task_count = count;
+	for (uint8_t i = 0; i < count; i++) {
+		tasks[i].last_tick = now;
+		tasks[i].overruns = 0;
+	}
+
+	stats_tick = now;
+	stats_cycles = DWT->CYCCNT;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief One pass of the main loop: run the due tasks, then sleep until the next interrupt unless a Modbus request
+ * is waiting
+ */
+/****************************************************************************************************************/
+void scheduler_run(void) {
+	uint32_t start = DWT->CYCCNT;
+
+	for (uint8_t i = 0; i < task_count; i++) {
+		SchedulerTask *t = &task_table[i];
+		uint32_t now = HAL_GetTick();
+		uint32_t late = now - t->last_tick;
+
+		if (late < t->period_ms) {
+			continue;
+		}
+		late -= t->period_ms;
+		if (late > t->deadline_ms) {
+			t->overruns++;
+			overruns++;
+			last_overrun_task = i;
+		}
+		t->last_tick = now;
+		t->run();
+	}
+
+	uint32_t pass_us = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000);
+	if (pass_us > max_pass_us) {
+		max_pass_us = (pass_us > 0xFFFF) ? 0xFFFF : (uint16_t) pass_us;
+	}
+	scheduler_statistics(HAL_GetTick());
+
+	uint32_t stopped_ms = 0;
+	if (low_power_idle(&stopped_ms)) {										// Slept in STOP; that time does not make tasks late
+		for (uint8_t i = 0; i < task_count; i++) {
+			task_table[i].last_tick += stopped_ms;
+		}
+		wakeups++;
+		return;
+	}
+
+	__disable_irq();														// An interrupt between the check and WFI still ends the WFI
+	if (modbus_command_available() == 0) {
+		__DSB();
+		__WFI();
+	}
+	__enable_irq();
+	wakeups++;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Awake time in the last statistics window
+ * @return 1/1000
+ */
+/****************************************************************************************************************/
+uint16_t scheduler_load_permil(void) {
+	return load_permil;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Count the cycles since the start of the window at the old core clock. Called after every SYSCLK switch
+ * @param old_hz Core clock before the switch
+ */
+/****************************************************************************************************************/
+void scheduler_clock_changed(uint32_t old_hz) {
+	uint32_t cycles = DWT->CYCCNT;
+
+	stats_awake_us += (cycles - stats_cycles) / (old_hz / 1000000);
+	stats_cycles = cycles;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a scheduler register
+ * @param reg Register address, MODBUS_REG_SCHED_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool scheduler_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_SCHED_LOAD_PERMIL:
+		*value = load_permil;
+		return true;
+
+	case MODBUS_REG_SCHED_WAKEUPS:
+		*value = wakeups_per_s;
+		return true;
+
+	case MODBUS_REG_SCHED_OVERRUNS:
+		*value = overruns;
+		return true;
+
+	case MODBUS_REG_SCHED_LAST_OVERRUN_TASK:
+		*value = last_overrun_task;
+		return true;
+
+	case MODBUS_REG_SCHED_MAX_PASS_US:
+		*value = max_pass_us;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Close the statistics window every SCHEDULER_STATS_PERIOD_MS
+ */
+/****************************************************************************************************************/
+static void scheduler_statistics(uint32_t now) {
+	uint32_t elapsed = now - stats_tick;
+
+	if (elapsed < SCHEDULER_STATS_PERIOD_MS) {
+		return;
+	}
+
+	uint32_t cycles = DWT->CYCCNT;
+	float awake_us = stats_awake_us + (float) (cycles - stats_cycles) / (SystemCoreClock / 1000000);
+	float awake = awake_us / (1000.0f * elapsed);
+	load_permil = (uint16_t) ((awake > 1.0f) ? 1000 : awake * 1000.0f);
+	wakeups_per_s = (uint16_t) ((wakeups * 1000UL) / elapsed);
+
+	stats_tick = now;
+	stats_cycles = cycles;
+	stats_awake_us = 0;
+	wakeups = 0;
+}
@@ -0,0 +1,128 @@
+#include "statistics.h"
+#include "modbus_registers.h"
+#include <math.h>
+
+static volatile StatsAccumulator acc;										// Running interval; written by acquisition
+static StatsAccumulator snapshot;											// Interval returned by the register block
+static uint32_t interval_start = 0;											// Tick the running interval started
+static uint32_t snapshot_interval_ms = 0;
+
+static int32_t stats_to_flow_milli(float voltage, bool offset);
+
+/****************************************************************************************************************/
+/**
+ * @brief Add a sample to the running interval. Called by the acquisition callbacks (interrupt context) for every
+ * published sample
+ * @param voltage Channel 3 voltage, V
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void stats_accumulate(float voltage) {
+	uint32_t n = acc.count + 1;
+
+	if (n == 1) {
+		acc.mean = voltage;
+		acc.m2 = 0;
+		acc.min = voltage;
+		acc.max = voltage;
+	} else {
+		float delta = voltage - acc.mean;
+		acc.mean += delta / n;
+		acc.m2 += delta * (voltage - acc.mean);
+		if (voltage < acc.min) acc.min = voltage;
+		if (voltage > acc.max) acc.max = voltage;
+	}
+	acc.count = n;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Snapshot the running interval and start a new one
+ */
+/****************************************************************************************************************/
+void stats_reset(void) {
+	uint32_t now = HAL_GetTick();
+
+	__disable_irq();
+	snapshot = acc;
+	acc.count = 0;
+	__enable_irq();
+
+	snapshot_interval_ms = now - interval_start;
+	interval_start = now;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a statistics register. Reading MODBUS_REG_STATS_COUNT takes the snapshot
+ * @param reg Register address, MODBUS_REG_STATS_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool stats_read_register(uint16_t reg, uint16_t *value) {
+	uint32_t v = 0;
+
+	switch (reg) {
+	case MODBUS_REG_STATS_COUNT:
+		stats_reset();
+		v = snapshot.count;
+		break;
+
+	case MODBUS_REG_STATS_COUNT + 1:
+		v = snapshot.count;
+		break;
+
+	case MODBUS_REG_STATS_INTERVAL_MS:
+	case MODBUS_REG_STATS_INTERVAL_MS + 1:
+		v = snapshot_interval_ms;
+		break;
+
+	case MODBUS_REG_STATS_MEAN_MILLI:
+	case MODBUS_REG_STATS_MEAN_MILLI + 1:
+		v = (uint32_t) stats_to_flow_milli(snapshot.mean, true);
+		break;
+
+	case MODBUS_REG_STATS_MIN_MILLI:
+	case MODBUS_REG_STATS_MIN_MILLI + 1:
+		v = (uint32_t) stats_to_flow_milli(snapshot.min, true);
+		break;
+
+	case MODBUS_REG_STATS_MAX_MILLI:
+	case MODBUS_REG_STATS_MAX_MILLI + 1:
+		v = (uint32_t) stats_to_flow_milli(snapshot.max, true);
+		break;
+
+	case MODBUS_REG_STATS_STDDEV_MILLI:
+	case MODBUS_REG_STATS_STDDEV_MILLI + 1:
+		v = (uint32_t) stats_to_flow_milli((snapshot.count > 1) ? sqrtf(snapshot.m2 / (snapshot.count - 1)) : 0, false);
+		break;
+
+	default:
+		return false;
+	}
+
+	// 32-bit values: high word in the first register
+	*value = ((reg - MODBUS_REG_STATS_BASE) & 1) ? (uint16_t) v : (uint16_t) (v >> 16);
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert a voltage, or a voltage difference, to flow with the current calibration
+ * @param voltage
+ * @param offset true for an absolute voltage, false for a difference (standard deviation)
+ * @return Flow * 1000; INT32_MIN if there is no calibration or no sample
+ */
+/****************************************************************************************************************/
+static int32_t stats_to_flow_milli(float voltage, bool offset) {
+	float zero = 0;
+	float span = 0;
+
+	if ((snapshot.count == 0) || (get_flow_scale(&zero, &span) == false)) {
+		return INT32_MIN;
+	}
+	if (offset == false) {
+		zero = 0;
+	}
+	return (int32_t) roundf((voltage - zero) / span * 1000.0f);
+}
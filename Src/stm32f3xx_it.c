@@ -23,6 +23,9 @@
 #include "stm32f3xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "acquisition.h"
+#include "fault_record.h"
+#include "isr_timing.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -80,57 +83,41 @@ void NMI_Handler(void)
 /**
   * @brief This function handles Hard fault interrupt.
   */
-void HardFault_Handler(void)
+__attribute__((naked)) void HardFault_Handler(void)
 {
   /* USER CODE BEGIN HardFault_IRQn 0 */
+  FAULT_RECORD_ENTRY(FAULT_TYPE_HARD);									// Save the crash record and reset
   /* USER CODE END HardFault_IRQn 0 */
-  while (1)
-  {
-    /* USER CODE BEGIN W1_HardFault_IRQn 0 */
-    /* USER CODE END W1_HardFault_IRQn 0 */
-  }
 }
 
 /**
   * @brief This function handles Memory management fault.
   */
-void MemManage_Handler(void)
+__attribute__((naked)) void MemManage_Handler(void)
 {
   /* USER CODE BEGIN MemoryManagement_IRQn 0 */
+  FAULT_RECORD_ENTRY(FAULT_TYPE_MEMMANAGE);									// Save the crash record and reset
   /* USER CODE END MemoryManagement_IRQn 0 */
-  while (1)
-  {
-    /* USER CODE BEGIN W1_MemoryManagement_IRQn 0 */
-    /* USER CODE END W1_MemoryManagement_IRQn 0 */
-  }
 }
 
 /**
   * @brief This function handles Pre-fetch fault, memory access fault.
   */
-void BusFault_Handler(void)
+__attribute__((naked)) void BusFault_Handler(void)
 {
   /* USER CODE BEGIN BusFault_IRQn 0 */
+  FAULT_RECORD_ENTRY(FAULT_TYPE_BUS);									// Save the crash record and reset
   /* USER CODE END BusFault_IRQn 0 */
-  while (1)
-  {
-    /* USER CODE BEGIN W1_BusFault_IRQn 0 */
-    /* USER CODE END W1_BusFault_IRQn 0 */
-  }
 }
 
 /**
   * @brief This function handles Undefined instruction or illegal state.
   */
-void UsageFault_Handler(void)
+__attribute__((naked)) void UsageFault_Handler(void)
 {
   /* USER CODE BEGIN UsageFault_IRQn 0 */
+  FAULT_RECORD_ENTRY(FAULT_TYPE_USAGE);									// Save the crash record and reset
   /* USER CODE END UsageFault_IRQn 0 */
-  while (1)
-  {
-    /* USER CODE BEGIN W1_UsageFault_IRQn 0 */
-    /* USER CODE END W1_UsageFault_IRQn 0 */
-  }
 }
 
 /**
@@ -172,9 +159,10 @@ void PendSV_Handler(void)
 /**
   * @brief This function handles System tick timer.
   */
-void SysTick_Handler(void)
+CCMRAM_FUNC void SysTick_Handler(void)
 {
   /* USER CODE BEGIN SysTick_IRQn 0 */
+  isr_timing_record(ISR_TIMING_TICK_LATENCY, SysTick->LOAD - SysTick->VAL);	// Cycles since the counter reloaded
 
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
@@ -193,13 +181,15 @@ void SysTick_Handler(void)
 /**
   * @brief This function handles DMA1 channel2 global interrupt.
   */
-void DMA1_Channel2_IRQHandler(void)
+CCMRAM_FUNC void DMA1_Channel2_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Channel2_IRQn 0 */
+  uint32_t isr_start = DWT->CYCCNT;
 
   /* USER CODE END DMA1_Channel2_IRQn 0 */
-  HAL_DMA_IRQHandler(&hdma_adc2);
+  acquisition_dma_irq_handler();
   /* USER CODE BEGIN DMA1_Channel2_IRQn 1 */
+  isr_timing_record(ISR_TIMING_DMA_ADC2, DWT->CYCCNT - isr_start);
 
   /* USER CODE END DMA1_Channel2_IRQn 1 */
 }
@@ -208,13 +198,21 @@ void DMA1_Channel2_IRQHandler(void)
 /**
   * @brief This function handles ADC1 and ADC2 interrupts.
   */
-void ADC1_2_IRQHandler(void)
+CCMRAM_FUNC void ADC1_2_IRQHandler(void)
 {
   /* USER CODE BEGIN ADC1_2_IRQn 0 */
+  uint32_t isr_start = DWT->CYCCNT;
 
   /* USER CODE END ADC1_2_IRQn 0 */
-  HAL_ADC_IRQHandler(&hadc2);
+  if ((ADC2->ISR & ADC_ISR_AWD1) && (ADC2->IER & ADC_IER_AWD1)) {	// Analog watchdog 1 is the only ADC2 interrupt used
+    HAL_ADC_LevelOutOfWindowCallback(&hadc2);
+    ADC2->ISR = ADC_ISR_AWD1;
+  }
+  if ((ADC2->ISR & ADC_ISR_OVR) && (ADC2->IER & ADC_IER_OVR)) {		// Disabled after the DMA start; clear it should it fire anyway
+    ADC2->ISR = ADC_ISR_OVR;
+  }
   /* USER CODE BEGIN ADC1_2_IRQn 1 */
+  isr_timing_record(ISR_TIMING_ADC, DWT->CYCCNT - isr_start);
 
   /* USER CODE END ADC1_2_IRQn 1 */
 }
@@ -0,0 +1,185 @@
+#include "temperature.h"
+#include "acquisition.h"
+#include "config_store.h"
+#include "modbus_registers.h"
+
+#define TS_CAL1_ADDR ((uint16_t*)((uint32_t)0x1FFFF7B8))					// Sensor ADC value at 30 degC, VDDA = 3.3V. See datasheet
+#define TS_CAL2_ADDR ((uint16_t*)((uint32_t)0x1FFFF7C2))					// Sensor ADC value at 110 degC, VDDA = 3.3V
+#define TS_CAL1_TEMPERATURE		30.0f
+#define TS_CAL2_TEMPERATURE		110.0f
+
+extern ADC_HandleTypeDef hadc1;
+
+static float temperature = 25.0f;											// Filtered MCU temperature, degC
+static float cal_temperature = 25.0f;										// Temperature when the sensor was calibrated, degC
+static int32_t tempco_zero_uv = 0;											// Zero temperature coefficient, uV/degC
+static int32_t tempco_span_ppm = 0;											// Span temperature coefficient, ppm/degC
+static uint32_t last_tick = 0;
+static bool conversion_pending = false;
+
+static float temperature_convert(uint32_t raw);
+
+/****************************************************************************************************************/
+/**
+ * @brief Load compensation coefficients and take a first temperature reading (blocking, ~10us), so the calibration
+ * at boot has a temperature. ADC1 must be initialized (MX_ADC1_Init)
+ */
+/****************************************************************************************************************/
+void temperature_init(void) {
+	uint32_t temp = 0;
+
+	if (config_get(CONFIG_KEY_TEMPCO_ZERO, &temp)) {
+		tempco_zero_uv = (int32_t) temp;
+	}
+	if (config_get(CONFIG_KEY_TEMPCO_SPAN, &temp)) {
+		tempco_span_ppm = (int32_t) temp;
+	}
+
+	if (HAL_ADC_Start(&hadc1) == HAL_OK) {
+		if (HAL_ADC_PollForConversion(&hadc1, 1) == HAL_OK) {
+			temperature = temperature_convert(HAL_ADC_GetValue(&hadc1));
+		}
+	}
+
+	if (config_get_float(CONFIG_KEY_CAL_TEMPERATURE, &cal_temperature) == false) {
+		cal_temperature = temperature;
+	}
+
+	last_tick = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Temperature acquisition, called from the main loop. Reads the conversion started in the previous period
+ * and starts the next one, so it never waits for ADC1
+ */
+/****************************************************************************************************************/
+void temperature_task(void) {
+	uint32_t now = HAL_GetTick();
+
+	if ((now - last_tick) < TEMPERATURE_PERIOD_MS) {
+		return;
+	}
+	last_tick = now;
+
+	if (conversion_pending && __HAL_ADC_GET_FLAG(&hadc1, ADC_FLAG_EOC)) {
+		float t = temperature_convert(HAL_ADC_GetValue(&hadc1));
+		temperature += (t - temperature) / (1 << TEMPERATURE_FILTER_SHIFT);
+	}
+
+	conversion_pending = (HAL_ADC_Start(&hadc1) == HAL_OK);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Filtered MCU temperature, degC
+ */
+/****************************************************************************************************************/
+float temperature_get(void) {
+	return temperature;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Store the current temperature as the reference for compensation. Called when the sensor is calibrated
+ */
+/****************************************************************************************************************/
+void temperature_set_calibration_point(void) {
+	cal_temperature = temperature;
+	config_set_float(CONFIG_KEY_CAL_TEMPERATURE, cal_temperature);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Zero shift at the current temperature
+ * @return Voltage to add to the calibrated zero offset, V
+ */
+/****************************************************************************************************************/
+float temperature_zero_shift(void) {
+	return tempco_zero_uv * 0.000001f * (temperature - cal_temperature);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Span factor at the current temperature
+ * @return Factor to multiply the calibrated step per liter with
+ */
+/****************************************************************************************************************/
+float temperature_span_factor(void) {
+	return 1.0f + tempco_span_ppm * 0.000001f * (temperature - cal_temperature);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a temperature register
+ * @param reg Register address, MODBUS_REG_TEMPERATURE_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool temperature_read_register(uint16_t reg, uint16_t *value) {
+
+	switch (reg) {
+	case MODBUS_REG_TEMPERATURE:
+		*value = (uint16_t) (int16_t) (temperature * 100.0f);
+		return true;
+
+	case MODBUS_REG_TEMPERATURE_CAL:
+		*value = (uint16_t) (int16_t) (cal_temperature * 100.0f);
+		return true;
+
+	case MODBUS_REG_TEMPERATURE_TEMPCO_ZERO:
+		*value = (uint16_t) (int16_t) tempco_zero_uv;
+		return true;
+
+	case MODBUS_REG_TEMPERATURE_TEMPCO_SPAN:
+		*value = (uint16_t) (int16_t) tempco_span_ppm;
+		return true;
+
+	case MODBUS_REG_TEMPERATURE_ZERO_SHIFT_UV:
+		*value = (uint16_t) (int16_t) (temperature_zero_shift() * 1000000.0f);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a temperature compensation coefficient. Coefficients are kept in the configuration store
+ * @param reg Register address, MODBUS_REG_TEMPERATURE_x
+ * @param value
+ * @return false if the register does not exist or is read-only
+ */
+/****************************************************************************************************************/
+bool temperature_write_register(uint16_t reg, uint16_t value) {
+
+	switch (reg) {
+	case MODBUS_REG_TEMPERATURE_TEMPCO_ZERO:
+		tempco_zero_uv = (int16_t) value;
+		return config_set(CONFIG_KEY_TEMPCO_ZERO, (uint32_t) tempco_zero_uv);
+
+	case MODBUS_REG_TEMPERATURE_TEMPCO_SPAN:
+		tempco_span_ppm = (int16_t) value;
+		return config_set(CONFIG_KEY_TEMPCO_SPAN, (uint32_t) tempco_span_ppm);
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert a temperature sensor reading to degC using the factory calibration points. The reading is
+ * scaled to VDDA = 3.3V, the condition the calibration values were taken at
+ */
+/****************************************************************************************************************/
+static float temperature_convert(uint32_t raw) {
+	float vdd = acquisition_get_vdd();
+	float ts = (vdd > 0) ? (raw * vdd / 3.3f) : (float) raw;
+	float cal1 = *TS_CAL1_ADDR;
+	float cal2 = *TS_CAL2_ADDR;
+
+	return (TS_CAL2_TEMPERATURE - TS_CAL1_TEMPERATURE) / (cal2 - cal1) * (ts - cal1) + TS_CAL1_TEMPERATURE;
+}
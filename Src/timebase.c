@@ -0,0 +1,78 @@
+#include "timebase.h"
+
+static uint32_t timebase_prescaler(void);
+
+/****************************************************************************************************************/
+/**
+ * @brief Start TIM2 counting microseconds from 0
+ */
+/****************************************************************************************************************/
+void timebase_init(void) {
+	__HAL_RCC_TIM2_CLK_ENABLE();
+
+	TIM2->CR1 = 0;
+	TIM2->PSC = timebase_prescaler();
+	TIM2->ARR = 0xFFFFFFFFUL;
+	TIM2->CNT = 0;
+	TIM2->EGR = TIM_EGR_UG;													// Load the prescaler
+	TIM2->SR = 0;
+	TIM2->CR1 = TIM_CR1_CEN;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Current time
+ * @return Microseconds since timebase_init(), modulo 2^32
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC uint32_t timebase_us(void) {
+	return TIM2->CNT;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Set the prescaler for the new PCLK1 after SystemCoreClock has been updated. The update event that loads
+ * the prescaler clears the counter, so the count is written back
+ */
+/****************************************************************************************************************/
+void timebase_clock_changed(void) {
+	uint32_t prescaler = timebase_prescaler();
+
+	__disable_irq();
+	uint32_t count = TIM2->CNT;
+	TIM2->PSC = prescaler;
+	TIM2->EGR = TIM_EGR_UG;
+	TIM2->CNT = count;
+	__enable_irq();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Account for the time in STOP mode, when TIM2 did not count. Only moves the counter forward, as it ran for
+ * part of the measured time
+ * @param start_us timebase_us() before STOP
+ * @param stopped_us Time since then measured with the RTC
+ */
+/****************************************************************************************************************/
+void timebase_stopped(uint32_t start_us, uint32_t stopped_us) {
+	__disable_irq();
+	uint32_t counted = TIM2->CNT - start_us;
+	if (stopped_us > counted) {
+		TIM2->CNT += stopped_us - counted;
+	}
+	__enable_irq();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief TIM2 prescaler for 1 MHz at the current clock
+ */
+/****************************************************************************************************************/
+static uint32_t timebase_prescaler(void) {
+	uint32_t hz = HAL_RCC_GetPCLK1Freq();
+
+	if ((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_CFGR_PPRE1_DIV1) {				// Timer clock is twice PCLK1
+		hz *= 2;
+	}
+	return hz / 1000000 - 1;
+}
@@ -0,0 +1,201 @@
+#include "trend.h"
+#include "flow_log.h"
+#include "modbus_registers.h"
+#include <math.h>
+
+static volatile float acc_sum = 0;											// Samples of the current second, V; written by acquisition
+static volatile float acc_min = 0;
+static volatile float acc_max = 0;
+static volatile uint32_t acc_count = 0;
+
+static TrendEntry seconds[TREND_SECONDS_SIZE];
+static TrendEntry minutes[TREND_MINUTES_SIZE];
+static TrendEntry hours[TREND_HOURS_SIZE];
+static TrendRing rings[TREND_LEVEL_COUNT] = {
+		{ seconds, TREND_SECONDS_SIZE, 0, 0, 0 },
+		{ minutes, TREND_MINUTES_SIZE, 0, 0, 0 },
+		{ hours, TREND_HOURS_SIZE, 0, 0, 0 },
+};
+static TrendAccumulator levels[TREND_LEVEL_COUNT];							// Input of each level above the first
+static uint32_t last_tick = 0;
+
+_Static_assert(sizeof(seconds) + sizeof(minutes) + sizeof(hours) + sizeof(rings) + sizeof(levels) <= TREND_RAM_BUDGET,
+		"trend rings exceed TREND_RAM_BUDGET");
+
+static void trend_push(uint8_t level, TrendEntry entry);
+static int32_t trend_to_flow_milli(float voltage, float zero, float span);
+
+/****************************************************************************************************************/
+/**
+ * @brief Start the first period
+ */
+/****************************************************************************************************************/
+void trend_init(void) {
+	last_tick = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Add a sample to the current second. Called by the acquisition callbacks (interrupt context) for every
+ * published sample
+ * @param voltage Channel 3 voltage, V
+ */
+/****************************************************************************************************************/
+CCMRAM_FUNC void trend_accumulate(float voltage) {
+	if (acc_count == 0) {
+		acc_min = voltage;
+		acc_max = voltage;
+	} else {
+		if (voltage < acc_min) acc_min = voltage;
+		if (voltage > acc_max) acc_max = voltage;
+	}
+	acc_sum += voltage;
+	acc_count++;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Trend update, called from the main loop. Every TREND_PERIOD_MS the samples of the last second are converted
+ * to flow with the current calibration and pushed into the pyramid
+ */
+/****************************************************************************************************************/
+void trend_task(void) {
+	TrendEntry entry = { TREND_INVALID, TREND_INVALID, TREND_INVALID };
+	float zero = 0;
+	float span = 0;
+
+	if ((HAL_GetTick() - last_tick) < TREND_PERIOD_MS) {
+		return;
+	}
+	last_tick += TREND_PERIOD_MS;											// Keeps the period exact; a stall is caught up one entry per call
+
+	__disable_irq();														// Take the samples of the last second
+	float sum = acc_sum;
+	float min = acc_min;
+	float max = acc_max;
+	uint32_t count = acc_count;
+	acc_sum = 0;
+	acc_count = 0;
+	__enable_irq();
+
+	if ((count > 0) && get_flow_scale(&zero, &span)) {
+		entry.min = trend_to_flow_milli(min, zero, span);
+		entry.max = trend_to_flow_milli(max, zero, span);
+		entry.mean = trend_to_flow_milli(sum / count, zero, span);
+	}
+
+	trend_push(TREND_LEVEL_SECONDS, entry);
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a trend register
+ * @param reg Register address, MODBUS_REG_TREND_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool trend_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_TREND_ENTRIES_BASE) && (reg < MODBUS_REG_TREND_ENTRIES_END)) {
+		const TrendRing *ring = &rings[(reg - MODBUS_REG_TREND_ENTRIES_BASE) / MODBUS_REG_TREND_LEVEL_STRIDE];
+		uint16_t offset = (reg - MODBUS_REG_TREND_ENTRIES_BASE) % MODBUS_REG_TREND_LEVEL_STRIDE;
+		uint16_t n = offset / MODBUS_REG_TREND_ENTRY_SIZE;					// Entry number, 0 is the newest
+		uint32_t v = (uint32_t) TREND_INVALID;
+
+		if (n >= ring->size) {
+			return false;
+		}
+		if (n < ring->count) {
+			const TrendEntry *e = &ring->entries[(ring->head + ring->size - 1 - n) % ring->size];
+			switch ((offset % MODBUS_REG_TREND_ENTRY_SIZE) / 2) {
+			case 0:
+				v = (uint32_t) e->min;
+				break;
+			case 1:
+				v = (uint32_t) e->max;
+				break;
+			default:
+				v = (uint32_t) e->mean;
+				break;
+			}
+		}
+		*value = (offset & 1) ? (uint16_t) v : (uint16_t) (v >> 16);	// High word first
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_TREND_COUNT_SECONDS:
+	case MODBUS_REG_TREND_COUNT_MINUTES:
+	case MODBUS_REG_TREND_COUNT_HOURS:
+		*value = rings[reg - MODBUS_REG_TREND_COUNT_SECONDS].count;
+		return true;
+
+	case MODBUS_REG_TREND_SEQUENCE_SECONDS:
+	case MODBUS_REG_TREND_SEQUENCE_MINUTES:
+	case MODBUS_REG_TREND_SEQUENCE_HOURS:
+		*value = rings[reg - MODBUS_REG_TREND_SEQUENCE_SECONDS].sequence;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Store an entry in a level and add it to the input of the next level. Every TREND_RATIO entries the next
+ * level gets an entry of its own
+ * @param level TREND_LEVEL_x
+ * @param entry
+ */
+/****************************************************************************************************************/
+static void trend_push(uint8_t level, TrendEntry entry) {
+	TrendRing *ring = &rings[level];
+
+	ring->entries[ring->head] = entry;
+	ring->head = (ring->head + 1) % ring->size;
+	if (ring->count < ring->size) {
+		ring->count++;
+	}
+	ring->sequence++;
+
+	if (level == TREND_LEVEL_MINUTES) {
+		flow_log_append(FLOW_LOG_TYPE_MINUTE, entry.min, entry.max, entry.mean);
+	}
+
+	if (level + 1 >= TREND_LEVEL_COUNT) {
+		return;
+	}
+
+	TrendAccumulator *next = &levels[level + 1];
+	if (entry.mean != TREND_INVALID) {
+		if ((next->valid == 0) || (entry.min < next->min)) next->min = entry.min;
+		if ((next->valid == 0) || (entry.max > next->max)) next->max = entry.max;
+		next->sum += entry.mean;
+		next->valid++;
+	}
+	next->entries++;
+
+	if (next->entries >= TREND_RATIO) {
+		TrendEntry combined = { TREND_INVALID, TREND_INVALID, TREND_INVALID };
+		if (next->valid > 0) {
+			combined.min = next->min;
+			combined.max = next->max;
+			combined.mean = (int32_t) (next->sum / next->valid);
+		}
+		next->sum = 0;
+		next->valid = 0;
+		next->entries = 0;
+		trend_push(level + 1, combined);
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Convert a voltage to flow * 1000
+ */
+/****************************************************************************************************************/
+static int32_t trend_to_flow_milli(float voltage, float zero, float span) {
+	return (int32_t) roundf((voltage - zero) / span * 1000.0f);
+}
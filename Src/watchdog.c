@@ -0,0 +1,172 @@
+#include "watchdog.h"
+#include "modbus_registers.h"
+
+_Static_assert(MODBUS_REG_WDG_CHECKIN_AGE + WATCHDOG_TASK_COUNT <= MODBUS_REG_WDG_DEADLINE, "Watchdog registers overlap");
+_Static_assert(MODBUS_REG_WDG_DEADLINE + WATCHDOG_TASK_COUNT <= MODBUS_REG_WDG_END, "Watchdog registers overlap");
+
+extern IWDG_HandleTypeDef hiwdg;
+
+// Kept over a reset
+typedef struct WatchdogRecord {
+	uint32_t	magic;
+	uint32_t	missed_task;												// WATCHDOG_x, WATCHDOG_NONE
+	uint32_t	missed_count;												// Resets by a missed deadline since power-on
+	uint32_t	check;
+}WatchdogRecord;
+
+static WatchdogRecord record __attribute__((section(".noinit")));
+
+static volatile uint32_t checkin_tick[WATCHDOG_TASK_COUNT];					// Written by interrupts and the main loop
+static uint32_t deadlines[WATCHDOG_TASK_COUNT] = {
+	WATCHDOG_ACQUISITION_MS, WATCHDOG_MODBUS_RX_MS, WATCHDOG_TX_DRAIN_MS, WATCHDOG_FLASH_WRITER_MS,
+};
+static uint32_t reset_cause = 0;											// RCC_CSR reset flags at boot
+static bool expired = false;												// A deadline was missed; the IWDG is not fed
+
+static void watchdog_seal(void);
+
+/****************************************************************************************************************/
+/**
+ * @brief Read and clear the reset flags and check the record of the previous run. Call right after
+ * MX_IWDG_Init(); all deadlines start now
+ */
+/****************************************************************************************************************/
+void watchdog_init(void) {
+	reset_cause = RCC->CSR >> 24;
+	RCC->CSR |= RCC_CSR_RMVF;
+
+	if ((record.magic != WATCHDOG_MAGIC)
+			|| (record.check != ~(record.magic + record.missed_task + record.missed_count))) {
+		record.missed_task = WATCHDOG_NONE;									// Power-on: random contents
+		record.missed_count = 0;
+		watchdog_seal();
+	}
+
+	uint32_t now = HAL_GetTick();
+	for (uint8_t i = 0; i < WATCHDOG_TASK_COUNT; i++) {
+		checkin_tick[i] = now;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Refresh the IWDG if every task checked in within its deadline. Called at the end of every main loop pass
+ */
+/****************************************************************************************************************/
+void watchdog_task(void) {
+	uint32_t now = HAL_GetTick();
+
+	for (uint8_t i = 0; (i < WATCHDOG_TASK_COUNT) && (expired == false); i++) {
+		if ((now - checkin_tick[i]) > deadlines[i]) {
+			expired = true;
+			record.missed_task = i;
+			record.missed_count++;
+			watchdog_seal();
+		}
+	}
+
+	if (expired == false) {
+		HAL_IWDG_Refresh(&hiwdg);
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Report progress of a task; also from interrupts
+ * @param task WATCHDOG_x
+ */
+/****************************************************************************************************************/
+void watchdog_checkin(uint8_t task) {
+	checkin_tick[task] = HAL_GetTick();
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Change the deadline of a task, e.g. with the acquisition sample timeout
+ * @param task WATCHDOG_x
+ * @param deadline_ms
+ */
+/****************************************************************************************************************/
+void watchdog_set_deadline(uint8_t task, uint32_t deadline_ms) {
+	checkin_tick[task] = HAL_GetTick();										// Measure the new deadline from now
+	deadlines[task] = deadline_ms;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Reset flags read at boot
+ * @return RCC_CSR bits 31..24
+ */
+/****************************************************************************************************************/
+uint32_t watchdog_reset_cause(void) {
+	return reset_cause;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Read a watchdog register
+ * @param reg Register address, MODBUS_REG_WDG_x
+ * @param value
+ * @return false if the register does not exist
+ */
+/****************************************************************************************************************/
+bool watchdog_read_register(uint16_t reg, uint16_t *value) {
+
+	if ((reg >= MODBUS_REG_WDG_CHECKIN_AGE) && (reg < MODBUS_REG_WDG_CHECKIN_AGE + WATCHDOG_TASK_COUNT)) {
+		uint32_t age = HAL_GetTick() - checkin_tick[reg - MODBUS_REG_WDG_CHECKIN_AGE];
+		*value = (age > 0xFFFF) ? 0xFFFF : (uint16_t) age;
+		return true;
+	}
+
+	if ((reg >= MODBUS_REG_WDG_DEADLINE) && (reg < MODBUS_REG_WDG_DEADLINE + WATCHDOG_TASK_COUNT)) {
+		uint32_t deadline = deadlines[reg - MODBUS_REG_WDG_DEADLINE];
+		*value = (deadline > 0xFFFF) ? 0xFFFF : (uint16_t) deadline;
+		return true;
+	}
+
+	switch (reg) {
+	case MODBUS_REG_WDG_RESET_CAUSE:
+		*value = (uint16_t) reset_cause;
+		return true;
+
+	case MODBUS_REG_WDG_MISSED_TASK:
+		*value = (uint16_t) record.missed_task;
+		return true;
+
+	case MODBUS_REG_WDG_MISSED_COUNT:
+		*value = (uint16_t) record.missed_count;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Write a watchdog register: WATCHDOG_NONE to the missed task clears it
+ * @param reg Register address, MODBUS_REG_WDG_x
+ * @param value
+ * @return false if the register does not exist, is read-only or the value is out of range
+ */
+/****************************************************************************************************************/
+bool watchdog_write_register(uint16_t reg, uint16_t value) {
+
+	if ((reg != MODBUS_REG_WDG_MISSED_TASK) || (value != WATCHDOG_NONE)) {
+		return false;
+	}
+
+	record.missed_task = WATCHDOG_NONE;
+	watchdog_seal();
+	return true;
+}
+
+/****************************************************************************************************************/
+/**
+ * @brief Update the check word of the record
+ */
+/****************************************************************************************************************/
+static void watchdog_seal(void) {
+	record.magic = WATCHDOG_MAGIC;
+	record.check = ~(record.magic + record.missed_task + record.missed_count);
+}
@@ -0,0 +1,61 @@
+/*
+ * Host decoder for compressed capture chunks (see Inc/sample_codec.h).
+ *
+ * Input: one chunk per line, the registers as read from MODBUS_REG_CAPTURE_PACKED_BASE + chunk * stride, decimal or
+ * 0x hex, separated by spaces or commas. Reading more registers than the chunk needs is fine.
+ * Output: the decoded values, one per line. Chunks with a bad CRC are reported on stderr and skipped.
+ *
+ * Build: gcc -O2 -I../../Inc -o capture_decode capture_decode.c ../../Src/sample_codec.c
+ * Usage: capture_decode [file]
+ */
+#include "sample_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_LENGTH		4096
+
+int main(int argc, char *argv[]) {
+	FILE *in = stdin;
+	char line[LINE_LENGTH];
+	int errors = 0;
+	int chunks = 0;
+
+	if (argc > 1) {
+		in = fopen(argv[1], "r");
+		if (in == NULL) {
+			perror(argv[1]);
+			return 2;
+		}
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		uint16_t words[SAMPLE_CODEC_MAX_WORDS];
+		uint16_t values[SAMPLE_CODEC_CHUNK_VALUES];
+		uint16_t count = 0;
+
+		for (char *t = strtok(line, " ,;\t\r\n"); (t != NULL) && (count < SAMPLE_CODEC_MAX_WORDS); t = strtok(NULL, " ,;\t\r\n")) {
+			words[count++] = (uint16_t) strtoul(t, NULL, 0);
+		}
+		if (count == 0) {
+			continue;
+		}
+
+		int n = sample_codec_decode(words, count, values, SAMPLE_CODEC_CHUNK_VALUES);
+		chunks++;
+		if (n < 0) {
+			fprintf(stderr, "chunk %d (index %u): %s\n", chunks, (count > 2) ? words[2] : 0,
+					(n == SAMPLE_CODEC_ERROR_CRC) ? "CRC error" : "bad format or truncated");
+			errors++;
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			printf("%u\n", values[i]);
+		}
+	}
+
+	if (in != stdin) {
+		fclose(in);
+	}
+	return (errors > 0) ? 1 : 0;
+}
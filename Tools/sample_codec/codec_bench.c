@@ -0,0 +1,98 @@
+/*
+ * Compression benchmark for the capture codec (see Inc/sample_codec.h) on recorded traces.
+ *
+ * Input: trace files with one value per line, e.g. a capture downloaded from MODBUS_REG_CAPTURE_DATA_BASE. Every
+ * trace is encoded chunk by chunk exactly as the device does, decoded again and compared. The report compares the
+ * registers and the bus time of a raw and a compressed download at the given baud rate (8 data bits, 2 stop bits).
+ *
+ * Build: gcc -O2 -I../../Inc -o codec_bench codec_bench.c ../../Src/sample_codec.c
+ * Usage: codec_bench [-b baud] trace...
+ */
+#include "sample_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_VALUES				65536
+#define MODBUS_MAX_READ			125										// Registers per read request
+#define MODBUS_REQUEST_BYTES	8
+#define MODBUS_RESPONSE_BYTES	5										// Address, function, byte count, CRC
+#define BITS_PER_BYTE			11										// Start, 8 data, 2 stop
+
+static uint16_t trace[MAX_VALUES];
+
+static uint16_t trace_source(void *context, uint16_t n) {
+	return ((const uint16_t *) context)[n];
+}
+
+static double bus_seconds(unsigned long requests, unsigned long registers, unsigned long baud) {
+	unsigned long bytes = requests * (MODBUS_REQUEST_BYTES + MODBUS_RESPONSE_BYTES) + 2 * registers;
+	return (double) bytes * BITS_PER_BYTE / baud;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long baud = 9600;
+	int failures = 0;
+	int arg = 1;
+
+	if ((argc > 2) && (strcmp(argv[1], "-b") == 0)) {
+		baud = strtoul(argv[2], NULL, 0);
+		arg = 3;
+	}
+	if ((arg >= argc) || (baud == 0)) {
+		fprintf(stderr, "usage: %s [-b baud] trace...\n", argv[0]);
+		return 2;
+	}
+
+	printf("%-24s %7s %7s %7s %6s %6s %9s %9s\n", "trace", "values", "raw", "packed", "ratio", "width", "raw s", "packed s");
+
+	for (; arg < argc; arg++) {
+		FILE *in = fopen(argv[arg], "r");
+		unsigned long count = 0;
+		char line[64];
+
+		if (in == NULL) {
+			perror(argv[arg]);
+			failures++;
+			continue;
+		}
+		while ((fgets(line, sizeof(line), in) != NULL) && (count < MAX_VALUES)) {
+			char *end;
+			unsigned long v = strtoul(line, &end, 0);
+			if (end != line) {
+				trace[count++] = (uint16_t) v;
+			}
+		}
+		fclose(in);
+
+		unsigned long packed = 0;
+		unsigned long chunks = 0;
+		unsigned long width_sum = 0;
+		for (unsigned long first = 0; first < count; first += SAMPLE_CODEC_CHUNK_VALUES) {
+			SampleCodecChunk chunk;
+			uint16_t words[SAMPLE_CODEC_MAX_WORDS];
+			uint16_t values[SAMPLE_CODEC_CHUNK_VALUES];
+			uint16_t n = (count - first < SAMPLE_CODEC_CHUNK_VALUES) ? (uint16_t) (count - first) : SAMPLE_CODEC_CHUNK_VALUES;
+
+			sample_codec_chunk_init(&chunk, trace_source, &trace[first], (uint16_t) chunks, 0, n);
+			for (uint16_t w = 0; w < chunk.words; w++) {
+				words[w] = sample_codec_chunk_word(&chunk, w);
+			}
+			if ((sample_codec_decode(words, chunk.words, values, SAMPLE_CODEC_CHUNK_VALUES) != n)
+					|| (memcmp(values, &trace[first], n * sizeof(uint16_t)) != 0)) {
+				fprintf(stderr, "%s: chunk %lu does not decode to the original values\n", argv[arg], chunks);
+				failures++;
+			}
+			packed += chunk.words;
+			width_sum += chunk.width;
+			chunks++;
+		}
+
+		unsigned long raw_requests = (count + MODBUS_MAX_READ - 1) / MODBUS_MAX_READ;
+		printf("%-24s %7lu %7lu %7lu %6.2f %6.2f %9.2f %9.2f\n", argv[arg], count, count, packed,
+				(packed > 0) ? (double) count / packed : 0.0, (chunks > 0) ? (double) width_sum / chunks : 0.0,
+				bus_seconds(raw_requests, count, baud), bus_seconds(chunks, packed, baud));
+	}
+
+	return (failures > 0) ? 1 : 0;
+}
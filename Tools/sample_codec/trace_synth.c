@@ -0,0 +1,57 @@
+/*
+ * Synthetic capture trace for codec_bench, until recorded captures are available.
+ *
+ * Output: CAPTURE_SIZE values, one per line, shaped like a triggered capture of a flow step: 12-bit ADC codes at
+ * a steady level, a first order step at the trigger position and uniform noise of +-noise LSB. The noise comes from
+ * a fixed linear congruential generator, so the same arguments always give the same trace.
+ *
+ * Build: gcc -O2 -o trace_synth trace_synth.c
+ * Usage: trace_synth [noise [from [to [tau]]]]
+ *   noise  peak noise, LSB (default 2)
+ *   from   level before the step, ADC code (default 1200)
+ *   to     level after the step, ADC code (default 2800)
+ *   tau    time constant of the step, values (default 40; 0 for a sharp edge)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define CAPTURE_SIZE			1024									// Same as Inc/capture.h
+#define TRIGGER_POSITION		300										// Pre-trigger values, not on a chunk boundary
+#define ADC_FULL_SCALE			4095
+
+static uint32_t seed = 1;
+
+static long noise_lsb(long peak) {
+	seed = seed * 1103515245U + 12345U;								// Wraps at 32 bits on every host
+	return (long) ((seed >> 16) % (2 * peak + 1)) - peak;
+}
+
+int main(int argc, char *argv[]) {
+	long noise = (argc > 1) ? strtol(argv[1], NULL, 0) : 2;
+	double from = (argc > 2) ? strtod(argv[2], NULL) : 1200.0;
+	double to = (argc > 3) ? strtod(argv[3], NULL) : 2800.0;
+	double tau = (argc > 4) ? strtod(argv[4], NULL) : 40.0;
+
+	if (noise < 0) {
+		fprintf(stderr, "usage: %s [noise [from [to [tau]]]]\n", argv[0]);
+		return 2;
+	}
+
+	for (int n = 0; n < CAPTURE_SIZE; n++) {
+		double level = from;
+		if (n >= TRIGGER_POSITION) {
+			level = (tau > 0.0) ? to + (from - to) * exp(-(n - TRIGGER_POSITION) / tau) : to;
+		}
+		long code = lround(level) + noise_lsb(noise);
+		if (code < 0) {
+			code = 0;
+		} else if (code > ADC_FULL_SCALE) {
+			code = ADC_FULL_SCALE;
+		}
+		printf("%ld\n", code);
+	}
+
+	return 0;
+}